@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Every measurement is printed as a JSON object on its own line, so that the results of
+// two releases can be compared line by line
+namespace bench {
+
+using clock = std::chrono::steady_clock;
+
+#if defined(WIRECALL_BENCH_SINGLE_HEADER)
+inline constexpr std::string_view build = "single-header";
+#else
+inline constexpr std::string_view build = "regular";
+#endif
+
+// Each measurement runs for the number of seconds given as the first argument
+inline clock::duration duration_from_args(int argc, char ** argv) {
+    double seconds = argc > 1 ? std::atof(argv[1]) : 0.2;
+    return std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+struct stopwatch {
+    clock::time_point start = clock::now();
+
+    clock::duration elapsed() const {
+        return clock::now() - start;
+    }
+
+    double seconds() const {
+        return std::chrono::duration<double>(elapsed()).count();
+    }
+};
+
+// Latencies in microseconds
+struct latencies {
+    std::vector<double> samples;
+
+    void add(clock::duration latency) {
+        samples.push_back(std::chrono::duration<double, std::micro>(latency).count());
+    }
+
+    void merge(latencies const & other) {
+        samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+    }
+
+    double percentile(double q) {
+        if (samples.empty()) {
+            return 0;
+        }
+        std::sort(samples.begin(), samples.end());
+        auto index = std::min<size_t>(samples.size() - 1, static_cast<size_t>(q * samples.size()));
+        return samples[index];
+    }
+};
+
+struct record {
+  private:
+    std::ostringstream m_json;
+    bool m_empty = true;
+
+    void name(std::string_view name) {
+        m_json << (m_empty ? "{" : ",") << '"' << name << "\":";
+        m_empty = false;
+    }
+
+  public:
+    explicit record(std::string_view benchmark) {
+        field("benchmark", benchmark);
+        field("build", build);
+    }
+
+    record & field(std::string_view key, std::string_view value) {
+        name(key);
+        m_json << '"' << value << '"';
+        return *this;
+    }
+
+    template <typename T>
+        requires std::is_arithmetic_v<T>
+    record & field(std::string_view key, T value) {
+        name(key);
+        m_json << value;
+        return *this;
+    }
+
+    void print() {
+        std::cout << m_json.str() << "}" << std::endl;
+    }
+};
+
+}
@@ -0,0 +1,198 @@
+#include "bench.hpp"
+
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Round trips of an echo method between two endpoints in the same process, over a
+// loopback connection, for each transport, payload size, concurrency and pool size
+
+namespace {
+
+using endpoint_type = wirecall::ipc_endpoint<std::string>;
+
+asio::awaitable<void> serve(std::shared_ptr<endpoint_type> endpoint) {
+    try {
+        co_await endpoint->run();
+    } catch (...) {
+        // closed once the measurement is done
+    }
+}
+
+asio::awaitable<void> add_echo(std::shared_ptr<endpoint_type> endpoint) {
+    co_await endpoint->add_method("echo", [](std::span<uint8_t const> data) {
+        return std::vector<uint8_t>(data.begin(), data.end());
+    });
+}
+
+template <typename caller_type>
+asio::awaitable<void> caller(std::shared_ptr<caller_type> endpoint, std::vector<uint8_t> const & payload, bench::clock::time_point until, bench::latencies & latencies) {
+    while (bench::clock::now() < until) {
+        auto start = bench::clock::now();
+        auto echo = co_await endpoint->template call<std::vector<uint8_t>>("echo", std::span<uint8_t const>{payload});
+        latencies.add(bench::clock::now() - start);
+        if (echo.size() != payload.size()) {
+            throw std::runtime_error("Unexpected echo");
+        }
+    }
+}
+
+auto tcp_pair(asio::thread_pool & pool) {
+    asio::ip::tcp::acceptor acceptor{pool, {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::ip::tcp::socket client{pool};
+    client.connect(acceptor.local_endpoint());
+    asio::ip::tcp::socket server{pool};
+    acceptor.accept(server);
+    client.set_option(asio::ip::tcp::no_delay{true});
+    server.set_option(asio::ip::tcp::no_delay{true});
+    return std::pair{std::move(client), std::move(server)};
+}
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+auto unix_pair(asio::thread_pool & pool) {
+    asio::local::stream_protocol::socket client{pool};
+    asio::local::stream_protocol::socket server{pool};
+    asio::local::connect_pair(client, server);
+    return std::pair{std::move(client), std::move(server)};
+}
+#endif
+
+void report(std::string_view benchmark, std::string_view transport, size_t payload_size, size_t concurrency, size_t threads, size_t connections, double seconds, std::vector<bench::latencies> & latencies) {
+    bench::latencies all;
+    for (auto & caller_latencies : latencies) {
+        all.merge(caller_latencies);
+    }
+    auto calls = all.samples.size();
+
+    auto line = bench::record(benchmark);
+    line
+        .field("transport", transport)
+        .field("payload_bytes", payload_size)
+        .field("concurrency", concurrency)
+        .field("threads", threads);
+    if (connections > 0) {
+        line.field("connections", connections);
+    }
+    line
+        .field("calls", calls)
+        .field("seconds", seconds)
+        .field("calls_per_second", calls / seconds)
+        .field("megabytes_per_second", 2.0 * calls * payload_size / seconds / 1e6)
+        .field("p50_us", all.percentile(0.5))
+        .field("p90_us", all.percentile(0.9))
+        .field("p99_us", all.percentile(0.99))
+        .field("max_us", all.percentile(1.0))
+        .print();
+}
+
+template <typename make_pair_type>
+void measure(std::string_view transport, make_pair_type make_pair, size_t payload_size, size_t concurrency, size_t threads, bench::clock::duration duration) {
+    asio::thread_pool pool(threads);
+
+    auto [client_socket, server_socket] = make_pair(pool);
+    auto client = std::make_shared<endpoint_type>(std::move(client_socket));
+    auto server = std::make_shared<endpoint_type>(std::move(server_socket));
+
+    asio::co_spawn(pool, add_echo(server), asio::use_future).get();
+    asio::co_spawn(pool, serve(server), asio::detached);
+    asio::co_spawn(pool, serve(client), asio::detached);
+
+    std::vector<uint8_t> payload(payload_size, 0x5a);
+    std::vector<bench::latencies> latencies(concurrency);
+    std::vector<std::future<void>> callers;
+
+    bench::stopwatch watch;
+    for (size_t i = 0; i < concurrency; ++i) {
+        callers.push_back(asio::co_spawn(pool, caller(client, payload, watch.start + duration, latencies[i]), asio::use_future));
+    }
+    for (auto & done : callers) {
+        done.get();
+    }
+    auto seconds = watch.seconds();
+
+    asio::post(pool, [client, server]() {
+        client->close();
+        server->close();
+    });
+    pool.join();
+
+    report("call", transport, payload_size, concurrency, threads, 0, seconds, latencies);
+}
+
+// The same calls from a client striping them over several connections to a server
+void measure_striped(size_t payload_size, size_t concurrency, size_t threads, size_t connections, bench::clock::duration duration) {
+    using client_type = wirecall::ipc_client<std::string>;
+
+    wirecall::ipc_server<std::string>::method_registry methods;
+    methods.add("echo", [](std::span<uint8_t const> data) {
+        return std::vector<uint8_t>(data.begin(), data.end());
+    });
+    wirecall::ipc_server_options server_options;
+    server_options.threads = threads;
+    wirecall::ipc_server<std::string> server{{asio::ip::make_address("127.0.0.1"), 0}, std::move(methods), server_options};
+    std::thread server_thread{[&server]() {
+        server.run();
+    }};
+
+    asio::thread_pool pool(threads);
+    wirecall::ipc_client_options options;
+    options.connections = connections;
+    auto client = std::make_shared<client_type>(pool.get_executor(), options);
+    asio::co_spawn(pool, client->connect(server.local_endpoint()), asio::use_future).get();
+
+    std::vector<uint8_t> payload(payload_size, 0x5a);
+    std::vector<bench::latencies> latencies(concurrency);
+    std::vector<std::future<void>> callers;
+
+    bench::stopwatch watch;
+    for (size_t i = 0; i < concurrency; ++i) {
+        callers.push_back(asio::co_spawn(pool, caller(client, payload, watch.start + duration, latencies[i]), asio::use_future));
+    }
+    for (auto & done : callers) {
+        done.get();
+    }
+    auto seconds = watch.seconds();
+
+    asio::post(pool, [client]() {
+        client->close();
+    });
+    pool.join();
+    server.stop();
+    server_thread.join();
+
+    report("striped_call", "tcp", payload_size, concurrency, threads, connections, seconds, latencies);
+}
+
+}
+
+int main(int argc, char ** argv) {
+    auto duration = bench::duration_from_args(argc, argv);
+
+    for (size_t threads : {1, 4}) {
+        for (size_t concurrency : {1, 16}) {
+            for (size_t payload_size : {16, 1024, 64 * 1024}) {
+                measure("tcp", tcp_pair, payload_size, concurrency, threads, duration);
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+                measure("unix", unix_pair, payload_size, concurrency, threads, duration);
+#endif
+            }
+        }
+    }
+
+    for (size_t connections : {1, 2, 4}) {
+        measure_striped(1024, 16, 4, connections, duration);
+    }
+
+    return 0;
+}
@@ -0,0 +1,214 @@
+#include "bench.hpp"
+
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <future>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// The building blocks of a call, measured on their own
+
+namespace {
+
+using namespace std::literals;
+
+constexpr size_t round_size = 1000;
+
+void report(std::string_view benchmark, std::string_view variant, uint64_t ops, double seconds) {
+    bench::record(benchmark)
+        .field("variant", variant)
+        .field("ops", ops)
+        .field("seconds", seconds)
+        .field("ops_per_second", ops / seconds)
+        .field("ns_per_op", seconds * 1e9 / ops)
+        .print();
+}
+
+// A value sent and received right away, without suspending
+template <typename channel_type>
+asio::awaitable<void> channel_send_receive(std::string_view variant, bench::clock::duration duration) {
+    channel_type channel{co_await asio::this_coro::executor};
+    uint64_t ops = 0;
+    bench::stopwatch watch;
+    while (watch.elapsed() < duration) {
+        for (size_t i = 0; i < round_size; ++i) {
+            channel.try_send();
+            co_await channel.async_receive();
+        }
+        ops += round_size;
+    }
+    report("async_channel", variant, ops, watch.seconds());
+}
+
+// A value handed over to another coroutine waiting for it
+template <typename channel_type>
+asio::awaitable<void> channel_consumer(channel_type channel, channel_type done, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i) {
+        co_await channel.async_receive();
+    }
+    done.try_send();
+}
+
+template <typename channel_type>
+asio::awaitable<void> channel_handoff(std::string_view variant, uint64_t count) {
+    auto executor = co_await asio::this_coro::executor;
+    channel_type channel{executor};
+    channel_type done{executor};
+    asio::co_spawn(executor, channel_consumer(channel, done, count), asio::detached);
+    bench::stopwatch watch;
+    for (uint64_t i = 0; i < count; ++i) {
+        co_await channel.async_send();
+    }
+    co_await done.async_receive();
+    report("async_channel", variant, count, watch.seconds());
+}
+
+template <typename mutex_type>
+asio::awaitable<void> mutex_uncontended(std::string_view variant, bench::clock::duration duration) {
+    mutex_type mutex;
+    uint64_t ops = 0;
+    bench::stopwatch watch;
+    while (watch.elapsed() < duration) {
+        for (size_t i = 0; i < round_size; ++i) {
+            auto lock = co_await mutex.lock();
+        }
+        ops += round_size;
+    }
+    report("async_mutex", variant, ops, watch.seconds());
+}
+
+asio::awaitable<void> mutex_contender(wirecall::async_mutex & mutex, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i) {
+        auto lock = co_await mutex.lock();
+        // hold the lock across a suspension, so the others have to queue
+        co_await asio::post(co_await asio::this_coro::executor, asio::use_awaitable);
+    }
+}
+
+void mutex_contended(size_t threads, size_t contenders, uint64_t count) {
+    asio::thread_pool pool(threads);
+    wirecall::async_mutex mutex;
+    bench::stopwatch watch;
+    for (size_t i = 0; i < contenders; ++i) {
+        asio::co_spawn(pool, mutex_contender(mutex, count), asio::detached);
+    }
+    pool.join();
+    report("async_mutex", "contended", contenders * count, watch.seconds());
+}
+
+using message_type = std::tuple<int64_t, std::string, std::vector<double>>;
+
+asio::awaitable<void> codec(std::string_view variant, message_type message, bench::clock::duration duration) {
+    wirecall::byte_writer writer;
+    uint64_t ops = 0;
+    bench::stopwatch watch;
+    while (watch.elapsed() < duration) {
+        for (size_t i = 0; i < round_size; ++i) {
+            writer.clear();
+            co_await wirepump::write(writer, message);
+        }
+        ops += round_size;
+    }
+    report("serialize", variant, ops, watch.seconds());
+
+    ops = 0;
+    watch = {};
+    while (watch.elapsed() < duration) {
+        for (size_t i = 0; i < round_size; ++i) {
+            auto decoded = co_await wirecall::details::deserialize<message_type>(writer.data());
+            if (std::get<0>(decoded) != std::get<0>(message)) {
+                throw std::runtime_error("Unexpected message");
+            }
+        }
+        ops += round_size;
+    }
+    report("deserialize", variant, ops, watch.seconds());
+}
+
+// Frames written to and read from a buffered socket, over a loopback connection
+asio::awaitable<void> frame_reader(wirecall::connection & connection, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i) {
+        co_await connection.receive_frame();
+    }
+}
+
+asio::awaitable<void> frame_writer(wirecall::connection & connection, std::vector<uint8_t> const & payload, uint64_t count) {
+    for (uint64_t i = 0; i < count; ++i) {
+        co_await connection.send_frame(std::span<uint8_t const>{payload});
+    }
+}
+
+void buffered_socket(std::string_view variant, size_t payload_size, uint64_t count, bool coalescing) {
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::ip::tcp::socket client{ctx};
+    client.connect(acceptor.local_endpoint());
+    asio::ip::tcp::socket server{ctx};
+    acceptor.accept(server);
+
+    wirecall::connection writer{std::move(client)};
+    wirecall::connection reader{std::move(server)};
+    if (coalescing) {
+        writer.set_write_coalescing(wirecall::write_coalescing{});
+    }
+
+    std::vector<uint8_t> payload(payload_size, 0x5a);
+    bench::stopwatch watch;
+    asio::co_spawn(ctx, frame_writer(writer, payload, count), asio::detached);
+    asio::co_spawn(ctx, frame_reader(reader, count), asio::detached);
+    ctx.run();
+    auto seconds = watch.seconds();
+
+    bench::record("buffered_socket")
+        .field("variant", variant)
+        .field("payload_bytes", payload_size)
+        .field("frames", count)
+        .field("seconds", seconds)
+        .field("frames_per_second", count / seconds)
+        .field("megabytes_per_second", count * payload_size / seconds / 1e6)
+        .print();
+}
+
+asio::awaitable<void> single_threaded(bench::clock::duration duration) {
+    co_await channel_send_receive<wirecall::async_channel<>>("concurrent"sv, duration);
+    co_await channel_send_receive<wirecall::single_threaded_async_channel<>>("single_threaded"sv, duration);
+    co_await channel_handoff<wirecall::async_channel<>>("concurrent_handoff"sv, 20000);
+    co_await channel_handoff<wirecall::single_threaded_async_channel<>>("single_threaded_handoff"sv, 20000);
+
+    co_await mutex_uncontended<wirecall::async_mutex>("uncontended"sv, duration);
+    co_await mutex_uncontended<wirecall::single_threaded_async_mutex>("single_threaded_uncontended"sv, duration);
+
+    message_type small{42, "hello", std::vector<double>{1.0, 2.0}};
+    co_await codec("small"sv, small, duration);
+    message_type large{42, std::string(512, 'x'), std::vector<double>(64, 1.0)};
+    co_await codec("1kb"sv, large, duration);
+}
+
+}
+
+int main(int argc, char ** argv) {
+    auto duration = bench::duration_from_args(argc, argv);
+
+    {
+        asio::io_context ctx;
+        auto done = asio::co_spawn(ctx, single_threaded(duration), asio::use_future);
+        ctx.run();
+        done.get();
+    }
+
+    mutex_contended(4, 8, 20000);
+
+    buffered_socket("64b", 64, 200000, false);
+    buffered_socket("64b_coalesced", 64, 200000, true);
+    buffered_socket("64kb", 64 * 1024, 5000, false);
+
+    return 0;
+}
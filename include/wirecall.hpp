@@ -1,2 +1,6 @@
 #pragma once
 #include "wirecall/ipc.hpp"
+#include "wirecall/ipc_client.hpp"
+#include "wirecall/ipc_server.hpp"
+#include "wirecall/pubsub_broker.hpp"
+#include "wirecall/shm_socket.hpp"
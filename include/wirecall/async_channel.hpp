@@ -2,12 +2,14 @@
 
 #include <asio/awaitable.hpp>
 #include <asio/error_code.hpp>
+#include <asio/experimental/channel.hpp>
 #include <asio/experimental/concurrent_channel.hpp>
 #include <asio/use_awaitable.hpp>
 
 #include <concepts>
 #include <memory>
 #include <optional>
+#include <type_traits>
 #include <tuple>
 #include <utility>
 
@@ -15,6 +17,13 @@ namespace wirecall {
 
 template <template<typename, typename...> typename asio_channel_template, typename... Tp>
 struct basic_async_channel {
+  public:
+    // Whether it can be used from several threads at once
+    static constexpr bool concurrent = !std::is_same_v<
+        asio_channel_template<void(asio::error_code)>,
+        asio::experimental::channel<void(asio::error_code)>
+    >;
+
   private:
     inline static asio::error_code m_success{0, asio::system_category()};
 
@@ -67,4 +76,8 @@ struct basic_async_channel {
 template <typename... Tp>
 using async_channel = basic_async_channel<asio::experimental::concurrent_channel, Tp...>;
 
+// For endpoints running on a single thread, or a strand
+template <typename... Tp>
+using single_threaded_async_channel = basic_async_channel<asio::experimental::channel, Tp...>;
+
 }
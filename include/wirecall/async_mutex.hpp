@@ -1,77 +1,370 @@
 #pragma once
 
 #include "wirecall/async_channel.hpp"
+#include "wirecall/sync.hpp"
 
+#include <asio/associated_allocator.hpp>
+#include <asio/async_result.hpp>
 #include <asio/awaitable.hpp>
+#include <asio/post.hpp>
+#include <asio/use_awaitable.hpp>
 
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <utility>
 
 namespace wirecall {
 
+namespace details {
+
+// A coroutine suspended waiting for a lock. Waiters are linked intrusively, and
+// completing one posts its handler to the executor it is waiting on, already
+// owning the lock it asked for.
+struct async_waiter {
+    async_waiter * next = nullptr;
+    bool exclusive = true;
+    void (*on_complete)(async_waiter *);
+
+    void complete() {
+        on_complete(this);
+    }
+};
+
+template <typename handler_type>
+struct handler_waiter : async_waiter {
+  private:
+    using allocator_type = typename std::allocator_traits<
+        asio::associated_allocator_t<handler_type>
+    >::template rebind_alloc<handler_waiter>;
+
+    handler_type m_handler;
+
+    static void complete_handler(async_waiter * waiter) {
+        auto self = static_cast<handler_waiter *>(waiter);
+        auto handler = std::move(self->m_handler);
+        allocator_type allocator{asio::get_associated_allocator(handler)};
+        std::allocator_traits<allocator_type>::destroy(allocator, self);
+        std::allocator_traits<allocator_type>::deallocate(allocator, self, 1);
+        asio::post(std::move(handler));
+    }
+
+  public:
+    handler_waiter(handler_type handler, bool exclusive)
+      : async_waiter{nullptr, exclusive, &complete_handler}
+      , m_handler{std::move(handler)}
+    {}
+
+    static async_waiter * make(handler_type handler, bool exclusive) {
+        allocator_type allocator{asio::get_associated_allocator(handler)};
+        auto self = std::allocator_traits<allocator_type>::allocate(allocator, 1);
+        return std::construct_at(self, std::move(handler), exclusive);
+    }
+};
+
+// Suspends until `enqueue` hands the waiter over to a mutex. It returns false when
+// the lock could be taken right away, and the waiter is completed straight away.
+template <typename enqueue_type>
+asio::awaitable<void> async_wait_lock(bool exclusive, enqueue_type && enqueue) {
+    co_await asio::async_initiate<decltype(asio::use_awaitable) const &, void()>(
+        [exclusive, &enqueue](auto handler) {
+            auto waiter = handler_waiter<decltype(handler)>::make(std::move(handler), exclusive);
+            if (!enqueue(waiter)) {
+                waiter->complete();
+            }
+        },
+        asio::use_awaitable
+    );
+}
+
+template <typename mutex_type, bool exclusive>
+struct [[nodiscard]] async_lock_guard {
+  private:
+    mutex_type * m_mutex;
+    async_lock_guard(mutex_type * mutex) : m_mutex(mutex) {}
+    friend mutex_type;
+
+  public:
+    async_lock_guard() = delete;
+    async_lock_guard(async_lock_guard const &) = delete;
+    async_lock_guard(async_lock_guard && other)
+      : m_mutex{std::exchange(other.m_mutex, nullptr)}
+    {}
+
+    ~async_lock_guard() {
+        std::move(*this).unlock();
+    }
+
+    // Lets go of the mutex before unlocking it, the owner may be resumed elsewhere as
+    // soon as it is unlocked
+    void unlock() && {
+        auto mutex = std::exchange(m_mutex, nullptr);
+        if (!mutex) return;
+        if constexpr (exclusive) {
+            mutex->unlock();
+        } else {
+            mutex->unlock_shared();
+        }
+    }
+
+    bool owned_by(mutex_type const & owner) const {
+        return m_mutex == &owner;
+    }
+};
+
+}
+
+// The state word is either unlocked, locked, or the head of a stack of the waiters
+// that arrived since the last unlock. The owner moves that stack to a private list
+// in arrival order, and unlocking hands the lock straight to the first waiter.
+// Taking a free lock neither suspends nor allocates.
 template <template<typename...> typename channel_type>
 struct basic_async_mutex {
+  public:
+    using async_lock = details::async_lock_guard<basic_async_mutex, true>;
+
   private:
-    channel_type<> m_channel;
+    using sync = details::sync_traits<channel_type>;
+
+    static constexpr uintptr_t locked = 0;
+    static constexpr uintptr_t not_locked = 1;
+
+    typename sync::template atomic<uintptr_t> m_state = not_locked;
+    // only touched by the owner of the lock
+    details::async_waiter * m_waiters = nullptr;
 
   public:
-    struct [[nodiscard]] async_lock {
-      protected:
-        basic_async_mutex * m_mutex;
-        async_lock(basic_async_mutex * mutex) : m_mutex(mutex) {}
-        friend struct basic_async_mutex;
-    
-      public:
-        async_lock() = delete;
-        async_lock(async_lock &) = delete;
-        async_lock(async_lock const &) = delete;
-        async_lock(async_lock && other) {
-            m_mutex = other.m_mutex;
-            other.m_mutex = nullptr;
+    basic_async_mutex() = default;
+
+    // Same constructor as the other executor bound primitives
+    template <typename executor_type>
+    basic_async_mutex(executor_type const &) {}
+
+    basic_async_mutex(basic_async_mutex const &) = delete;
+
+    std::optional<async_lock> try_lock() {
+        if (try_acquire()) {
+            return async_lock(this);
         }
+        return std::nullopt;
+    }
 
-        ~async_lock() {
-            std::move(*this).unlock();
+    asio::awaitable<async_lock> lock() {
+        if (!try_acquire()) {
+            co_await details::async_wait_lock(true, [this](details::async_waiter * waiter) {
+                return try_lock_or_enqueue(waiter);
+            });
         }
+        co_return async_lock(this);
+    }
+
+  private:
+    bool try_acquire() {
+        auto state = not_locked;
+        return m_state.compare_exchange_strong(state, locked, std::memory_order_acquire, std::memory_order_relaxed);
+    }
 
-        void unlock() && {
-            if (m_mutex) m_mutex->unlock();
-            m_mutex = nullptr;
+    // Returns false when it took the lock instead of queuing the waiter
+    bool try_lock_or_enqueue(details::async_waiter * waiter) {
+        auto state = m_state.load(std::memory_order_acquire);
+        while (true) {
+            if (state == not_locked) {
+                if (m_state.compare_exchange_weak(state, locked, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    return false;
+                }
+            } else {
+                waiter->next = reinterpret_cast<details::async_waiter *>(state);
+                if (m_state.compare_exchange_weak(state, reinterpret_cast<uintptr_t>(waiter), std::memory_order_release, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
         }
+    }
+
+    void unlock() {
+        assert(m_state.load(std::memory_order_relaxed) != not_locked);
+
+        auto head = m_waiters;
+        if (!head) {
+            auto state = locked;
+            if (m_state.compare_exchange_strong(state, not_locked, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
 
-        bool owned_by(basic_async_mutex const & owner) const {
-            return m_mutex == &owner;
+            // reverse the newly arrived waiters into arrival order
+            auto waiter = reinterpret_cast<details::async_waiter *>(m_state.exchange(locked, std::memory_order_acquire));
+            while (waiter) {
+                auto next = waiter->next;
+                waiter->next = head;
+                head = waiter;
+                waiter = next;
+            }
         }
-    };
 
-    template <typename executor_type>
-    basic_async_mutex(executor_type const & executor)
-      : m_channel{executor}
-    {
-        unlock();
+        m_waiters = head->next;
+        head->complete();
     }
 
+    friend async_lock;
+};
+
+using async_mutex = basic_async_mutex<async_channel>;
+
+using single_threaded_async_mutex = basic_async_mutex<single_threaded_async_channel>;
+
+// Readers share the lock, writers own it alone. Waiters are served in arrival order,
+// a waiting writer holds back the readers that arrive after it. Taking a free lock
+// is a single atomic operation, the queue is only locked when somebody has to wait.
+template <template<typename...> typename channel_type>
+struct basic_async_shared_mutex {
+  public:
+    using async_lock = details::async_lock_guard<basic_async_shared_mutex, true>;
+    using async_shared_lock = details::async_lock_guard<basic_async_shared_mutex, false>;
+
+  private:
+    using sync = details::sync_traits<channel_type>;
+
+    // the number of readers is kept above the flags
+    static constexpr uintptr_t writer = 1;
+    static constexpr uintptr_t waiting = 2;
+    static constexpr uintptr_t reader = 4;
+
+    typename sync::template atomic<uintptr_t> m_state = 0;
+
+    typename sync::mutex m_waiters_mutex;
+    details::async_waiter * m_head = nullptr;
+    details::async_waiter * m_tail = nullptr;
+
+  public:
+    basic_async_shared_mutex() = default;
+
+    template <typename executor_type>
+    basic_async_shared_mutex(executor_type const &) {}
+
+    basic_async_shared_mutex(basic_async_shared_mutex const &) = delete;
+
     std::optional<async_lock> try_lock() {
-        if (m_channel.try_receive()) {
+        if (try_acquire()) {
             return async_lock(this);
         }
         return std::nullopt;
     }
 
+    std::optional<async_shared_lock> try_lock_shared() {
+        if (try_acquire_shared()) {
+            return async_shared_lock(this);
+        }
+        return std::nullopt;
+    }
+
     asio::awaitable<async_lock> lock() {
-        co_await m_channel.async_receive();
+        if (!try_acquire()) {
+            co_await details::async_wait_lock(true, [this](details::async_waiter * waiter) {
+                return try_lock_or_enqueue(waiter);
+            });
+        }
         co_return async_lock(this);
     }
 
+    asio::awaitable<async_shared_lock> lock_shared() {
+        if (!try_acquire_shared()) {
+            co_await details::async_wait_lock(false, [this](details::async_waiter * waiter) {
+                return try_lock_or_enqueue(waiter);
+            });
+        }
+        co_return async_shared_lock(this);
+    }
+
   private:
+    bool try_acquire() {
+        uintptr_t state = 0;
+        return m_state.compare_exchange_strong(state, writer, std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    bool try_acquire_shared() {
+        auto state = m_state.load(std::memory_order_relaxed);
+        while (!(state & (writer | waiting))) {
+            if (m_state.compare_exchange_weak(state, state + reader, std::memory_order_acquire, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool available(uintptr_t state, bool exclusive) {
+        return exclusive ? state == 0 : !(state & (writer | waiting));
+    }
+
+    bool try_lock_or_enqueue(details::async_waiter * waiter) {
+        std::lock_guard lock{m_waiters_mutex};
+
+        // once the waiting flag is set all the releases go through the queue
+        auto state = m_state.load(std::memory_order_relaxed);
+        while (true) {
+            if (available(state, waiter->exclusive)) {
+                auto next = state + (waiter->exclusive ? writer : reader);
+                if (m_state.compare_exchange_weak(state, next, std::memory_order_acquire, std::memory_order_relaxed)) {
+                    return false;
+                }
+            } else if (state & waiting) {
+                break;
+            } else if (m_state.compare_exchange_weak(state, state | waiting, std::memory_order_relaxed, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        waiter->next = nullptr;
+        (m_tail ? m_tail->next : m_head) = waiter;
+        m_tail = waiter;
+        return true;
+    }
+
     void unlock() {
-        auto tf = m_channel.try_send();
-        assert(tf);
+        uintptr_t state = writer;
+        if (m_state.compare_exchange_strong(state, 0, std::memory_order_release, std::memory_order_relaxed)) {
+            return;
+        }
+        std::lock_guard lock{m_waiters_mutex};
+        m_state.fetch_sub(writer, std::memory_order_release);
+        wake();
+    }
+
+    void unlock_shared() {
+        // only the last reader out wakes the waiters
+        if (m_state.fetch_sub(reader, std::memory_order_release) != (reader | waiting)) {
+            return;
+        }
+        std::lock_guard lock{m_waiters_mutex};
+        wake();
     }
 
-    friend struct async_lock;
+    // Hands the lock to the waiters at the front of the queue that can take it
+    void wake() {
+        while (m_head) {
+            auto state = m_state.load(std::memory_order_acquire);
+            if ((state & writer) || (m_head->exclusive && state >= reader)) {
+                return;
+            }
+
+            auto waiter = m_head;
+            m_head = waiter->next;
+            if (!m_head) {
+                m_tail = nullptr;
+                m_state.fetch_sub(waiting, std::memory_order_relaxed);
+            }
+            m_state.fetch_add(waiter->exclusive ? writer : reader, std::memory_order_acquire);
+            waiter->complete();
+        }
+    }
+
+    friend async_lock;
+    friend async_shared_lock;
 };
 
-using async_mutex = basic_async_mutex<async_channel>;
+using async_shared_mutex = basic_async_shared_mutex<async_channel>;
+
+using single_threaded_async_shared_mutex = basic_async_shared_mutex<single_threaded_async_channel>;
 
 }
@@ -1,20 +1,32 @@
 #pragma once
 
+#include "wirecall/codec.hpp"
+#include "wirecall/frame.hpp"
+
 #include "wirepump.hpp"
 
 #include <asio/any_io_executor.hpp>
 #include <asio/awaitable.hpp>
 #include <asio/buffer.hpp>
+#include <asio/read.hpp>
 #include <asio/use_awaitable.hpp>
 #include <asio/write.hpp>
 
+#include <algorithm>
+#include <array>
 #include <concepts>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <limits>
 #include <memory>
-#include <sstream>
+#include <span>
+#include <stdexcept>
 #include <string_view>
 #include <string>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace wirecall {
 
@@ -27,56 +39,378 @@ template <typename socket_type>
         { socket.cancel() } -> std::same_as<void>;
     }
 struct buffered_socket {
+  public:
+    static constexpr size_t default_read_ahead = 16 * 1024;
+    static constexpr size_t max_spare_write_buffers = 64;
+    static constexpr size_t default_max_frame = 64 * 1024 * 1024;
+
   private:
     socket_type m_socket;
-    std::stringstream m_write_buffer;
-    std::stringstream m_read_buffer;
+
+    // Writes land in m_write_buffer until commit() queues it in the lane of its priority.
+    // Queued buffers are staged lane by lane and sent together in a single gather write,
+    // then recycled as spares. A frame larger than m_max_fragment is staged one fragment
+    // at a time, its buffer staying at the front of its lane until it is fully staged.
+    std::vector<uint8_t> m_write_buffer;
+    size_t m_frame_begin = 0;
+    std::array<std::vector<std::vector<uint8_t>>, details::fragment_header::lanes> m_write_queues;
+    // where the next fragment starts in the buffer at the front of each lane, and how
+    // much is left of the frame being fragmented
+    std::array<size_t, details::fragment_header::lanes> m_queue_offsets = {};
+    std::array<size_t, details::fragment_header::lanes> m_fragment_left = {};
+    size_t m_write_queue_bytes = 0;
+    // bytes committed to, and staged from, each lane since the socket was created, which
+    // tells a sender when what it committed went out
+    std::array<uint64_t, details::fragment_header::lanes> m_committed_bytes = {};
+    std::array<uint64_t, details::fragment_header::lanes> m_staged_bytes = {};
+    size_t m_max_fragment = details::fragment_header::max_length;
+    std::vector<std::vector<uint8_t>> m_staged;
+    std::vector<asio::const_buffer> m_staged_buffers;
+    std::deque<std::array<uint8_t, frame_length_size>> m_staged_headers;
+    std::vector<std::vector<uint8_t>> m_spare_write_buffers;
+
+    // Unread bytes live in [m_read_begin, m_read_end). The window rewinds to the
+    // front of the storage whenever it drains, and is compacted before refilling.
+    std::vector<uint8_t> m_read_buffer;
+    size_t m_read_begin = 0;
+    size_t m_read_end = 0;
+    size_t m_read_ahead;
+
+    // the fragments received so far of the frame in progress in each lane
+    std::array<std::vector<uint8_t>, details::fragment_header::lanes> m_partial_frames;
+    // largest frame body read, fragments included, before giving up on the peer
+    size_t m_max_frame = default_max_frame;
 
   public:
     template <typename other_socket_type>
         requires requires (other_socket_type socket) {
             socket_type{std::move(socket)};
         }
-    buffered_socket(other_socket_type socket) : m_socket{std::move(socket)} {}
+    buffered_socket(other_socket_type socket, size_t read_ahead = default_read_ahead)
+      : m_socket{std::move(socket)}
+      , m_read_ahead{std::max<size_t>(read_ahead, 1)}
+    {}
+
+    size_t read_ahead() const { return m_read_ahead; }
+    void set_read_ahead(size_t read_ahead) { m_read_ahead = std::max<size_t>(read_ahead, 1); }
+
+    // A peer sending a larger frame body is disconnected
+    void set_max_frame(size_t max_frame) {
+        m_max_frame = std::clamp<size_t>(max_frame, 1, std::numeric_limits<uint32_t>::max());
+    }
+
+    size_t max_frame() const { return m_max_frame; }
+
+    // Frames with a larger body are written in fragments, zero for the largest ones possible
+    void set_max_fragment(size_t max_fragment) {
+        m_max_fragment = std::clamp<size_t>(max_fragment ? max_fragment : details::fragment_header::max_length, 1, details::fragment_header::max_length);
+    }
+
+    std::span<uint8_t const> buffered() const {
+        return {m_read_buffer.data() + m_read_begin, m_read_end - m_read_begin};
+    }
+
+    void consume(size_t n) {
+        m_read_begin += n;
+        if (m_read_begin == m_read_end) {
+            m_read_begin = m_read_end = 0;
+        }
+    }
+
+    // Ensure at least `n` bytes are buffered, reading ahead as much as the socket has available.
+    asio::awaitable<void> fill(size_t n) {
+        while (m_read_end - m_read_begin < n) {
+            size_t wanted = std::max(n - (m_read_end - m_read_begin), m_read_ahead);
+            if (m_read_buffer.size() - m_read_end < wanted) {
+                if (m_read_end != m_read_begin) {
+                    std::memmove(m_read_buffer.data(), m_read_buffer.data() + m_read_begin, m_read_end - m_read_begin);
+                }
+                m_read_end -= m_read_begin;
+                m_read_begin = 0;
+                if (m_read_buffer.size() - m_read_end < wanted) {
+                    m_read_buffer.resize(m_read_end + wanted);
+                }
+            }
+            m_read_end += co_await m_socket.async_read_some(
+                asio::buffer(m_read_buffer.data() + m_read_end, m_read_buffer.size() - m_read_end),
+                asio::use_awaitable
+            );
+        }
+    }
 
     asio::awaitable<void> read(uint8_t & c) {
-        c = m_read_buffer.get();
-        while (m_read_buffer.eof()) {
-            std::string buffer(1024, '\0');
-            auto n = co_await m_socket.async_read_some(asio::buffer(buffer.data(), buffer.size()), asio::use_awaitable);
-            buffer.resize(n);
-            m_read_buffer.str(std::move(buffer));
-            m_read_buffer.clear();
-            c = m_read_buffer.get();
+        if (m_read_begin == m_read_end) {
+            co_await fill(1);
         }
+        c = m_read_buffer[m_read_begin];
+        consume(1);
     }
+
+    asio::awaitable<void> read(std::span<uint8_t> data) {
+        if (auto n = std::min(data.size(), m_read_end - m_read_begin)) {
+            std::memcpy(data.data(), m_read_buffer.data() + m_read_begin, n);
+            consume(n);
+            data = data.subspan(n);
+        }
+
+        if (data.empty()) {
+            co_return;
+        } else if (data.size() >= m_read_ahead) {
+            // Large reads bypass the buffer and land directly in their destination
+            co_await asio::async_read(m_socket, asio::buffer(data.data(), data.size()), asio::use_awaitable);
+        } else {
+            co_await fill(data.size());
+            std::memcpy(data.data(), m_read_buffer.data() + m_read_begin, data.size());
+            consume(data.size());
+        }
+    }
+
     asio::awaitable<void> write(uint8_t const & c) {
-        m_write_buffer.put(c);
+        m_write_buffer.push_back(c);
+        co_return;
+    }
+
+    asio::awaitable<void> write(std::span<uint8_t const> data) {
+        m_write_buffer.insert(m_write_buffer.end(), data.begin(), data.end());
         co_return;
     }
+
+    // Offset of the write position from the start of the current frame body
+    size_t position() const {
+        return m_write_buffer.size() - m_frame_begin - frame_length_size;
+    }
+
+    // Reserve room for the length of a frame whose body is written next
+    void begin_frame() {
+        m_frame_begin = m_write_buffer.size();
+        m_write_buffer.resize(m_frame_begin + frame_length_size);
+    }
+
+    void end_frame() {
+        auto length = m_write_buffer.size() - m_frame_begin - frame_length_size;
+        if (length > std::numeric_limits<uint32_t>::max()) {
+            abort_frame();
+            throw std::length_error("Frame too large");
+        }
+        for (size_t i = 0; i < frame_length_size; ++i) {
+            m_write_buffer[m_frame_begin + i] = (length >> (8 * i)) & 0xff;
+        }
+    }
+
+    // Drop a partially written frame
+    void abort_frame() {
+        m_write_buffer.resize(m_frame_begin);
+    }
+
+    asio::awaitable<frame> read_frame() {
+        using header_type = details::fragment_header;
+
+        while (true) {
+            std::array<uint8_t, frame_length_size> header;
+            co_await read(std::span<uint8_t>{header});
+            uint32_t value = 0;
+            for (size_t i = 0; i < frame_length_size; ++i) {
+                value |= uint32_t(header[i]) << (8 * i);
+            }
+
+            size_t length = value & header_type::max_length;
+            size_t lane_index = (value >> header_type::lane_shift) & 3;
+            if (lane_index >= header_type::lanes) {
+                throw std::runtime_error("Invalid frame lane");
+            }
+            auto lane = static_cast<priority>(lane_index);
+            auto & partial = m_partial_frames[lane_index];
+
+            // checked before allocating anything for it
+            if (length > m_max_frame || partial.size() > m_max_frame - length) {
+                cancel();
+                close();
+                throw std::length_error("Frame larger than the limit");
+            }
+
+            if (!(value & header_type::more) && partial.empty()) {
+                auto data = details::frame_buffer_pool::acquire(length);
+                co_await read(std::span<uint8_t>{data});
+                co_return frame{std::move(data), lane};
+            }
+
+            auto size = partial.size();
+            if (size == 0) {
+                partial = details::frame_buffer_pool::acquire(0);
+            }
+            partial.resize(size + length);
+            co_await read(std::span<uint8_t>{partial}.subspan(size));
+
+            if (!(value & header_type::more)) {
+                co_return frame{std::exchange(partial, {}), lane};
+            }
+        }
+    }
+
+    void commit(priority lane = priority::normal) {
+        if (m_write_buffer.empty()) {
+            return;
+        }
+        m_write_queue_bytes += m_write_buffer.size();
+        m_committed_bytes[static_cast<size_t>(lane)] += m_write_buffer.size();
+        m_write_queues[static_cast<size_t>(lane)].push_back(std::move(m_write_buffer));
+        if (!m_spare_write_buffers.empty()) {
+            m_write_buffer = std::move(m_spare_write_buffers.back());
+            m_spare_write_buffers.pop_back();
+        } else {
+            m_write_buffer = {};
+        }
+    }
+
+    size_t pending_bytes() const {
+        return m_write_queue_bytes;
+    }
+
+    uint64_t committed_bytes(priority lane) const {
+        return m_committed_bytes[static_cast<size_t>(lane)];
+    }
+
+    uint64_t staged_bytes(priority lane) const {
+        return m_staged_bytes[static_cast<size_t>(lane)];
+    }
+
+    // Move committed frames, up to `max_bytes` (but at least one fragment), to the staging
+    // area, higher priorities first, recycling the previously staged buffers. Returns the
+    // number of bytes staged. Staging and committing must be serialized by the caller,
+    // while write_staged() can run concurrently with further writes and commits.
+    size_t stage_pending(size_t max_bytes = std::numeric_limits<size_t>::max()) {
+        for (auto & buffer : m_staged) {
+            if (m_spare_write_buffers.size() < max_spare_write_buffers) {
+                buffer.clear();
+                m_spare_write_buffers.push_back(std::move(buffer));
+            }
+        }
+        m_staged.clear();
+        m_staged_buffers.clear();
+        m_staged_headers.clear();
+
+        size_t staged_bytes = 0;
+        for (auto lane : {priority::high, priority::normal, priority::low}) {
+            if (!stage_lane(lane, max_bytes, staged_bytes)) {
+                break;
+            }
+        }
+        return staged_bytes;
+    }
+
+    asio::awaitable<void> write_staged() {
+        co_await asio::async_write(m_socket, m_staged_buffers, asio::use_awaitable);
+    }
+
+    // Writes the buffers as they are, bypassing the write queue, for frames encoded once
+    // and shared by many sockets. Must not run concurrently with other writes.
+    template <typename buffers_type>
+    asio::awaitable<void> write_buffers(buffers_type const & buffers) {
+        co_await asio::async_write(m_socket, buffers, asio::use_awaitable);
+    }
+
     asio::awaitable<void> flush() {
-        std::string buffer = m_write_buffer.str();
-        co_await asio::async_write(m_socket, asio::buffer(buffer.data(), buffer.size()), asio::use_awaitable);
-        m_write_buffer.str("");
+        commit();
+        while (stage_pending()) {
+            co_await write_staged();
+        }
     }
+
     bool is_open() const { return m_socket.is_open(); }
     void close() { m_socket.close(); }
     void cancel() { m_socket.cancel(); }
     auto get_executor() { return m_socket.get_executor(); }
+
+  private:
+    // Returns false once `max_bytes` are staged
+    bool stage_lane(priority lane, size_t max_bytes, size_t & staged_bytes) {
+        auto index = static_cast<size_t>(lane);
+        auto & queue = m_write_queues[index];
+        auto & offset = m_queue_offsets[index];
+        auto & left = m_fragment_left[index];
+
+        while (!queue.empty()) {
+            auto & buffer = queue.front();
+
+            // a frame starts with the header end_frame() wrote, which is left out when
+            // the frame is sent with headers of its own
+            bool starting = left == 0;
+            auto body = starting ? offset + frame_length_size : offset;
+            size_t remaining = left;
+            if (starting) {
+                for (size_t i = 0; i < frame_length_size; ++i) {
+                    remaining |= size_t(buffer[offset + i]) << (8 * i);
+                }
+            }
+
+            auto n = std::min(remaining, m_max_fragment);
+            auto size = frame_length_size + n;
+            if (staged_bytes > 0 && staged_bytes + size > max_bytes) {
+                return false;
+            }
+
+            if (starting && n == remaining && lane == priority::normal) {
+                m_staged_buffers.push_back(asio::buffer(buffer.data() + offset, size));
+            } else {
+                auto header = details::fragment_header::encode(n, lane, n < remaining);
+                auto & bytes = m_staged_headers.emplace_back();
+                for (size_t i = 0; i < frame_length_size; ++i) {
+                    bytes[i] = (header >> (8 * i)) & 0xff;
+                }
+                m_staged_buffers.push_back(asio::buffer(bytes));
+                m_staged_buffers.push_back(asio::buffer(buffer.data() + body, n));
+            }
+
+            m_write_queue_bytes -= body + n - offset;
+            m_staged_bytes[index] += body + n - offset;
+            staged_bytes += size;
+            offset = body + n;
+            left = remaining - n;
+
+            if (offset == buffer.size()) {
+                m_staged.push_back(std::move(buffer));
+                queue.erase(queue.begin());
+                offset = 0;
+            }
+        }
+        return true;
+    }
 };
 
 }
 
+template <typename socket_type, typename T>
+    requires std::is_arithmetic_v<T>
+struct wirepump::read_impl<wirecall::buffered_socket<socket_type>, T> : wirecall::details::codec<T> {};
+
+template <typename socket_type, typename T>
+    requires std::is_arithmetic_v<T>
+struct wirepump::write_impl<wirecall::buffered_socket<socket_type>, T> : wirecall::details::codec<T> {};
+
+template <typename socket_type>
+struct wirepump::read_impl<wirecall::buffered_socket<socket_type>, std::string> : wirecall::details::codec<std::string> {};
+
 template <typename socket_type>
-struct wirepump::read_impl<wirecall::buffered_socket<socket_type>, uint8_t> {
-    static auto read(wirecall::buffered_socket<socket_type> & socket, uint8_t & c) -> asio::awaitable<void> {
-        co_await socket.read(c);
+struct wirepump::write_impl<wirecall::buffered_socket<socket_type>, std::string> : wirecall::details::codec<std::string> {};
+
+template <typename socket_type>
+struct wirepump::write_impl<wirecall::buffered_socket<socket_type>, std::string_view> : wirecall::details::codec<std::string_view> {};
+
+template <typename socket_type, wirecall::details::byte_type T>
+struct wirepump::read_impl<wirecall::buffered_socket<socket_type>, std::vector<T>> : wirecall::details::codec<std::vector<T>> {};
+
+template <typename socket_type, wirecall::details::array_element_type T>
+struct wirepump::write_impl<wirecall::buffered_socket<socket_type>, std::vector<T>> {
+    static auto write(wirecall::buffered_socket<socket_type> & socket, std::vector<T> const & value) {
+        return wirecall::details::codec<std::vector<T>>::write(socket, std::span<T const>{value});
     }
 };
 
-template <typename socket_type>
-struct wirepump::write_impl<wirecall::buffered_socket<socket_type>, uint8_t> {
-    static auto write(wirecall::buffered_socket<socket_type> & socket, uint8_t const & c) -> asio::awaitable<void> {
-        co_await socket.write(c);
+template <typename socket_type, typename T>
+    requires wirecall::details::array_element_type<std::remove_const_t<T>>
+struct wirepump::write_impl<wirecall::buffered_socket<socket_type>, std::span<T>> {
+    static auto write(wirecall::buffered_socket<socket_type> & socket, std::span<T> const & value) {
+        using element_type = std::remove_const_t<T>;
+        return wirecall::details::codec<std::span<element_type const>>::write(socket, std::span<element_type const>{value});
     }
 };
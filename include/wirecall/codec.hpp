@@ -0,0 +1,253 @@
+#pragma once
+
+#include <asio/awaitable.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace wirecall::details {
+
+// Bulk encoding for streams exposing `read(std::span<uint8_t>)`, `write(std::span<uint8_t const>)`,
+// `buffered()` and `consume(n)`. Integers wider than a byte are LEB128 varints of their value
+// widened to 64 bits, so a value can be decoded into any integer type able to represent it.
+// Everything else is copied as little endian raw bytes.
+
+template <typename T>
+concept varint_type = std::integral<T> && (sizeof(T) > 1);
+
+template <typename T>
+concept raw_type = std::is_arithmetic_v<T> && !varint_type<T>;
+
+template <typename T>
+concept byte_type = sizeof(T) == 1 && std::is_trivially_copyable_v<T>;
+
+// Arrays of these are copied as raw little endian elements, aligned relative to the
+// start of the frame so they can be viewed in place on the receiving side.
+template <typename T>
+concept array_element_type = (std::is_arithmetic_v<T> || byte_type<T>) && !std::same_as<T, bool>;
+
+template <typename T>
+size_t array_padding(size_t position) {
+    return (alignof(T) - position % alignof(T)) % alignof(T);
+}
+
+template <typename T>
+auto as_bytes(T * data, size_t size) {
+    if constexpr (std::is_const_v<T>) {
+        return std::span<uint8_t const>{reinterpret_cast<uint8_t const *>(data), size * sizeof(T)};
+    } else {
+        return std::span<uint8_t>{reinterpret_cast<uint8_t *>(data), size * sizeof(T)};
+    }
+}
+
+template <typename stream_type>
+asio::awaitable<void> write_varint(stream_type & stream, uint64_t value) {
+    std::array<uint8_t, 10> buffer;
+    size_t n = 0;
+    do {
+        buffer[n] = value & 0x7f;
+        value >>= 7;
+        if (value) buffer[n] |= 0x80;
+        ++n;
+    } while (value);
+    co_await stream.write(std::span<uint8_t const>{buffer.data(), n});
+}
+
+// Decodes a varint without suspending, if it is already buffered
+template <typename stream_type>
+std::optional<uint64_t> read_buffered_varint(stream_type & stream) {
+    uint64_t value = 0;
+
+    auto data = stream.buffered();
+    for (size_t i = 0; i < data.size() && i < 10; ++i) {
+        value |= uint64_t(data[i] & 0x7f) << (7 * i);
+        if (!(data[i] & 0x80)) {
+            stream.consume(i + 1);
+            return value;
+        }
+    }
+
+    return std::nullopt;
+}
+
+template <typename stream_type>
+asio::awaitable<uint64_t> read_varint(stream_type & stream) {
+    if (auto value = read_buffered_varint(stream)) {
+        co_return *value;
+    }
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < 10; ++i) {
+        uint8_t byte;
+        co_await stream.read(std::span<uint8_t>{&byte, 1});
+        value |= uint64_t(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            co_return value;
+        }
+    }
+
+    throw std::runtime_error("Malformed varint in stream");
+}
+
+template <typename T>
+struct codec;
+
+template <varint_type T>
+struct codec<T> {
+    template <typename stream_type>
+    static asio::awaitable<void> read(stream_type & stream, T & value) {
+        uint64_t raw = co_await read_varint(stream);
+        if constexpr (std::is_signed_v<T>) {
+            auto wide = static_cast<int64_t>(raw);
+            if (wide < std::numeric_limits<T>::min() || wide > std::numeric_limits<T>::max()) {
+                throw std::runtime_error("Integer out of range");
+            }
+            value = static_cast<T>(wide);
+        } else {
+            if (raw > std::numeric_limits<T>::max()) {
+                throw std::runtime_error("Integer out of range");
+            }
+            value = static_cast<T>(raw);
+        }
+    }
+
+    template <typename stream_type>
+    static asio::awaitable<void> write(stream_type & stream, T const & value) {
+        if constexpr (std::is_signed_v<T>) {
+            co_await write_varint(stream, static_cast<uint64_t>(static_cast<int64_t>(value)));
+        } else {
+            co_await write_varint(stream, static_cast<uint64_t>(value));
+        }
+    }
+};
+
+template <raw_type T>
+struct codec<T> {
+    template <typename stream_type>
+    static asio::awaitable<void> read(stream_type & stream, T & value) {
+        if (auto data = stream.buffered(); data.size() >= sizeof(T)) {
+            std::memcpy(&value, data.data(), sizeof(T));
+            stream.consume(sizeof(T));
+        } else {
+            co_await stream.read(as_bytes(&value, 1));
+        }
+        if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1) {
+            auto bytes = as_bytes(&value, 1);
+            std::reverse(bytes.begin(), bytes.end());
+        }
+    }
+
+    template <typename stream_type>
+    static asio::awaitable<void> write(stream_type & stream, T const & value) {
+        if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1) {
+            T swapped = value;
+            auto bytes = as_bytes(&swapped, 1);
+            std::reverse(bytes.begin(), bytes.end());
+            co_await stream.write(bytes);
+        } else {
+            co_await stream.write(as_bytes(&value, 1));
+        }
+    }
+};
+
+// Elements allocated ahead of the bytes arriving, when the stream can't tell how many are left
+inline constexpr size_t max_unchecked_read = 64 * 1024;
+
+// Reads `size` raw elements, never allocating for more than the peer actually sends
+template <typename T, typename stream_type>
+asio::awaitable<void> read_elements(stream_type & stream, T & value, uint64_t size) {
+    constexpr size_t element_size = sizeof(typename T::value_type);
+    if constexpr (requires { { stream.remaining() } -> std::convertible_to<size_t>; }) {
+        if (size > stream.remaining() / element_size) {
+            throw std::runtime_error("Sequence longer than the rest of the frame");
+        }
+        value.resize(size);
+        co_await stream.read(as_bytes(value.data(), value.size()));
+    } else {
+        value.clear();
+        while (value.size() < size) {
+            auto offset = value.size();
+            auto n = std::min<uint64_t>(size - offset, std::max<size_t>(offset, max_unchecked_read / element_size));
+            value.resize(offset + n);
+            co_await stream.read(as_bytes(value.data() + offset, n));
+        }
+    }
+}
+
+template <typename T>
+struct sequence_codec {
+    template <typename stream_type>
+    static asio::awaitable<void> read(stream_type & stream, T & value) {
+        uint64_t size = co_await read_varint(stream);
+        co_await read_elements(stream, value, size);
+    }
+
+    template <typename stream_type>
+    static asio::awaitable<void> write(stream_type & stream, T const & value) {
+        co_await write_varint(stream, value.size());
+        co_await stream.write(as_bytes(value.data(), value.size()));
+    }
+};
+
+template <array_element_type T>
+struct array_codec {
+    template <typename stream_type>
+    static asio::awaitable<void> read(stream_type & stream, std::vector<T> & value) {
+        uint64_t size = co_await read_varint(stream);
+        if constexpr (alignof(T) > 1) {
+            stream.consume(array_padding<T>(stream.position()));
+        }
+        co_await read_elements(stream, value, size);
+        if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1) {
+            for (auto & element : value) {
+                auto bytes = as_bytes(&element, 1);
+                std::reverse(bytes.begin(), bytes.end());
+            }
+        }
+    }
+
+    template <typename stream_type>
+    static asio::awaitable<void> write(stream_type & stream, std::span<T const> value) {
+        static constexpr std::array<uint8_t, alignof(std::max_align_t)> zeros = {};
+        co_await write_varint(stream, value.size());
+        if constexpr (alignof(T) > 1) {
+            co_await stream.write(std::span<uint8_t const>{zeros.data(), array_padding<T>(stream.position())});
+        }
+        if constexpr (std::endian::native == std::endian::big && sizeof(T) > 1) {
+            for (auto element : value) {
+                auto bytes = as_bytes(&element, 1);
+                std::reverse(bytes.begin(), bytes.end());
+                co_await stream.write(bytes);
+            }
+        } else {
+            co_await stream.write(as_bytes(value.data(), value.size()));
+        }
+    }
+};
+
+template <>
+struct codec<std::string> : sequence_codec<std::string> {};
+
+template <>
+struct codec<std::string_view> : sequence_codec<std::string_view> {};
+
+template <array_element_type T>
+struct codec<std::vector<T>> : array_codec<T> {};
+
+template <array_element_type T>
+struct codec<std::span<T const>> : array_codec<T> {};
+
+}
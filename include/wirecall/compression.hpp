@@ -0,0 +1,206 @@
+#pragma once
+
+#include "wirecall/frame.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+// With compression, frame bodies larger than `threshold` are compressed before being
+// sent, once the peer announced it can decompress them. Smaller frames are sent as is.
+struct compression {
+    size_t threshold = 16 * 1024;
+};
+
+namespace details {
+
+// Codecs announced to the peer as a bitmask, in a frame_flags::capabilities frame
+enum class compression_codec : uint64_t {
+    lz = 1,
+};
+
+constexpr uint64_t supported_codecs = static_cast<uint64_t>(compression_codec::lz);
+
+// A byte oriented LZ77 block format in the spirit of LZ4, fast rather than tight. Every
+// sequence is a token holding the literal and match lengths in a nibble each, longer
+// lengths continuing in extra bytes, then the literals, then a 16 bit match offset.
+// The last sequence only has literals.
+struct lz {
+    static constexpr size_t min_match = 4;
+    static constexpr size_t max_offset = std::numeric_limits<uint16_t>::max();
+    static constexpr size_t hash_bits = 12;
+    // the largest expansion of a decompressed block, bounds what a frame may claim
+    static constexpr size_t max_ratio = 255;
+
+    static void compress(std::span<uint8_t const> in, std::vector<uint8_t> & out) {
+        std::array<uint32_t, size_t{1} << hash_bits> table;
+        table.fill(0);
+
+        size_t n = in.size();
+        size_t anchor = 0;
+        size_t pos = 0;
+
+        while (pos + min_match <= n) {
+            auto value = load(in.data() + pos);
+            auto & slot = table[hash(value)];
+            size_t candidate = std::exchange(slot, static_cast<uint32_t>(pos));
+
+            if (candidate < pos && pos - candidate <= max_offset && load(in.data() + candidate) == value) {
+                size_t length = min_match;
+                while (pos + length < n && in[candidate + length] == in[pos + length]) {
+                    ++length;
+                }
+                write_sequence(out, in.subspan(anchor, pos - anchor), length, pos - candidate);
+                pos += length;
+                anchor = pos;
+            } else {
+                ++pos;
+            }
+        }
+
+        write_sequence(out, in.subspan(anchor), 0, 0);
+    }
+
+    // `out` has to be exactly the size of the decompressed block
+    static void decompress(std::span<uint8_t const> in, std::span<uint8_t> out) {
+        size_t ip = 0;
+        size_t op = 0;
+
+        auto read_length = [&](size_t length) {
+            if (length == 15) {
+                uint8_t extra;
+                do {
+                    if (ip >= in.size()) {
+                        throw std::runtime_error("Malformed compressed frame");
+                    }
+                    extra = in[ip++];
+                    length += extra;
+                } while (extra == 255);
+            }
+            return length;
+        };
+
+        while (true) {
+            if (ip >= in.size()) {
+                throw std::runtime_error("Malformed compressed frame");
+            }
+            auto token = in[ip++];
+
+            auto literals = read_length(token >> 4);
+            if (literals > in.size() - ip || literals > out.size() - op) {
+                throw std::runtime_error("Malformed compressed frame");
+            }
+            if (literals) {
+                std::memcpy(out.data() + op, in.data() + ip, literals);
+            }
+            ip += literals;
+            op += literals;
+
+            if (ip == in.size()) {
+                break;
+            }
+
+            if (in.size() - ip < 2) {
+                throw std::runtime_error("Malformed compressed frame");
+            }
+            size_t offset = in[ip] | (size_t{in[ip + 1]} << 8);
+            ip += 2;
+
+            auto length = read_length(token & 15) + min_match;
+            if (offset == 0 || offset > op || length > out.size() - op) {
+                throw std::runtime_error("Malformed compressed frame");
+            }
+            // matches may overlap what they copy
+            for (size_t i = 0; i < length; ++i, ++op) {
+                out[op] = out[op - offset];
+            }
+        }
+
+        if (op != out.size()) {
+            throw std::runtime_error("Malformed compressed frame");
+        }
+    }
+
+  private:
+    static uint32_t load(uint8_t const * data) {
+        uint32_t value;
+        std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    static size_t hash(uint32_t value) {
+        return (value * 2654435761u) >> (32 - hash_bits);
+    }
+
+    static void write_length(std::vector<uint8_t> & out, size_t length) {
+        for (; length >= 255; length -= 255) {
+            out.push_back(255);
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    }
+
+    static void write_sequence(std::vector<uint8_t> & out, std::span<uint8_t const> literals, size_t match, size_t offset) {
+        auto match_length = match ? match - min_match : 0;
+        out.push_back(static_cast<uint8_t>((std::min<size_t>(literals.size(), 15) << 4) | std::min<size_t>(match_length, 15)));
+        if (literals.size() >= 15) {
+            write_length(out, literals.size() - 15);
+        }
+        out.insert(out.end(), literals.begin(), literals.end());
+        if (match) {
+            out.push_back(offset & 0xff);
+            out.push_back(offset >> 8);
+            if (match_length >= 15) {
+                write_length(out, match_length - 15);
+            }
+        }
+    }
+};
+
+// A compressed body keeps its flags byte, with frame_flags::compressed set, followed by
+// the size of the rest of the body once decompressed and the compressed block.
+// Returns false when compressing does not make the body smaller.
+inline bool compress_frame_body(std::span<uint8_t const> body, std::vector<uint8_t> & out) {
+    out.clear();
+    auto rest = body.subspan(1);
+    uint64_t size = rest.size();
+    do {
+        out.push_back((size & 0x7f) | (size > 0x7f ? 0x80 : 0));
+        size >>= 7;
+    } while (size);
+    lz::compress(rest, out);
+    return out.size() + 1 < body.size();
+}
+
+// Rebuilds the body the peer compressed, its reader is left after the flags byte. Like
+// any other frame, the rebuilt body is at most max_frame bytes.
+inline frame decompress_frame(frame & payload, uint8_t flags, size_t max_frame) {
+    auto size = read_buffered_varint(payload.reader());
+    auto block = payload.reader().buffered();
+    if (!size || *size > std::numeric_limits<uint32_t>::max() || *size > block.size() * lz::max_ratio) {
+        throw std::runtime_error("Malformed compressed frame");
+    }
+    if (*size + 1 > max_frame) {
+        throw std::runtime_error("Compressed frame too large");
+    }
+
+    auto storage = frame_buffer_pool::acquire(*size + 1);
+    storage[0] = flags & ~static_cast<uint8_t>(frame_flags::compressed);
+    lz::decompress(block, std::span<uint8_t>{storage}.subspan(1));
+
+    frame body{std::move(storage), payload.lane()};
+    body.reader().consume(1);
+    return body;
+}
+
+}
+
+}
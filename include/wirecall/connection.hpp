@@ -2,17 +2,46 @@
 
 #include "wirecall/async_mutex.hpp"
 #include "wirecall/buffered_socket.hpp"
+#include "wirecall/compression.hpp"
+#include "wirecall/frame.hpp"
+#include "wirecall/tracing.hpp"
 
 #include "wirepump.hpp"
 
 #include <asio/awaitable.hpp>
 #include <asio/generic/stream_protocol.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/use_awaitable.hpp>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <concepts>
+#include <cstddef>
+#include <exception>
+#include <limits>
+#include <optional>
+#include <span>
 #include <utility>
+#include <vector>
 
 namespace wirecall {
 
+// With write coalescing, concurrent senders only queue their messages, and a single
+// flusher drains everything pending in gather writes of up to `max_batch_bytes`.
+// The flusher waits up to `max_linger` for more messages before starting a batch.
+// Frame bodies larger than `max_fragment_bytes` are written in fragments, so that
+// other frames, higher priorities first, go out in between.
+// Senders still wait until their message is written, and fail with the error of the
+// write that was meant to carry it. Once `max_pending_bytes` are queued, senders wait
+// for the flusher to make room before queuing theirs.
+struct write_coalescing {
+    size_t max_batch_bytes = 256 * 1024;
+    std::chrono::microseconds max_linger{0};
+    size_t max_fragment_bytes = 64 * 1024;
+    size_t max_pending_bytes = 4 * 1024 * 1024;
+};
+
 template <typename socket_type, typename mutex_type>
 struct basic_connection {
   private:
@@ -20,6 +49,23 @@ struct basic_connection {
     mutex_type read_mutex;
     mutex_type write_mutex;
 
+    std::optional<write_coalescing> m_coalescing = std::nullopt;
+    bool m_flushing = false;
+
+    // Senders waiting for the flusher, either for their frame to be written up to
+    // `committed` in its lane, or for room in the write queue. The flusher hands its
+    // role to the oldest one once its own frame is written.
+    struct write_waiter {
+        size_t lane;
+        uint64_t committed;
+        std::exception_ptr * error;
+        bool * flusher;
+        details::async_waiter * waiter;
+    };
+    std::vector<write_waiter> m_write_waiters;
+    std::vector<write_waiter> m_room_waiters;
+    std::array<uint64_t, details::fragment_header::lanes> m_written_bytes = {};
+
   public:
     basic_connection(socket_type socket)
       : m_socket{std::move(socket)}
@@ -32,21 +78,129 @@ struct basic_connection {
         return m_socket.get_executor();
     }
 
+    void set_write_coalescing(std::optional<write_coalescing> coalescing)
+        requires requires (socket_type socket) {
+            socket.commit();
+            { socket.stage_pending(size_t{}) } -> std::same_as<size_t>;
+            { socket.write_staged() } -> std::same_as<asio::awaitable<void>>;
+            { socket.pending_bytes() } -> std::same_as<size_t>;
+            { socket.committed_bytes(priority{}) } -> std::same_as<uint64_t>;
+            { socket.staged_bytes(priority{}) } -> std::same_as<uint64_t>;
+        }
+    {
+        m_coalescing = std::move(coalescing);
+        if constexpr (requires (socket_type socket) { socket.set_max_fragment(size_t{}); }) {
+            m_socket.set_max_fragment(m_coalescing ? m_coalescing->max_fragment_bytes : 0);
+        }
+    }
+
+    void set_max_frame_bytes(size_t max_frame_bytes)
+        requires requires (socket_type socket) {
+            socket.set_max_frame(size_t{});
+        }
+    {
+        m_socket.set_max_frame(max_frame_bytes);
+    }
+
+    // The largest frame body accepted from the peer, compressed bodies included once
+    // decompressed
+    size_t max_frame_bytes() const {
+        if constexpr (requires (socket_type const socket) { { socket.max_frame() } -> std::convertible_to<size_t>; }) {
+            return m_socket.max_frame();
+        } else {
+            return std::numeric_limits<uint32_t>::max();
+        }
+    }
+
     template <typename T>
     asio::awaitable<void> send(T const & msg) {
-        auto lock = co_await write_mutex.lock();
-        co_await wirepump::write(m_socket, msg);
-        if constexpr (requires (socket_type socket) {
-            { socket.flush() } -> std::same_as<asio::awaitable<void>>;
-        }) {
-            co_await m_socket.flush();
+        co_await send_frame(msg);
+    }
+
+    // Serialize all the parts back to back straight into the socket buffer as a single frame.
+    // Returns the size of the frame body.
+    template <typename... Ts>
+    asio::awaitable<size_t> send_frame(Ts const &... parts) {
+        co_return co_await send_frame_with_priority(priority::normal, parts...);
+    }
+
+    template <typename... Ts>
+    asio::awaitable<size_t> send_frame_with_priority(priority lane, Ts const &... parts) {
+        auto trace = details::trace_begin(details::trace_event::enqueue);
+        auto lock = co_await lock_for_write();
+        details::trace(details::trace_event::write_locked, trace);
+        size_t size;
+        m_socket.begin_frame();
+        try {
+            (co_await wirepump::write(m_socket, parts), ...);
+            size = m_socket.position();
+            m_socket.end_frame();
+        } catch (...) {
+            m_socket.abort_frame();
+            throw;
+        }
+        co_await flush(std::move(lock), lane);
+        details::trace(details::trace_event::flushed, trace, size);
+        co_return size;
+    }
+
+    // Like send_frame, the body starting with the frame flags. Bodies larger than the
+    // threshold are compressed after the flags, if that makes them smaller. Returns the
+    // size of the frame body as sent.
+    template <typename... Ts>
+    asio::awaitable<size_t> send_compressed_frame(size_t threshold, priority lane, uint8_t flags, Ts const &... parts) {
+        auto trace = details::trace_begin(details::trace_event::enqueue);
+
+        // serialized and compressed before taking the lock, the other senders only wait
+        // for the copy into the write buffer
+        byte_writer body{details::frame_buffer_pool::acquire(0)};
+        co_await wirepump::write(body, flags);
+        (co_await wirepump::write(body, parts), ...);
+        std::vector<uint8_t> compressed;
+        bool is_compressed = false;
+        if (body.position() > threshold) {
+            compressed = details::frame_buffer_pool::acquire(0);
+            is_compressed = details::compress_frame_body(body.data(), compressed);
+        }
+
+        auto lock = co_await lock_for_write();
+        details::trace(details::trace_event::write_locked, trace);
+        size_t size;
+        m_socket.begin_frame();
+        try {
+            if (is_compressed) {
+                uint8_t compressed_flags = flags | static_cast<uint8_t>(frame_flags::compressed);
+                std::span<uint8_t const> block{compressed};
+                co_await m_socket.write(compressed_flags);
+                co_await m_socket.write(block);
+            } else {
+                auto raw = body.data();
+                co_await m_socket.write(raw);
+            }
+            size = m_socket.position();
+            m_socket.end_frame();
+        } catch (...) {
+            m_socket.abort_frame();
+            throw;
         }
+        details::frame_buffer_pool::release(body.release());
+        details::frame_buffer_pool::release(std::move(compressed));
+        co_await flush(std::move(lock), lane);
+        details::trace(details::trace_event::flushed, trace, size);
+        co_return size;
+    }
+
+    asio::awaitable<frame> receive_frame() {
+        auto lock = co_await read_mutex.lock();
+        auto payload = co_await m_socket.read_frame();
+        details::trace(details::trace_event::received, 0, payload.remaining());
+        co_return payload;
     }
 
     template <typename T>
     asio::awaitable<void> receive(T & msg) {
-        auto lock = co_await read_mutex.lock();
-        co_await wirepump::read(m_socket, msg);
+        auto payload = co_await receive_frame();
+        msg = co_await details::deserialize<T>(payload.reader());
     }
 
     template <typename T>
@@ -61,8 +215,140 @@ struct basic_connection {
     }
 
     auto close() {
-        m_socket.close();
         m_socket.cancel();
+        m_socket.close();
+    }
+
+  private:
+    // With write coalescing, holds the sender back while the write queue is full
+    asio::awaitable<typename mutex_type::async_lock> lock_for_write() {
+        while (true) {
+            auto lock = co_await write_mutex.lock();
+            if (!m_coalescing || !m_flushing || m_socket.pending_bytes() < m_coalescing->max_pending_bytes) {
+                co_return std::move(lock);
+            }
+
+            std::exception_ptr error = nullptr;
+            auto enqueue = [&](details::async_waiter * waiter) {
+                m_room_waiters.push_back({0, 0, &error, nullptr, waiter});
+                std::move(lock).unlock();
+                return true;
+            };
+            co_await details::async_wait_lock(true, enqueue);
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    template <typename lock_type>
+    asio::awaitable<void> flush(lock_type lock, priority lane) {
+        if (m_coalescing) {
+            m_socket.commit(lane);
+            auto committed = m_socket.committed_bytes(lane);
+            bool linger = true;
+            if (m_flushing) {
+                std::exception_ptr error = nullptr;
+                bool flusher = false;
+                auto enqueue = [&](details::async_waiter * waiter) {
+                    m_write_waiters.push_back({static_cast<size_t>(lane), committed, &error, &flusher, waiter});
+                    std::move(lock).unlock();
+                    return true;
+                };
+                co_await details::async_wait_lock(true, enqueue);
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+                if (!flusher) {
+                    co_return;
+                }
+                // the previous flusher is done, the batch it started from already lingered
+                linger = false;
+            } else {
+                m_flushing = true;
+                std::move(lock).unlock();
+            }
+            co_await flush_pending(lane, committed, linger);
+        } else if constexpr (requires (socket_type socket) {
+            { socket.flush() } -> std::same_as<asio::awaitable<void>>;
+        }) {
+            // still written in order, but the receiver learns the priority of the frame
+            if constexpr (requires (socket_type socket) { socket.commit(lane); }) {
+                m_socket.commit(lane);
+            }
+            co_await m_socket.flush();
+        }
+    }
+
+    // Writes batches until the frame of the flusher, committed up to `committed` in its
+    // lane, is written, then hands the role over to a waiting sender, if any
+    asio::awaitable<void> flush_pending(priority lane, uint64_t committed, bool linger) {
+        std::exception_ptr error = nullptr;
+
+        try {
+            auto max_batch_bytes = m_coalescing->max_batch_bytes;
+            auto max_linger = m_coalescing->max_linger;
+            if (linger && max_linger.count() > 0) {
+                asio::steady_timer timer{get_executor(), max_linger};
+                co_await timer.async_wait(asio::use_awaitable);
+            }
+
+            std::optional<std::array<uint64_t, details::fragment_header::lanes>> written = std::nullopt;
+            while (true) {
+                auto lock = co_await write_mutex.lock();
+                if (written) {
+                    m_written_bytes = *written;
+                    complete_write_waiters();
+                }
+                if (m_written_bytes[static_cast<size_t>(lane)] >= committed && !m_write_waiters.empty()) {
+                    auto next = m_write_waiters.front();
+                    m_write_waiters.erase(m_write_waiters.begin());
+                    *next.flusher = true;
+                    next.waiter->complete();
+                    co_return;
+                }
+                if (m_socket.stage_pending(max_batch_bytes) == 0) {
+                    m_flushing = false;
+                    complete_write_waiters();
+                    co_return;
+                }
+                written.emplace();
+                for (auto staged_lane : {priority::high, priority::normal, priority::low}) {
+                    (*written)[static_cast<size_t>(staged_lane)] = m_socket.staged_bytes(staged_lane);
+                }
+                std::move(lock).unlock();
+                co_await m_socket.write_staged();
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        // whoever waits for the frames of the failed batch, or for room, fails alike
+        auto lock = co_await write_mutex.lock();
+        m_flushing = false;
+        for (auto & waiters : {&m_write_waiters, &m_room_waiters}) {
+            for (auto & waiter : *waiters) {
+                *waiter.error = error;
+                waiter.waiter->complete();
+            }
+            waiters->clear();
+        }
+        std::rethrow_exception(error);
+    }
+
+    // Wakes the senders whose frames are written, and those waiting for room
+    void complete_write_waiters() {
+        std::erase_if(m_write_waiters, [this](write_waiter const & waiter) {
+            if (m_written_bytes[waiter.lane] < waiter.committed) {
+                return false;
+            }
+            waiter.waiter->complete();
+            return true;
+        });
+        for (auto & waiter : m_room_waiters) {
+            waiter.waiter->complete();
+        }
+        m_room_waiters.clear();
     }
 };
 
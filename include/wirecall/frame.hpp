@@ -0,0 +1,383 @@
+#pragma once
+
+#include "wirecall/codec.hpp"
+
+#include "wirepump.hpp"
+
+#include <asio/awaitable.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+// On the wire every frame is a little endian uint32_t body length followed by the body.
+// The body starts with the frame flags and the key, followed by the payload.
+// Large frames are split in fragments, each with its own length, see details::fragment_header.
+enum class frame_flags : uint8_t {
+    none = 0,
+    // grants a streaming method more results, the key is the one results are sent on
+    stream_credit = 1,
+    // a batch of calls, the key is the one all of their results are sent back on
+    batch = 2,
+    // announces what the sender supports, the payload is the bitmask of the codecs it decompresses
+    capabilities = 3,
+    // the caller gave up on the call whose results are sent on the key
+    cancel = 4,
+    // results of the method the key names may be cached by the caller, for as many
+    // microseconds as the payload says, zero for not at all
+    cacheable = 5,
+    // cached results of the method the key names are stale, the payload is the encoded
+    // arguments of the one call that is, or empty for all of them
+    invalidate = 6,
+    // asks a broker for the frames published on the key
+    subscribe = 7,
+    // asks a broker to stop forwarding the frames published on the key
+    unsubscribe = 8,
+    // set on top of the others when the rest of the body is compressed
+    compressed = 0x80,
+};
+
+constexpr size_t frame_length_size = sizeof(uint32_t);
+
+// With write coalescing, frames are written by lane, higher priorities first, and large
+// frames only hold up the others for one fragment at a time
+enum class priority : uint8_t {
+    normal = 0,
+    // control traffic, written ahead of everything else
+    high = 1,
+    // bulk transfers, written when nothing else is waiting
+    low = 2,
+};
+
+namespace details {
+
+// The top bit of a length says more fragments of the frame follow, the next two the lane
+// of the frame. Normal frames sent whole have neither, like frames without fragments.
+// Fragments of a frame follow each other within its lane, fragments of other lanes
+// may come in between.
+struct fragment_header {
+    static constexpr uint32_t more = uint32_t{1} << 31;
+    static constexpr unsigned lane_shift = 29;
+    static constexpr uint32_t max_length = (uint32_t{1} << lane_shift) - 1;
+    static constexpr size_t lanes = 3;
+
+    static uint32_t encode(size_t length, priority lane, bool more_follow) {
+        return static_cast<uint32_t>(length) | (uint32_t{static_cast<uint8_t>(lane)} << lane_shift) | (more_follow ? more : 0);
+    }
+};
+
+}
+
+// Decodes straight out of a byte buffer it does not own. Views decoded from it
+// (std::string_view, std::span<T const>) point into that buffer.
+struct span_reader {
+  private:
+    std::span<uint8_t const> m_data = {};
+    size_t m_offset = 0;
+
+  public:
+    span_reader() = default;
+
+    explicit span_reader(std::span<uint8_t const> data)
+      : m_data{data}
+    {}
+
+    std::span<uint8_t const> buffered() const {
+        return m_data.subspan(m_offset);
+    }
+
+    size_t remaining() const {
+        return m_data.size() - m_offset;
+    }
+
+    size_t position() const {
+        return m_offset;
+    }
+
+    void consume(size_t n) {
+        if (remaining() < n) {
+            throw std::runtime_error("Unexpected end of frame");
+        }
+        m_offset += n;
+    }
+
+    std::span<uint8_t const> view(size_t n) {
+        consume(n);
+        return m_data.subspan(m_offset - n, n);
+    }
+
+    asio::awaitable<void> read(uint8_t & c) {
+        c = view(1)[0];
+        co_return;
+    }
+
+    asio::awaitable<void> read(std::span<uint8_t> data) {
+        std::memcpy(data.data(), view(data.size()).data(), data.size());
+        co_return;
+    }
+};
+
+// Encodes into a byte buffer it owns, the counterpart of span_reader. Positions are
+// relative to the start of the buffer, so what it encodes is decoded by a span_reader
+// over that buffer alone, wherever it ends up being embedded.
+struct byte_writer {
+  private:
+    std::vector<uint8_t> m_data = {};
+
+  public:
+    byte_writer() = default;
+
+    // Encodes into the storage of a recycled buffer
+    explicit byte_writer(std::vector<uint8_t> storage)
+      : m_data{std::move(storage)} {
+        m_data.clear();
+    }
+
+    std::span<uint8_t const> data() const {
+        return m_data;
+    }
+
+    size_t position() const {
+        return m_data.size();
+    }
+
+    void clear() {
+        m_data.clear();
+    }
+
+    // Hands the buffer back, to be recycled
+    std::vector<uint8_t> release() {
+        return std::move(m_data);
+    }
+
+    asio::awaitable<void> write(uint8_t const & c) {
+        m_data.push_back(c);
+        co_return;
+    }
+
+    asio::awaitable<void> write(std::span<uint8_t const> data) {
+        m_data.insert(m_data.end(), data.begin(), data.end());
+        co_return;
+    }
+};
+
+// Per-thread counts of the frame buffers handed out by the buffer pool without allocating,
+// and of the ones that allocated. Coroutine frames are not counted, asio keeps no counts
+// for its own cache.
+struct buffer_pool_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+namespace details {
+
+// Frame buffers are recycled through a small per-thread pool, so receiving and
+// decoding frames does not allocate in steady state.
+struct frame_buffer_pool {
+    static constexpr size_t max_buffers = 64;
+    static constexpr size_t max_buffer_capacity = 1024 * 1024;
+
+    static std::vector<uint8_t> acquire(size_t size) {
+        auto & pool = buffers();
+        std::vector<uint8_t> buffer;
+        if (!pool.empty()) {
+            buffer = std::move(pool.back());
+            pool.pop_back();
+        }
+        ++(buffer.capacity() >= size ? stats().hits : stats().misses);
+        buffer.resize(size);
+        return buffer;
+    }
+
+    static void release(std::vector<uint8_t> && buffer) {
+        auto & pool = buffers();
+        if (buffer.capacity() == 0 || buffer.capacity() > max_buffer_capacity || pool.size() >= max_buffers) {
+            return;
+        }
+        buffer.clear();
+        pool.push_back(std::move(buffer));
+    }
+
+    static buffer_pool_stats & stats() {
+        thread_local buffer_pool_stats counters;
+        return counters;
+    }
+
+  private:
+    static std::vector<std::vector<uint8_t>> & buffers() {
+        thread_local std::vector<std::vector<uint8_t>> pool;
+        return pool;
+    }
+};
+
+}
+
+inline buffer_pool_stats frame_buffer_pool_stats() {
+    return details::frame_buffer_pool::stats();
+}
+
+struct frame {
+  private:
+    std::vector<uint8_t> m_storage = {};
+    span_reader m_reader = {};
+    priority m_lane = priority::normal;
+
+  public:
+    frame() = default;
+
+    explicit frame(std::vector<uint8_t> storage, priority lane = priority::normal)
+      : m_storage{std::move(storage)}
+      , m_reader{m_storage}
+      , m_lane{lane}
+    {}
+
+    frame(frame const &) = delete;
+    frame & operator=(frame const &) = delete;
+
+    frame(frame && other) noexcept
+      : m_storage{std::move(other.m_storage)}
+      , m_reader{std::exchange(other.m_reader, {})}
+      , m_lane{other.m_lane}
+    {}
+
+    frame & operator=(frame && other) noexcept {
+        if (this != &other) {
+            details::frame_buffer_pool::release(std::move(m_storage));
+            m_storage = std::move(other.m_storage);
+            m_reader = std::exchange(other.m_reader, {});
+            m_lane = other.m_lane;
+        }
+        return *this;
+    }
+
+    ~frame() {
+        details::frame_buffer_pool::release(std::move(m_storage));
+    }
+
+    std::span<uint8_t const> data() const {
+        return m_storage;
+    }
+
+    span_reader & reader() {
+        return m_reader;
+    }
+
+    size_t remaining() const {
+        return m_reader.remaining();
+    }
+
+    // The priority the frame was sent with
+    priority lane() const {
+        return m_lane;
+    }
+};
+
+namespace details {
+
+template <typename T>
+struct is_view : std::false_type {};
+
+template <typename T>
+struct is_view<std::basic_string_view<T>> : std::true_type {};
+
+template <typename T>
+struct is_view<std::span<T const>> : std::true_type {};
+
+template <typename T>
+concept view_type = is_view<std::remove_cvref_t<T>>::value;
+
+template <typename T>
+asio::awaitable<T> deserialize(span_reader & reader) {
+    T value;
+    co_await wirepump::read(reader, value);
+    if (reader.remaining() != 0) {
+        throw std::runtime_error("Unexpected unused bytes in stream");
+    }
+    co_return value;
+}
+
+template <typename T>
+asio::awaitable<T> deserialize(std::span<uint8_t const> payload) {
+    span_reader reader{payload};
+    co_return co_await deserialize<T>(reader);
+}
+
+template <typename T>
+struct string_view_codec {
+    template <typename stream_type>
+    static asio::awaitable<void> read(stream_type & stream, T & value) {
+        uint64_t size = co_await read_varint(stream);
+        auto bytes = stream.view(size);
+        value = T{reinterpret_cast<typename T::value_type const *>(bytes.data()), bytes.size()};
+    }
+};
+
+template <typename T>
+struct span_view_codec {
+    template <typename stream_type>
+    static asio::awaitable<void> read(stream_type & stream, std::span<T const> & value) {
+        static_assert(sizeof(T) == 1 || std::endian::native == std::endian::little, "Viewing multi-byte elements requires a little endian host");
+        uint64_t size = co_await read_varint(stream);
+        stream.consume(array_padding<T>(stream.position()));
+        // the size comes from the peer, multiplying it first could wrap around
+        if (size > stream.remaining() / sizeof(T)) {
+            throw std::runtime_error("Span longer than the rest of the frame");
+        }
+        auto bytes = stream.view(size * sizeof(T));
+        value = std::span<T const>{reinterpret_cast<T const *>(bytes.data()), size};
+    }
+};
+
+}
+
+}
+
+template <typename T>
+    requires std::is_arithmetic_v<T>
+struct wirepump::read_impl<wirecall::span_reader, T> : wirecall::details::codec<T> {};
+
+template <>
+struct wirepump::read_impl<wirecall::span_reader, std::string> : wirecall::details::codec<std::string> {};
+
+template <>
+struct wirepump::read_impl<wirecall::span_reader, std::string_view> : wirecall::details::string_view_codec<std::string_view> {};
+
+template <wirecall::details::array_element_type T>
+struct wirepump::read_impl<wirecall::span_reader, std::vector<T>> : wirecall::details::codec<std::vector<T>> {};
+
+template <wirecall::details::array_element_type T>
+struct wirepump::read_impl<wirecall::span_reader, std::span<T const>> : wirecall::details::span_view_codec<T> {};
+
+template <typename T>
+    requires std::is_arithmetic_v<T>
+struct wirepump::write_impl<wirecall::byte_writer, T> : wirecall::details::codec<T> {};
+
+template <>
+struct wirepump::write_impl<wirecall::byte_writer, std::string> : wirecall::details::codec<std::string> {};
+
+template <>
+struct wirepump::write_impl<wirecall::byte_writer, std::string_view> : wirecall::details::codec<std::string_view> {};
+
+template <wirecall::details::array_element_type T>
+struct wirepump::write_impl<wirecall::byte_writer, std::vector<T>> {
+    static auto write(wirecall::byte_writer & writer, std::vector<T> const & value) {
+        return wirecall::details::codec<std::vector<T>>::write(writer, std::span<T const>{value});
+    }
+};
+
+template <typename T>
+    requires wirecall::details::array_element_type<std::remove_const_t<T>>
+struct wirepump::write_impl<wirecall::byte_writer, std::span<T>> {
+    static auto write(wirecall::byte_writer & writer, std::span<T> const & value) {
+        using element_type = std::remove_const_t<T>;
+        return wirecall::details::codec<std::span<element_type const>>::write(writer, std::span<element_type const>{value});
+    }
+};
@@ -4,27 +4,54 @@
 #include "wirecall/async_mutex.hpp"
 #include "wirecall/buffered_socket.hpp"
 #include "wirecall/connection.hpp"
+#include "wirecall/frame.hpp"
+#include "wirecall/metrics.hpp"
+#include "wirecall/pending_calls.hpp"
 #include "wirecall/pubsub.hpp"
+#include "wirecall/result_cache.hpp"
+#include "wirecall/single_flight.hpp"
+#include "wirecall/sync.hpp"
+#include "wirecall/tracing.hpp"
 
 #include "wirepump.hpp"
 
+#include <asio/any_io_executor.hpp>
 #include <asio/awaitable.hpp>
+#include <asio/bind_cancellation_slot.hpp>
+#include <asio/cancellation_signal.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/dispatch.hpp>
+#include <asio/error.hpp>
 #include <asio/generic/stream_protocol.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/strand.hpp>
+#include <asio/system_error.hpp>
+#include <asio/this_coro.hpp>
+#include <asio/use_awaitable.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <concepts>
+#include <cstddef>
 #include <cstdint>
 #include <exception>
 #include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
-#include <set>
+#include <span>
 #include <sstream>
 #include <stdexcept>
 #include <string_view>
 #include <string>
 #include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <variant>
+#include <vector>
 
 namespace wirecall {
 
@@ -37,45 +64,383 @@ class host_error : public std::runtime_error {
     {}
 };
 
+// Handed to streaming methods to send their results. Every item waits until the
+// caller granted a credit for it, so a method never gets ahead of its consumer.
+template <typename T>
+struct stream_writer {
+  private:
+    std::function<asio::awaitable<void>(T const &)> m_write;
+
+  public:
+    stream_writer(std::function<asio::awaitable<void>(T const &)> write)
+      : m_write{std::move(write)}
+    {}
+
+    asio::awaitable<void> yield(T const & item) {
+        co_await m_write(item);
+    }
+};
+
+// The result of one call of a batch, available once the batch completed
+template <typename R>
+struct batch_result {
+  private:
+    using value_type = std::conditional_t<std::same_as<R, void>, std::monostate, R>;
+
+    struct state {
+        std::optional<value_type> value;
+        std::exception_ptr error;
+    };
+
+    std::shared_ptr<state> m_state = std::make_shared<state>();
+
+    template <typename, typename, template <typename...> typename>
+    friend struct basic_ipc_endpoint;
+
+  public:
+    bool ready() const {
+        return m_state->value || m_state->error;
+    }
+
+    // Throws what the call would have thrown on its own
+    decltype(auto) get() const {
+        if (m_state->error) {
+            std::rethrow_exception(m_state->error);
+        }
+        if (!m_state->value) {
+            throw std::logic_error("The batch has not completed");
+        }
+        if constexpr (!std::same_as<R, void>) {
+            return static_cast<R const &>(*m_state->value);
+        }
+    }
+};
+
 template <typename named_key_type, typename socket_type, template <typename...> typename channel_type>
 struct basic_ipc_endpoint {
   private:
-    using anonymous_key_type = uint64_t;
+    using pending_calls_type = details::pending_calls<channel_type>;
+    using anonymous_key_type = typename pending_calls_type::key_type;
     using key_type = std::variant<anonymous_key_type, named_key_type>;
+    using sync = details::sync_traits<channel_type>;
+
+    using pubsub_type = basic_pubsub_endpoint<key_type, socket_type, channel_type>;
+
+    // The results of a stream take the place of the success flag of a regular result,
+    // the stream ends with a regular result
+    static constexpr uint8_t stream_item = 2;
+
+    // Credits the caller of a streaming method granted it, keyed by the result key of the call
+    struct stream_credits {
+        typename sync::template atomic<uint64_t> available;
+        typename sync::template atomic<bool> cancelled = false;
+        channel_type<> granted;
+
+        template <typename executor_type>
+        stream_credits(executor_type const & executor, uint64_t credits)
+          : available{credits}
+          , granted{executor}
+        {}
+
+        asio::awaitable<void> acquire() {
+            while (true) {
+                if (cancelled.load(std::memory_order_acquire)) {
+                    throw std::runtime_error("Stream cancelled");
+                }
+                auto credits = available.load(std::memory_order_acquire);
+                if (credits == 0) {
+                    co_await granted.async_receive();
+                } else if (available.compare_exchange_weak(credits, credits - 1, std::memory_order_acq_rel)) {
+                    co_return;
+                }
+            }
+        }
+    };
+
+    // A call whose caller may give up on it. Its cancellation only happens on its strand,
+    // which the method runs on.
+    struct running_call {
+        asio::strand<asio::any_io_executor> strand;
+        asio::steady_timer deadline;
+        asio::cancellation_signal signal;
+        bool done = false;
+        bool cancelled = false;
+
+        running_call(asio::any_io_executor const & executor)
+          : strand{asio::make_strand(executor)}
+          , deadline{strand}
+        {}
+
+        void cancel() {
+            if (!done && !cancelled) {
+                cancelled = true;
+                signal.emit(asio::cancellation_type::terminal);
+            }
+        }
+    };
+
+    pubsub_type m_pubsub;
+    pending_calls_type m_pending_calls;
+
+    std::unordered_map<anonymous_key_type, std::shared_ptr<running_call>> m_running = {};
+    typename sync::mutex m_running_mutex;
+
+    size_t m_stream_window = 16;
+    std::unordered_map<anonymous_key_type, std::shared_ptr<stream_credits>> m_streams = {};
+    // set once the connection is gone, streams opened after that are cancelled right away
+    bool m_streams_cancelled = false;
+    typename sync::mutex m_streams_mutex;
+
+  public:
+    // What methods are called by
+    using method_key_type = named_key_type;
+
+    // The results of a streaming method, read one at a time with next().
+    // It must not outlive its endpoint, dropping it early cancels the method.
+    template <typename T>
+    struct result_stream {
+      private:
+        basic_ipc_endpoint * m_endpoint;
+        typename pending_calls_type::call m_call;
+        size_t m_window;
+        size_t m_consumed = 0;
+        bool m_done = false;
+
+        result_stream(basic_ipc_endpoint * endpoint, typename pending_calls_type::call call, size_t window)
+          : m_endpoint{endpoint}
+          , m_call{std::move(call)}
+          , m_window{window}
+        {}
+
+        friend struct basic_ipc_endpoint;
+
+      public:
+        result_stream(result_stream const &) = delete;
+        result_stream(result_stream && other)
+          : m_endpoint{std::exchange(other.m_endpoint, nullptr)}
+          , m_call{std::move(other.m_call)}
+          , m_window{other.m_window}
+          , m_consumed{other.m_consumed}
+          , m_done{other.m_done}
+        {}
+
+        ~result_stream() {
+            if (m_endpoint && !m_done) {
+                asio::co_spawn(m_endpoint->get_executor(), m_endpoint->grant_credits(m_call.key(), 0), asio::detached);
+            }
+        }
+
+        // Returns std::nullopt once the method is done, and throws if it failed
+        asio::awaitable<std::optional<T>> next() {
+            if (m_done) {
+                co_return std::nullopt;
+            }
+
+            auto payload = co_await m_call.result();
+
+            uint8_t event;
+            co_await wirepump::read(payload.reader(), event);
+
+            if (event == stream_item) {
+                auto item = co_await details::deserialize<T>(payload.reader());
+                // grant credits back in batches, rather than one frame per item
+                if (++m_consumed >= std::max<size_t>(m_window / 2, 1)) {
+                    co_await m_endpoint->grant_credits(m_call.key(), std::exchange(m_consumed, 0));
+                }
+                co_return item;
+            }
+
+            m_done = true;
+            if (!event) {
+                auto message = co_await details::deserialize<std::string>(payload.reader());
+                throw host_error(std::move(message));
+            }
+            co_await details::deserialize<std::tuple<>>(payload.reader());
+            co_return std::nullopt;
+        }
+    };
+
+    // Calls sent together in a single frame by call_batch, the server runs them in order
+    // and sends all of their results back in a single frame. Arguments are encoded when
+    // the batch is sent, views passed to add() have to stay valid until then.
+    struct batch {
+      private:
+        struct entry {
+            key_type key;
+            std::function<asio::awaitable<void>(byte_writer &)> write_args;
+            std::function<asio::awaitable<void>(std::span<uint8_t const>)> read_result;
+        };
+
+        std::vector<entry> m_calls = {};
+
+        friend struct basic_ipc_endpoint;
+
+      public:
+        template <typename R, typename... Args>
+        batch_result<R> add(named_key_type named_key, Args&&... args) {
+            static_assert(!details::view_type<R>, "results outlive the frame they are decoded from, they can't be views");
+
+            batch_result<R> result;
+            m_calls.push_back({
+                key_type{std::in_place_index<1>, std::move(named_key)},
+                [args = std::make_tuple(std::forward<Args>(args)...)](byte_writer & out) -> asio::awaitable<void> {
+                    // laid out like the payload of a single call
+                    co_await wirepump::write(out, std::optional<key_type>{});
+                    co_await wirepump::write(out, std::optional<uint64_t>{});
+                    co_await wirepump::write(out, args);
+                },
+                [state = result.m_state](std::span<uint8_t const> data) -> asio::awaitable<void> {
+                    span_reader reader{data};
+                    try {
+                        if constexpr (std::same_as<R, ignore_result>) {
+                            state->value.emplace();
+                        } else if constexpr (std::same_as<R, void>) {
+                            co_await read_result<void>(reader);
+                            state->value.emplace();
+                        } else {
+                            state->value.emplace(co_await read_result<R>(reader));
+                        }
+                    } catch (...) {
+                        state->error = std::current_exception();
+                    }
+                },
+            });
+            return result;
+        }
+
+        size_t size() const {
+            return m_calls.size();
+        }
+    };
+
+    // Single threaded endpoints must only be used from the thread, or strand, they run on
+    static constexpr bool concurrent = sync::concurrent;
 
-    using method_type = std::function<asio::awaitable<void>(std::string)>;
-    using method_ptr_type = std::shared_ptr<method_type>;
+    // Batched calls pass a writer to collect their result instead of publishing it
+    using method_type = std::function<asio::awaitable<void>(basic_ipc_endpoint &, frame, byte_writer *)>;
 
-    basic_pubsub_endpoint<key_type, socket_type, channel_type> m_pubsub;
+    // Methods shared by many endpoints, like all the connections of a server.
+    // It is filled up front and not modified once handed to the endpoints.
+    struct method_registry {
+      private:
+        std::unordered_map<named_key_type, method_type> m_methods = {};
+        std::unordered_map<named_key_type, std::shared_ptr<details::method_counters>> m_counters = {};
+        std::unordered_map<named_key_type, std::chrono::steady_clock::duration> m_cache_ttls = {};
 
-    basic_async_mutex<channel_type> m_anonymous_key_mutex;
-    std::set<anonymous_key_type> m_anonymous_key_pool = {};
-    anonymous_key_type m_next_anonymous_key = 0;
+      public:
+        template <typename F>
+        method_registry & add(named_key_type key, F && f, method_options options = {}) {
+            auto counters = std::make_shared<details::method_counters>();
+            m_methods.insert_or_assign(key, make_method(std::forward<F>(f), counters, options));
+            m_counters.insert_or_assign(std::move(key), std::move(counters));
+            return *this;
+        }
+
+        // Lets callers cache the results of the method for up to `ttl`, until invalidated
+        method_registry & cacheable(named_key_type key, std::chrono::steady_clock::duration ttl) {
+            m_cache_ttls.insert_or_assign(std::move(key), ttl);
+            return *this;
+        }
+
+        auto const & cache_ttls() const {
+            return m_cache_ttls;
+        }
+
+        method_type const * find(named_key_type const & key) const {
+            auto it = m_methods.find(key);
+            return it == m_methods.end() ? nullptr : &it->second;
+        }
+
+        // Counted across all the endpoints sharing the registry
+        std::unordered_map<named_key_type, method_metrics> metrics() const {
+            std::unordered_map<named_key_type, method_metrics> metrics;
+            for (auto const & [key, counters] : m_counters) {
+                metrics.emplace(key, counters->snapshot());
+            }
+            return metrics;
+        }
+    };
+
+    using method_registry_ptr = std::shared_ptr<method_registry const>;
+
+  private:
+    method_registry_ptr m_methods;
+
+    // Methods added to this endpoint alone, for batches to find them
+    std::unordered_map<named_key_type, std::shared_ptr<method_type const>> m_local_methods = {};
+    std::unordered_map<named_key_type, std::shared_ptr<details::method_counters>> m_local_counters = {};
+    std::unordered_map<named_key_type, std::chrono::steady_clock::duration> m_local_cache_ttls = {};
+    typename sync::mutex m_local_methods_mutex;
+
+    details::sharded_counters<1> m_invalid_calls;
+
+    // results of the peer's methods, once it announced them as cacheable
+    details::result_cache<named_key_type, sync> m_results;
 
   public:
-    basic_ipc_endpoint(socket_type socket)
+    basic_ipc_endpoint(socket_type socket, method_registry_ptr methods = nullptr)
       : m_pubsub(std::move(socket))
-      , m_anonymous_key_mutex{m_pubsub.get_executor()}
+      , m_pending_calls{m_pubsub.get_executor()}
+      , m_methods{std::move(methods)}
     {
-        m_pubsub.subscribe_default([this](key_type key, std::optional<key_type> result_key, std::string paylod) -> asio::awaitable<void> {
-            if (!result_key) {
-                co_return;
+        // results go straight to the call waiting for them, late ones are dropped,
+        // and shared methods are dispatched without going through the subscriptions
+        m_pubsub.subscribe_direct([this](frame_flags flags, key_type const & key, frame & payload) {
+            if (flags == frame_flags::stream_credit) {
+                if (key.index() == 0) {
+                    add_credits(std::get<0>(key), payload);
+                }
+                return true;
+            }
+            if (flags == frame_flags::cancel) {
+                if (key.index() == 0) {
+                    cancel_call(std::get<0>(key));
+                }
+                return true;
+            }
+            if (flags == frame_flags::cacheable || flags == frame_flags::invalidate) {
+                if (key.index() == 1) {
+                    update_results(flags, std::get<1>(key), payload);
+                }
+                return true;
             }
+            if (flags == frame_flags::batch) {
+                if (key.index() == 0) {
+                    auto trace = details::trace_begin(details::trace_event::dispatched);
+                    m_pubsub.dispatch(invoke_batch(std::get<0>(key), std::move(payload), trace));
+                }
+                return true;
+            }
+            if (key.index() == 0) {
+                m_pending_calls.complete(std::get<0>(key), payload);
+                return true;
+            }
+            if (!m_methods) {
+                return false;
+            }
+            auto method = m_methods->find(std::get<1>(key));
+            if (!method) {
+                return false;
+            }
+            auto trace = details::trace_begin(details::trace_event::dispatched);
+            m_pubsub.dispatch(invoke(m_methods, *method, std::move(payload), trace));
+            return true;
+        });
 
-            bool success = false;
-            std::stringstream message;
+        m_pubsub.subscribe_default([this](key_type key, frame payload) -> asio::awaitable<void> {
+            if (key.index() != 1) {
+                // a late result for a call nobody is waiting for
+                co_return;
+            }
+            m_invalid_calls.add(0);
 
-            if (key.index() == 1) {
-                if constexpr (requires (std::ostream & o, named_key_type k) {
-                    o << k;
-                }) {
-                    message << "Invalid method key `" << std::get<1>(key) << "`";
-                } else {
-                    message << "Invalid method key";
-                }
+            std::optional<key_type> result_key;
+            co_await wirepump::read(payload.reader(), result_key);
+            if (!result_key) {
+                co_return;
             }
 
-            co_await m_pubsub.publish(*result_key, false, message.str());
+            co_await m_pubsub.publish_with_priority(payload.lane(), *result_key, false, invalid_method_message(std::get<1>(key)));
         });
     }
 
@@ -83,130 +448,814 @@ struct basic_ipc_endpoint {
         return m_pubsub.get_executor();
     }
 
-    template <typename R, typename... Args>
-    asio::awaitable<void> add_method(named_key_type named_key, std::function<asio::awaitable<R>(Args...)> f) {
-        key_type key{std::in_place_index<1>, std::move(named_key)};
+    void set_write_coalescing(std::optional<write_coalescing> coalescing) {
+        m_pubsub.set_write_coalescing(std::move(coalescing));
+    }
 
-        co_await m_pubsub.subscribe(
-            std::move(key),
-            [this, f=std::move(f)](std::optional<key_type> result_key, std::string paylod) -> asio::awaitable<void> {
-                bool success = true;
-                std::string result;
+    void set_compression(std::optional<compression> compression) {
+        m_pubsub.set_compression(std::move(compression));
+    }
 
-                try {
-                    if constexpr (std::same_as<R, void>) {
-                        co_await std::apply(f, details::deserialize<std::tuple<Args...>>(paylod));
-                    } else {
-                        result = details::serialize(co_await std::apply(f, details::deserialize<std::tuple<Args...>>(paylod)));
-                    }
-                    success = true;
-                } catch (std::exception const & ex) {
-                    success = false;
-                    result = ex.what();
-                } catch (...) {
-                    success = false;
-                    result = "Unknown exception";
-                }
+    void set_max_in_flight(size_t max_in_flight) {
+        m_pubsub.set_max_in_flight(max_in_flight);
+    }
 
-                if (result_key) {
-                    co_await m_pubsub.publish(*result_key, success, result);
-                }
-            }
-        );
+    void set_max_frame_bytes(size_t max_frame_bytes) {
+        m_pubsub.set_max_frame_bytes(max_frame_bytes);
     }
 
-    template <typename R, typename... Args>
-    asio::awaitable<void> add_method(named_key_type key, std::function<R(Args...)> f) {
-        co_await add_method(std::move(key), [f = std::move(f)](Args... args) -> asio::awaitable<R> {
-            co_return f(args...);
-        });
+    void set_handler_executor(std::optional<asio::any_io_executor> executor) requires sync::concurrent {
+        m_pubsub.set_handler_executor(std::move(executor));
     }
 
+    // Number of results a streaming method may send ahead of the ones read by the caller
+    void set_stream_window(size_t window) {
+        m_stream_window = std::clamp<size_t>(window, 1, pending_calls_type::max_stream_results);
+    }
+
+    // Methods of the shared registry take precedence over the ones added here
     template <typename F>
-    asio::awaitable<void> add_method(named_key_type key, F && f) {
-        co_await add_method(std::move(key), std::function{std::forward<F>(f)});
+    asio::awaitable<void> add_method(named_key_type key, F && f, method_options options = {}) {
+        auto counters = std::make_shared<details::method_counters>();
+        auto method = std::make_shared<method_type const>(make_method(std::forward<F>(f), counters, options));
+        {
+            std::lock_guard lock{m_local_methods_mutex};
+            m_local_methods.insert_or_assign(key, method);
+            m_local_counters.insert_or_assign(key, std::move(counters));
+        }
+        typename pubsub_type::callback_type callback = [this, method = std::move(method)](frame payload) {
+            return (*method)(*this, std::move(payload), nullptr);
+        };
+        co_await m_pubsub.subscribe(key_type{std::in_place_index<1>, std::move(key)}, std::move(callback));
     }
 
     asio::awaitable<void> remove_method(named_key_type key) {
+        {
+            std::lock_guard lock{m_local_methods_mutex};
+            m_local_methods.erase(key);
+            m_local_counters.erase(key);
+        }
         co_await m_pubsub.unsubscribe({std::in_place_index<1>, std::move(key)});
     }
 
+    // Cancelling the coroutine waiting for the result cancels the method on the peer
     template <typename R, typename... Args>
     asio::awaitable<R> call(named_key_type named_key, Args&&... args) {
+        return send_call<R>(priority::normal, std::nullopt, std::move(named_key), std::forward<Args>(args)...);
+    }
+
+    // With write coalescing on both ends, the call and its result are written ahead of
+    // calls of lower priorities, and large frames of those are fragmented around them
+    template <typename R, typename... Args>
+    asio::awaitable<R> call_with_priority(priority lane, named_key_type named_key, Args&&... args) {
+        return send_call<R>(lane, std::nullopt, std::move(named_key), std::forward<Args>(args)...);
+    }
+
+    // Gives up on the call after the timeout, the method on the peer is cancelled by
+    // then as well. Throws asio::error::timed_out.
+    template <typename R, typename... Args>
+    asio::awaitable<R> call_for(std::chrono::steady_clock::duration timeout, named_key_type named_key, Args&&... args) {
+        return send_call<R>(priority::normal, timeout, std::move(named_key), std::forward<Args>(args)...);
+    }
+
+    // Sends all the calls of the batch in one frame, and waits until all of them completed.
+    // A failing call does not fail the others, its result throws the error instead.
+    asio::awaitable<void> call_batch(batch & calls) {
+        if (calls.m_calls.empty()) {
+            co_return;
+        }
+
+        auto pending = m_pending_calls.acquire();
+        key_type result_key{std::in_place_index<0>, pending.key()};
+
+        // every call carries its arguments as a nested payload, so that the server can
+        // hand them to the method like the payload of a single call
+        byte_writer request, args;
+        co_await wirepump::write(request, uint64_t{calls.m_calls.size()});
+        for (auto & call : calls.m_calls) {
+            args.clear();
+            co_await call.write_args(args);
+            co_await wirepump::write(request, call.key);
+            co_await wirepump::write(request, args.data());
+        }
+
+        co_await m_pubsub.publish_with_flags(frame_flags::batch, std::move(result_key), request.data());
+
+        auto reply = co_await pending.result();
+        span_reader results{co_await read_result<std::span<uint8_t const>>(reply.reader())};
+
+        uint64_t count;
+        co_await wirepump::read(results, count);
+        if (count != calls.m_calls.size()) {
+            throw std::runtime_error("Unexpected number of results in batch");
+        }
+        for (auto & call : calls.m_calls) {
+            std::span<uint8_t const> result;
+            co_await wirepump::read(results, result);
+            co_await call.read_result(result);
+        }
+    }
+
+    // Calls a method taking a stream_writer<T> as its first argument
+    template <typename T, typename... Args>
+    asio::awaitable<result_stream<T>> call_stream(named_key_type named_key, Args&&... args) {
+        static_assert(!details::view_type<T>, "results outlive the frame they are decoded from, they can't be views");
+
+        key_type key{std::in_place_index<1>, std::move(named_key)};
+
+        auto pending = m_pending_calls.acquire_stream();
+        key_type result_key{std::in_place_index<0>, pending.key()};
+
+        uint64_t window = m_stream_window;
+        co_await m_pubsub.publish(std::move(key), std::optional{result_key}, std::optional<uint64_t>{}, window, std::forward<Args>(args)...);
+
+        co_return result_stream<T>{this, std::move(pending), m_stream_window};
+    }
+
+    asio::awaitable<void> run() {
+        try {
+            co_await announce_cacheable();
+            co_await m_pubsub.run();
+        } catch (asio::system_error const & ex) {
+            // closed by close(), which already failed the waiting calls, the endpoint may be gone by now
+            if (ex.code() != asio::error::operation_aborted) {
+                disconnected();
+            }
+            throw;
+        } catch (...) {
+            disconnected();
+            throw;
+        }
+    }
+
+    template <typename token_type>
+    auto run(token_type && token) {
+        return asio::co_spawn(get_executor(), run(), std::forward<token_type>(token));
+    }
+
+    // Adds up the counters of every thread, methods of a shared registry are left to
+    // method_registry::metrics()
+    endpoint_metrics<named_key_type> metrics() {
+        endpoint_metrics<named_key_type> metrics;
+        metrics.connection = m_pubsub.metrics();
+        metrics.invalid_calls = m_invalid_calls.sum(0);
+        std::lock_guard lock{m_local_methods_mutex};
+        for (auto const & [key, counters] : m_local_counters) {
+            metrics.methods.emplace(key, counters->snapshot());
+        }
+        return metrics;
+    }
+
+    // Caches the results of the methods the peer announced as cacheable, by the encoded
+    // arguments of their calls. std::nullopt stops caching and drops the results.
+    void set_result_cache(std::optional<result_cache_options> options) {
+        m_results.set_options(std::move(options));
+    }
+
+    result_cache_stats cache_stats() {
+        return m_results.stats();
+    }
+
+    // Lets the peer cache the results of a method added to this endpoint for up to
+    // `ttl`, zero stops it
+    asio::awaitable<void> set_cacheable(named_key_type key, std::chrono::steady_clock::duration ttl) {
+        {
+            std::lock_guard lock{m_local_methods_mutex};
+            m_local_cache_ttls.insert_or_assign(key, ttl);
+        }
+        co_await announce_cacheable(std::move(key), ttl);
+    }
+
+    // Drops all the results of the method cached by the peer
+    asio::awaitable<void> invalidate(named_key_type key) {
+        co_await m_pubsub.publish_with_flags(priority::high, frame_flags::invalidate, key_type{std::in_place_index<1>, std::move(key)});
+    }
+
+    // Drops the result of the one call with these arguments cached by the peer, the
+    // arguments have to be encoded like the ones of the call
+    template <typename Arg, typename... Args>
+    asio::awaitable<void> invalidate(named_key_type key, Arg const & arg, Args const &... args) {
+        byte_writer encoded;
+        co_await wirepump::write(encoded, arg);
+        (co_await wirepump::write(encoded, args), ...);
+        co_await m_pubsub.publish_with_flags(priority::high, frame_flags::invalidate, key_type{std::in_place_index<1>, std::move(key)}, encoded.data());
+    }
+
+    auto is_open() const {
+        return m_pubsub.is_open();
+    }
+
+    auto close() {
+        disconnected();
+        return m_pubsub.close();
+    }
+
+    // Waits until the methods started by run() completed, once it returned the endpoint
+    // has to outlive them
+    asio::awaitable<void> wait_handlers() {
+        co_await m_pubsub.wait_handlers();
+    }
+
+  private:
+    template <typename R, typename... Args>
+    asio::awaitable<R> send_call(priority lane, std::optional<std::chrono::steady_clock::duration> timeout, named_key_type named_key, Args&&... args) {
+        static_assert(!details::view_type<R>, "results outlive the frame they are decoded from, they can't be views");
+
         key_type key{std::in_place_index<1>, std::move(named_key)};
-        std::string payload = details::serialize<std::tuple<Args...>>({std::forward<Args>(args)...});
 
         if constexpr (std::same_as<R, ignore_result>) {
 
-            co_await m_pubsub.publish(std::move(key), std::optional<key_type>{}, std::move(payload));
+            co_await m_pubsub.publish_with_priority(lane, std::move(key), std::optional<key_type>{}, std::optional<uint64_t>{}, std::forward<Args>(args)...);
             co_return ignore_result{};
 
         } else {
-            key_type result_key = co_await allocate_anonymous_key();
+            // results of cacheable methods are looked up by the encoded arguments
+            std::optional<named_key_type> cached;
+            std::string encoded_args;
+            uint64_t generation = 0;
+            if (m_results.cacheable(std::get<1>(key))) {
+                cached = std::get<1>(key);
+                byte_writer encoded;
+                (co_await wirepump::write(encoded, args), ...);
+                encoded_args.assign(encoded.data().begin(), encoded.data().end());
+                if (auto hit = m_results.find(*cached, encoded_args, generation)) {
+                    span_reader reader{hit->bytes};
+                    reader.consume(hit->offset);
+                    co_return co_await read_result<R>(reader);
+                }
+            }
+
+            auto pending = m_pending_calls.acquire();
+            key_type result_key{std::in_place_index<0>, pending.key()};
+
+            // The call carries how many microseconds the caller waits for it, zero for no
+            // deadline. It is left out when the caller can't give up on it, so that the
+            // peer does not have to set up its cancellation.
+            std::optional<uint64_t> deadline;
+            if (timeout) {
+                deadline = std::max<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(*timeout).count(), 1);
+            } else if (auto state = co_await asio::this_coro::cancellation_state; state.slot().is_connected()) {
+                deadline = 0;
+            }
+
+            co_await m_pubsub.publish_with_priority(lane, std::move(key), std::optional{result_key}, deadline, std::forward<Args>(args)...);
 
-            channel_type<bool, std::string> result_channel{get_executor()};
+            auto result = co_await wait_result(pending, timeout, deadline.has_value());
+            if (!cached) {
+                co_return co_await read_result<R>(result.reader());
+            }
 
-            co_await m_pubsub.subscribe(result_key, [
-                this, result_key, result_channel
-            ](bool success, std::string payload) mutable -> asio::awaitable<void> {
-                co_await m_pubsub.unsubscribe(result_key);
-                co_await release_anonymous_key(result_key);
-                result_channel.try_send(success, std::move(payload));
+            // copied before decoding, and only kept once the result decoded successfully
+            auto copy = copy_result(result);
+            if constexpr (std::same_as<R, void>) {
+                co_await read_result<void>(result.reader());
+                m_results.insert(*cached, std::move(encoded_args), std::move(copy), generation);
+            } else {
+                auto value = co_await read_result<R>(result.reader());
+                m_results.insert(*cached, std::move(encoded_args), std::move(copy), generation);
+                co_return value;
+            }
+        }
+    }
+
+    // The deadline completes the call with an empty frame, which no result ever is.
+    // Late results are dropped once the call is released.
+    asio::awaitable<frame> wait_result(typename pending_calls_type::call & pending, std::optional<std::chrono::steady_clock::duration> timeout, bool cancellable) {
+        std::optional<asio::steady_timer> timer;
+        if (timeout) {
+            timer.emplace(get_executor(), *timeout);
+            timer->async_wait([this, key = pending.key()](asio::error_code ec) {
+                if (!ec) {
+                    frame expired;
+                    m_pending_calls.complete(key, expired);
+                }
             });
+        }
+
+        std::optional<frame> result;
+        std::exception_ptr error;
+        try {
+            result.emplace(co_await pending.result());
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        if (timer) {
+            timer->cancel();
+        }
+
+        if (result && result->remaining() != 0) {
+            co_return std::move(*result);
+        }
 
-            co_await m_pubsub.publish(std::move(key), std::optional{result_key}, std::move(payload));
+        // tell the peer it can stop working on the call
+        if (cancellable) {
+            asio::co_spawn(get_executor(), cancel_remote(pending.key()), asio::detached);
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        throw asio::system_error{asio::error::timed_out};
+    }
 
-            auto [success, result] = co_await result_channel.async_receive();
+    // Keeps the alignment of the result within the frame, for arrays decoded in place
+    static typename details::result_cache<named_key_type, sync>::result copy_result(frame & result) {
+        auto offset = result.reader().position() % alignof(std::max_align_t);
+        auto data = result.reader().buffered();
+        std::vector<uint8_t> bytes(offset + data.size());
+        std::copy(data.begin(), data.end(), bytes.begin() + offset);
+        return {std::move(bytes), offset};
+    }
 
-            if (!success) {
-                throw host_error(std::move(result));
+    void update_results(frame_flags flags, named_key_type const & method, frame & payload) {
+        auto & reader = payload.reader();
+        if (flags == frame_flags::cacheable) {
+            if (auto ttl = details::read_buffered_varint(reader)) {
+                m_results.set_ttl(method, std::chrono::microseconds{std::min<uint64_t>(*ttl, std::numeric_limits<int64_t>::max() / 1000)});
             }
+        } else if (reader.remaining() == 0) {
+            m_results.invalidate(method);
+        } else if (auto size = details::read_buffered_varint(reader); size && *size <= reader.remaining()) {
+            auto args = reader.view(*size);
+            m_results.invalidate(method, std::string{args.begin(), args.end()});
+        }
+    }
 
+    // Lets the peer know which results it may cache, before serving it
+    asio::awaitable<void> announce_cacheable() {
+        std::vector<std::pair<named_key_type, std::chrono::steady_clock::duration>> ttls;
+        if (m_methods) {
+            ttls.assign(m_methods->cache_ttls().begin(), m_methods->cache_ttls().end());
+        }
+        {
+            std::lock_guard lock{m_local_methods_mutex};
+            ttls.insert(ttls.end(), m_local_cache_ttls.begin(), m_local_cache_ttls.end());
+        }
+        for (auto & [key, ttl] : ttls) {
+            co_await announce_cacheable(std::move(key), ttl);
+        }
+    }
+
+    asio::awaitable<void> announce_cacheable(named_key_type key, std::chrono::steady_clock::duration ttl) {
+        uint64_t micros = std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(ttl).count(), 0);
+        co_await m_pubsub.publish_with_flags(priority::high, frame_flags::cacheable, key_type{std::in_place_index<1>, std::move(key)}, micros);
+    }
+
+    asio::awaitable<void> cancel_remote(anonymous_key_type key) {
+        co_await m_pubsub.publish_with_flags(priority::high, frame_flags::cancel, key_type{std::in_place_index<0>, key});
+    }
+
+    void cancel_call(anonymous_key_type key) {
+        std::shared_ptr<running_call> call;
+        {
+            std::lock_guard lock{m_running_mutex};
+            auto it = m_running.find(key);
+            if (it == m_running.end()) {
+                return;
+            }
+            call = it->second;
+        }
+        asio::dispatch(call->strand, [call] {
+            call->cancel();
+        });
+    }
+
+    // Runs a method on the strand of its call, where its cancellation happens as well.
+    // The call is only registered once on the strand, so it can't be cancelled before
+    // its cancellation slot is connected, nor after it is done.
+    template <typename R, typename result_type>
+    asio::awaitable<void> run_cancellable(anonymous_key_type key, uint64_t deadline, std::shared_ptr<running_call> call, asio::awaitable<R> method, std::optional<result_type> & result) {
+        {
+            std::lock_guard lock{m_running_mutex};
+            m_running.insert_or_assign(key, call);
+        }
+
+        if (deadline) {
+            call->deadline.expires_after(std::chrono::microseconds{deadline});
+            call->deadline.async_wait([call](asio::error_code ec) {
+                if (!ec) {
+                    call->cancel();
+                }
+            });
+        }
+
+        std::exception_ptr error;
+        try {
             if constexpr (std::same_as<R, void>) {
-                // Deserialize something of size zero
-                details::deserialize<std::tuple<>>(std::move(result));
+                co_await std::move(method);
+                result.emplace();
             } else {
-                co_return details::deserialize<R>(std::move(result));
+                result.emplace(co_await std::move(method));
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+
+        call->done = true;
+        call->deadline.cancel();
+        {
+            std::lock_guard lock{m_running_mutex};
+            if (auto it = m_running.find(key); it != m_running.end() && it->second == call) {
+                m_running.erase(it);
             }
         }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
     }
 
-    asio::awaitable<void> run() {
-        co_await m_pubsub.run();
+    asio::awaitable<void> invoke(method_registry_ptr methods, method_type const & method, frame payload, uint64_t trace) {
+        co_await method(*this, std::move(payload), nullptr);
+        details::trace(details::trace_event::handler_done, trace);
     }
 
-    template <typename token_type>
-    auto run(token_type && token) {
-        return asio::co_spawn(get_executor(), run(), std::forward<token_type>(token));
+    static std::string invalid_method_message(named_key_type const & key) {
+        if constexpr (requires (std::ostream & o, named_key_type k) {
+            o << k;
+        }) {
+            std::stringstream message;
+            message << "Invalid method key `" << key << "`";
+            return message.str();
+        } else {
+            return "Invalid method key";
+        }
     }
 
-    auto is_open() const {
-        return m_pubsub.is_open();
+    template <typename R>
+    static asio::awaitable<R> read_result(span_reader & reader) {
+        bool success;
+        co_await wirepump::read(reader, success);
+
+        if (!success) {
+            auto message = co_await details::deserialize<std::string>(reader);
+            throw host_error(std::move(message));
+        }
+
+        if constexpr (std::same_as<R, void>) {
+            // Deserialize something of size zero
+            co_await details::deserialize<std::tuple<>>(reader);
+        } else {
+            co_return co_await details::deserialize<R>(reader);
+        }
     }
 
-    auto close() {
-        return m_pubsub.close();
+    // Runs the calls of a batch one after the other, and replies with all of their results
+    asio::awaitable<void> invoke_batch(anonymous_key_type result_key, frame payload, uint64_t trace) {
+        key_type key{std::in_place_index<0>, result_key};
+        auto lane = payload.lane();
+        byte_writer results, result;
+        std::optional<std::string> error;
+
+        try {
+            std::span<uint8_t const> calls_data;
+            co_await wirepump::read(payload.reader(), calls_data);
+            span_reader calls{calls_data};
+
+            uint64_t count;
+            co_await wirepump::read(calls, count);
+            co_await wirepump::write(results, count);
+
+            for (uint64_t i = 0; i < count; ++i) {
+                key_type method_key;
+                std::span<uint8_t const> args;
+                co_await wirepump::read(calls, method_key);
+                co_await wirepump::read(calls, args);
+
+                result.clear();
+                co_await invoke_batched(method_key, args, result);
+                co_await wirepump::write(results, result.data());
+            }
+
+            if (calls.remaining() != 0) {
+                throw std::runtime_error("Unexpected unused bytes in stream");
+            }
+        } catch (std::exception const & ex) {
+            // the batch itself is malformed, the caller can't tell its calls apart
+            error = ex.what();
+        }
+
+        size_t sent;
+        if (error) {
+            sent = co_await m_pubsub.publish_with_priority(lane, key, false, *error);
+        } else {
+            sent = co_await m_pubsub.publish_with_priority(lane, key, true, results.data());
+        }
+        details::trace(details::trace_event::reply_sent, 0, sent);
+        details::trace(details::trace_event::handler_done, trace);
     }
 
-  private:
-    asio::awaitable<key_type> allocate_anonymous_key() {
-        auto lock = co_await m_anonymous_key_mutex.lock();
-        anonymous_key_type key;
-        if (!m_anonymous_key_pool.empty()) {
-            key = m_anonymous_key_pool.extract(m_anonymous_key_pool.begin()).value();
+    asio::awaitable<void> invoke_batched(key_type const & key, std::span<uint8_t const> args, byte_writer & result) {
+        std::shared_ptr<method_type const> local;
+        method_type const * method = nullptr;
+
+        if (key.index() == 1) {
+            if (m_methods) {
+                method = m_methods->find(std::get<1>(key));
+            }
+            if (!method) {
+                std::lock_guard lock{m_local_methods_mutex};
+                auto it = m_local_methods.find(std::get<1>(key));
+                if (it != m_local_methods.end()) {
+                    local = it->second;
+                    method = local.get();
+                }
+            }
+        }
+
+        if (!method) {
+            m_invalid_calls.add(0);
+            std::string message = "Invalid method key";
+            if (key.index() == 1) {
+                message = invalid_method_message(std::get<1>(key));
+            }
+            co_await wirepump::write(result, false);
+            co_await wirepump::write(result, message);
+            co_return;
+        }
+
+        // the method owns its payload, like a frame received on its own
+        auto storage = details::frame_buffer_pool::acquire(args.size());
+        std::copy(args.begin(), args.end(), storage.begin());
+        co_await (*method)(*this, frame{std::move(storage)}, &result);
+    }
+
+    // Zero credits cancel the stream
+    asio::awaitable<void> grant_credits(anonymous_key_type key, uint64_t credits) {
+        co_await m_pubsub.publish_with_flags(priority::high, frame_flags::stream_credit, key_type{std::in_place_index<0>, key}, credits);
+    }
+
+    void add_credits(anonymous_key_type key, frame & payload) {
+        auto credits = details::read_buffered_varint(payload.reader());
+        if (!credits) {
+            return;
+        }
+
+        std::lock_guard lock{m_streams_mutex};
+        auto it = m_streams.find(key);
+        if (it == m_streams.end()) {
+            return;
+        }
+        if (*credits == 0) {
+            it->second->cancelled.store(true, std::memory_order_release);
         } else {
-            key = m_next_anonymous_key++;
+            it->second->available.fetch_add(*credits, std::memory_order_release);
         }
-        co_return key_type{std::in_place_index<0>, std::move(key)};
+        it->second->granted.try_send();
     }
 
-    asio::awaitable<void> release_anonymous_key(key_type key) {
-        auto lock = co_await m_anonymous_key_mutex.lock();
-        m_anonymous_key_pool.insert(std::get<0>(std::move(key)));
+    std::shared_ptr<stream_credits> open_stream(anonymous_key_type key, uint64_t credits) {
+        auto stream = std::make_shared<stream_credits>(get_executor(), credits);
+        std::lock_guard lock{m_streams_mutex};
+        if (m_streams_cancelled) {
+            stream->cancelled.store(true, std::memory_order_release);
+        } else {
+            m_streams.insert_or_assign(key, stream);
+        }
+        return stream;
+    }
+
+    void close_stream(anonymous_key_type key) {
+        std::lock_guard lock{m_streams_mutex};
+        m_streams.erase(key);
+    }
+
+    // Calls made to the peer, by the methods as well, fail instead of waiting for results
+    // that can't arrive anymore
+    void disconnected() {
+        cancel_streams();
+        m_pending_calls.close();
+    }
+
+    // Nobody is left to grant credits, streams waiting for some give up
+    void cancel_streams() {
+        std::lock_guard lock{m_streams_mutex};
+        m_streams_cancelled = true;
+        for (auto & [key, stream] : m_streams) {
+            stream->cancelled.store(true, std::memory_order_release);
+            stream->granted.try_send();
+        }
+    }
+
+    template <typename R>
+    using flights_type = details::single_flight<std::conditional_t<std::same_as<R, void>, std::monostate, R>, channel_type>;
+
+    // The method outlives the call, so the coroutine only holds a reference to it
+    template <typename R, typename... Args>
+    static asio::awaitable<void> invoke_method(basic_ipc_endpoint & self, std::function<asio::awaitable<R>(Args...)> const & f, details::method_counters & counters, std::shared_ptr<flights_type<R>> const & flights, frame payload, byte_writer * batched) {
+        using result_type = std::conditional_t<std::same_as<R, void>, std::monostate, R>;
+
+        details::method_counters::measurement measurement{counters, payload.remaining()};
+        // results are sent with the priority of the call
+        auto lane = payload.lane();
+
+        std::optional<key_type> result_key;
+        std::optional<uint64_t> deadline;
+        co_await wirepump::read(payload.reader(), result_key);
+        co_await wirepump::read(payload.reader(), deadline);
+
+        std::optional<result_type> result;
+        std::string error;
+        std::shared_ptr<running_call> call;
+
+        // calls with a deadline run on their own, like batched ones. The others share a
+        // single run, cancelling one of them only drops its own result.
+        std::optional<typename flights_type<R>::leader> leader;
+        typename flights_type<R>::outcome_ptr shared;
+        if (flights && result_key && !deadline.value_or(0) && !batched) {
+            auto args = payload.reader().buffered();
+            auto executor = co_await asio::this_coro::executor;
+            auto joined = flights->join(std::string{args.begin(), args.end()}, executor);
+            if (auto first = std::get_if<0>(&joined)) {
+                leader.emplace(std::move(*first));
+            } else if (deadline && result_key->index() == 0) {
+                std::optional<typename flights_type<R>::outcome_ptr> received;
+                call = std::make_shared<running_call>(executor);
+                auto waiting = self.run_cancellable(std::get<0>(*result_key), 0, call, std::get<1>(joined).async_receive(), received);
+                try {
+                    co_await asio::co_spawn(call->strand, std::move(waiting), asio::bind_cancellation_slot(call->signal.slot(), asio::use_awaitable));
+                } catch (...) {
+                    // only ever cancelled
+                }
+                if (!received) {
+                    co_return;
+                }
+                shared = std::move(*received);
+            } else {
+                shared = co_await std::get<1>(joined).async_receive();
+            }
+        }
+
+        if (!shared) {
+            try {
+                auto args = co_await details::deserialize<std::tuple<std::remove_cvref_t<Args>...>>(payload.reader());
+                if (deadline && result_key && result_key->index() == 0 && !batched) {
+                    call = std::make_shared<running_call>(co_await asio::this_coro::executor);
+                    auto running = self.run_cancellable(std::get<0>(*result_key), *deadline, call, std::apply(f, std::move(args)), result);
+                    if (leader) {
+                        // the others wait for this run, cancelling the call does not stop it
+                        co_await asio::co_spawn(call->strand, std::move(running), asio::use_awaitable);
+                    } else {
+                        co_await asio::co_spawn(call->strand, std::move(running), asio::bind_cancellation_slot(call->signal.slot(), asio::use_awaitable));
+                    }
+                } else if constexpr (std::same_as<R, void>) {
+                    co_await std::apply(f, std::move(args));
+                    result.emplace();
+                } else {
+                    result.emplace(co_await std::apply(f, std::move(args)));
+                }
+            } catch (std::exception const & ex) {
+                error = ex.what();
+            } catch (...) {
+                error = "Unknown exception";
+            }
+        }
+
+        if (leader) {
+            // every waiting call encodes the outcome into its own reply
+            shared = leader->complete({std::move(result), std::move(error)});
+        }
+
+        if (call && call->cancelled) {
+            // the caller gave up on the result
+            co_return;
+        }
+        auto const & outcome = shared ? shared->result : result;
+        auto const & message = shared ? shared->error : error;
+
+        measurement.failed = !outcome;
+
+        if (batched) {
+            auto position = batched->position();
+            co_await wirepump::write(*batched, outcome.has_value());
+            if (!outcome) {
+                co_await wirepump::write(*batched, message);
+            } else if constexpr (!std::same_as<R, void>) {
+                co_await wirepump::write(*batched, *outcome);
+            }
+            measurement.bytes_out = batched->position() - position;
+            co_return;
+        }
+
+        if (!result_key) {
+            co_return;
+        }
+
+        if (!outcome) {
+            measurement.bytes_out = co_await self.m_pubsub.publish_with_priority(lane, *result_key, false, message);
+        } else if constexpr (std::same_as<R, void>) {
+            measurement.bytes_out = co_await self.m_pubsub.publish_with_priority(lane, *result_key, true);
+        } else {
+            measurement.bytes_out = co_await self.m_pubsub.publish_with_priority(lane, *result_key, true, *outcome);
+        }
+        details::trace(details::trace_event::reply_sent, 0, measurement.bytes_out);
+    }
+
+    template <typename T, typename... Args>
+    static asio::awaitable<void> invoke_stream_method(basic_ipc_endpoint & self, std::function<asio::awaitable<void>(stream_writer<T> &, Args...)> const & f, details::method_counters & counters, frame payload, byte_writer * batched) {
+        details::method_counters::measurement measurement{counters, payload.remaining()};
+
+        if (batched) {
+            measurement.failed = true;
+            co_await wirepump::write(*batched, false);
+            co_await wirepump::write(*batched, std::string{"Streaming methods can't be batched"});
+            co_return;
+        }
+
+        auto lane = payload.lane();
+        std::optional<key_type> result_key;
+        std::optional<uint64_t> deadline;
+        co_await wirepump::read(payload.reader(), result_key);
+        co_await wirepump::read(payload.reader(), deadline);
+
+        std::shared_ptr<stream_credits> stream;
+        bool success = false;
+        std::string error;
+
+        try {
+            if (!result_key || result_key->index() != 0) {
+                throw std::runtime_error("Streaming methods have to be called with call_stream");
+            }
+            auto stream_key = std::get<0>(*result_key);
+
+            // opened before decoding the arguments, so that a cancellation arriving
+            // meanwhile finds it
+            uint64_t credits;
+            co_await wirepump::read(payload.reader(), credits);
+            stream = self.open_stream(stream_key, credits);
+
+            auto args = co_await details::deserialize<std::tuple<std::remove_cvref_t<Args>...>>(payload.reader());
+            stream_writer<T> writer{[&self, &measurement, stream, lane, key = *result_key](T const & item) -> asio::awaitable<void> {
+                co_await stream->acquire();
+                measurement.bytes_out += co_await self.m_pubsub.publish_with_priority(lane, key, stream_item, item);
+            }};
+
+            co_await std::apply(f, std::tuple_cat(std::tie(writer), std::move(args)));
+            success = true;
+        } catch (std::exception const & ex) {
+            error = ex.what();
+        } catch (...) {
+            error = "Unknown exception";
+        }
+
+        if (stream) {
+            self.close_stream(std::get<0>(*result_key));
+        }
+
+        measurement.failed = !success;
+
+        if (!result_key) {
+            co_return;
+        }
+
+        size_t sent;
+        if (!success) {
+            sent = co_await self.m_pubsub.publish_with_priority(lane, *result_key, false, error);
+        } else {
+            sent = co_await self.m_pubsub.publish_with_priority(lane, *result_key, true);
+        }
+        measurement.bytes_out += sent;
+        details::trace(details::trace_event::reply_sent, 0, sent);
+    }
+
+    // The method keeps its counters alive, metrics() may hold on to them as well
+    using counters_ptr = std::shared_ptr<details::method_counters>;
+
+    // Every call of a stream gets its own results, they are never shared
+    template <typename T, typename... Args>
+    static method_type make_method(std::function<asio::awaitable<void>(stream_writer<T> &, Args...)> f, counters_ptr counters, method_options) {
+        return [f = std::move(f), counters = std::move(counters)](basic_ipc_endpoint & self, frame payload, byte_writer * batched) {
+            return invoke_stream_method(self, f, *counters, std::move(payload), batched);
+        };
+    }
+
+    template <typename R, typename... Args>
+    static method_type make_method(std::function<asio::awaitable<R>(Args...)> f, counters_ptr counters, method_options options) {
+        auto flights = options.single_flight ? std::make_shared<flights_type<R>>() : nullptr;
+        return [f = std::move(f), counters = std::move(counters), flights = std::move(flights)](basic_ipc_endpoint & self, frame payload, byte_writer * batched) {
+            return invoke_method(self, f, *counters, flights, std::move(payload), batched);
+        };
+    }
+
+    template <typename R, typename... Args>
+    static method_type make_method(std::function<R(Args...)> f, counters_ptr counters, method_options options) {
+        return make_method(std::function{[f = std::move(f)](Args... args) -> asio::awaitable<R> {
+            co_return f(args...);
+        }}, std::move(counters), options);
+    }
+
+    template <typename F>
+    static method_type make_method(F && f, counters_ptr counters, method_options options) {
+        return make_method(std::function{std::forward<F>(f)}, std::move(counters), options);
     }
 };
 
 template <typename key_type>
 using ipc_endpoint = basic_ipc_endpoint<key_type, buffered_socket<asio::generic::stream_protocol::socket>, async_channel>;
 
+// Skips all synchronization, for endpoints that only run on one thread or strand
+template <typename key_type>
+using single_threaded_ipc_endpoint = basic_ipc_endpoint<key_type, buffered_socket<asio::generic::stream_protocol::socket>, single_threaded_async_channel>;
+
 }
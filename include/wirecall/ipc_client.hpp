@@ -0,0 +1,211 @@
+#pragma once
+
+#include "wirecall/ipc.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+enum class striping {
+    // every connection gets the next call in turn
+    round_robin,
+    // the connection with the fewest calls waiting for their results gets the call
+    least_outstanding,
+};
+
+struct ipc_client_options {
+    // number of connections to the server, calls are spread across them
+    size_t connections = std::max(1u, std::thread::hardware_concurrency());
+    striping policy = striping::least_outstanding;
+};
+
+// Calls methods of a single server over several connections, so that calls don't all
+// queue on the locks and the socket of a single endpoint. Connections run on the
+// executor the client is created with, a thread pool lets them run on many threads.
+template <typename endpoint_type, typename protocol_type>
+struct basic_ipc_client {
+  public:
+    using method_key_type = typename endpoint_type::method_key_type;
+    using batch = typename endpoint_type::batch;
+
+  private:
+    using socket_type = typename protocol_type::socket;
+
+    // shared with the coroutine running the endpoint, which may outlive the client
+    struct stripe {
+        endpoint_type endpoint;
+        std::atomic<size_t> outstanding = 0;
+
+        explicit stripe(socket_type socket)
+          : endpoint{std::move(socket)}
+        {}
+    };
+
+    // counts a call on its connection until it completes, however it completes, and
+    // keeps the connection alive for as long as the call is suspended on it
+    struct outstanding_call {
+        std::shared_ptr<stripe> target;
+
+        explicit outstanding_call(std::shared_ptr<stripe> s)
+          : target{std::move(s)}
+        {
+            target->outstanding.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        outstanding_call(outstanding_call const &) = delete;
+        outstanding_call & operator=(outstanding_call const &) = delete;
+
+        ~outstanding_call() {
+            target->outstanding.fetch_sub(1, std::memory_order_relaxed);
+        }
+    };
+
+    asio::any_io_executor m_executor;
+    ipc_client_options m_options;
+    std::vector<std::shared_ptr<stripe>> m_stripes;
+    std::atomic<size_t> m_next = 0;
+
+  public:
+    basic_ipc_client(asio::any_io_executor executor, ipc_client_options options = {})
+      : m_executor{std::move(executor)}
+      , m_options{std::move(options)}
+    {
+        m_options.connections = std::max<size_t>(m_options.connections, 1);
+    }
+
+    basic_ipc_client(basic_ipc_client const &) = delete;
+
+    ~basic_ipc_client() {
+        close();
+    }
+
+    // Opens all the connections, and runs them until they are closed
+    asio::awaitable<void> connect(typename protocol_type::endpoint const & endpoint) {
+        if (!m_stripes.empty()) {
+            throw std::logic_error("Client already connected");
+        }
+
+        std::vector<std::shared_ptr<stripe>> stripes;
+        for (size_t i = 0; i < m_options.connections; ++i) {
+            socket_type socket{m_executor};
+            co_await socket.async_connect(endpoint, asio::use_awaitable);
+            if constexpr (std::same_as<protocol_type, asio::ip::tcp>) {
+                socket.set_option(asio::ip::tcp::no_delay{true});
+            }
+            stripes.push_back(std::make_shared<stripe>(std::move(socket)));
+        }
+
+        m_stripes = std::move(stripes);
+        for (auto & s : m_stripes) {
+            asio::co_spawn(m_executor, run(s), asio::detached);
+        }
+    }
+
+    // Configures every connection, like with set_compression, once connected
+    template <typename F>
+    void for_each_endpoint(F && f) {
+        for (auto & s : m_stripes) {
+            f(s->endpoint);
+        }
+    }
+
+    template <typename R, typename... Args>
+    asio::awaitable<R> call(method_key_type key, Args&&... args) {
+        outstanding_call counted{next()};
+        co_return co_await counted.target->endpoint.template call<R>(std::move(key), std::forward<Args>(args)...);
+    }
+
+    template <typename R, typename... Args>
+    asio::awaitable<R> call_for(std::chrono::steady_clock::duration timeout, method_key_type key, Args&&... args) {
+        outstanding_call counted{next()};
+        co_return co_await counted.target->endpoint.template call_for<R>(timeout, std::move(key), std::forward<Args>(args)...);
+    }
+
+    template <typename R, typename... Args>
+    asio::awaitable<R> call_with_priority(priority lane, method_key_type key, Args&&... args) {
+        outstanding_call counted{next()};
+        co_return co_await counted.target->endpoint.template call_with_priority<R>(lane, std::move(key), std::forward<Args>(args)...);
+    }
+
+    // All the calls of a batch go over the same connection
+    asio::awaitable<void> call_batch(batch & calls) {
+        outstanding_call counted{next()};
+        co_await counted.target->endpoint.call_batch(calls);
+    }
+
+    size_t connections() const {
+        return m_stripes.size();
+    }
+
+    // The metrics of every connection, in the order they were opened
+    auto metrics() {
+        std::vector<decltype(m_stripes.front()->endpoint.metrics())> metrics;
+        for (auto & s : m_stripes) {
+            metrics.push_back(s->endpoint.metrics());
+        }
+        return metrics;
+    }
+
+    void close() {
+        for (auto & s : m_stripes) {
+            if (s->endpoint.is_open()) {
+                s->endpoint.close();
+            }
+        }
+    }
+
+  private:
+    static asio::awaitable<void> run(std::shared_ptr<stripe> s) {
+        try {
+            co_await s->endpoint.run();
+        } catch (...) {
+            // the connection is skipped from now on
+        }
+    }
+
+    // Closed connections are skipped, unless all of them are
+    std::shared_ptr<stripe> next() {
+        if (m_stripes.empty()) {
+            throw std::logic_error("Client not connected");
+        }
+
+        auto start = m_next.fetch_add(1, std::memory_order_relaxed);
+        auto count = m_stripes.size();
+        std::shared_ptr<stripe> const * best = nullptr;
+        for (size_t i = 0; i < count; ++i) {
+            auto & candidate = m_stripes[(start + i) % count];
+            if (!candidate->endpoint.is_open()) {
+                continue;
+            }
+            if (m_options.policy == striping::round_robin) {
+                return candidate;
+            }
+            // ties go to the connection next in turn
+            if (!best || candidate->outstanding.load(std::memory_order_relaxed) < (*best)->outstanding.load(std::memory_order_relaxed)) {
+                best = &candidate;
+            }
+        }
+        return best ? *best : m_stripes[start % count];
+    }
+};
+
+template <typename key_type, typename protocol_type = asio::ip::tcp>
+using ipc_client = basic_ipc_client<ipc_endpoint<key_type>, protocol_type>;
+
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "wirecall/ipc.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/executor_work_guard.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/socket_base.hpp>
+#include <asio/use_awaitable.hpp>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+struct ipc_server_options {
+    // number of threads, each running its own io_context, connections are spread across
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    // give every thread its own acceptor bound with SO_REUSEPORT and let the kernel
+    // balance connections, instead of handing them out round robin from a single acceptor
+    bool reuse_port = false;
+    // pin every thread to its own cpu
+    bool pin_threads = false;
+    // per connection limit of methods running at once, zero for no limit
+    size_t max_in_flight = 0;
+    // run the methods on this executor instead of the connection's thread
+    std::optional<asio::any_io_executor> handler_executor = std::nullopt;
+    // connections sending larger frames are closed
+    size_t max_frame_bytes = 64 * 1024 * 1024;
+};
+
+// Accepts connections and serves the methods of a single shared registry on all of them.
+// Setting up a connection doesn't register any method, and the registry can't be
+// modified once the server is created.
+template <typename endpoint_type, typename protocol_type>
+struct basic_ipc_server {
+    // the connections run on several threads and share the state of the registry
+    static_assert(endpoint_type::concurrent, "The endpoints of a server must be thread safe");
+
+  public:
+    using method_registry = typename endpoint_type::method_registry;
+    using method_registry_ptr = typename endpoint_type::method_registry_ptr;
+    using method_key_type = typename endpoint_type::method_key_type;
+
+  private:
+    using acceptor_type = typename protocol_type::acceptor;
+    using socket_type = typename protocol_type::socket;
+    using work_guard_type = asio::executor_work_guard<asio::io_context::executor_type>;
+
+    struct shard {
+        asio::io_context context{1};
+        std::optional<acceptor_type> acceptor = std::nullopt;
+        std::optional<work_guard_type> work = std::nullopt;
+        std::thread thread = {};
+        // the connections being served, for invalidations to reach them
+        std::mutex endpoints_mutex;
+        std::list<std::weak_ptr<endpoint_type>> endpoints = {};
+    };
+
+    method_registry_ptr m_methods;
+    ipc_server_options m_options;
+    std::vector<std::unique_ptr<shard>> m_shards;
+    std::atomic<size_t> m_next_shard = 0;
+    std::atomic<bool> m_stopping = false;
+    typename protocol_type::endpoint m_local_endpoint;
+
+  public:
+    basic_ipc_server(typename protocol_type::endpoint const & endpoint, method_registry methods, ipc_server_options options = {})
+      : m_methods{std::make_shared<method_registry const>(std::move(methods))}
+      , m_options{std::move(options)}
+      , m_local_endpoint{endpoint}
+    {
+        m_options.threads = std::max<size_t>(m_options.threads, 1);
+        for (size_t i = 0; i < m_options.threads; ++i) {
+            m_shards.push_back(std::make_unique<shard>());
+        }
+
+        if (m_options.reuse_port) {
+            for (auto & s : m_shards) {
+                open(*s, m_local_endpoint);
+                // the other acceptors bind to the port picked by the first one
+                m_local_endpoint = s->acceptor->local_endpoint();
+            }
+        } else {
+            open(*m_shards.front(), m_local_endpoint);
+            m_local_endpoint = m_shards.front()->acceptor->local_endpoint();
+        }
+    }
+
+    basic_ipc_server(basic_ipc_server const &) = delete;
+
+    ~basic_ipc_server() {
+        stop();
+        for (auto & s : m_shards) {
+            if (s->thread.joinable()) s->thread.join();
+        }
+    }
+
+    auto local_endpoint() const {
+        return m_local_endpoint;
+    }
+
+    // The methods of the registry, counted across all the connections
+    auto metrics() const {
+        return m_methods->metrics();
+    }
+
+    // Serves connections until stop() is called
+    void run() {
+        for (auto & s : m_shards) {
+            s->work.emplace(s->context.get_executor());
+            if (s->acceptor) {
+                asio::co_spawn(s->context, accept(*s), asio::detached);
+            }
+        }
+
+        for (size_t i = 0; i < m_shards.size(); ++i) {
+            auto & s = *m_shards[i];
+            s.thread = std::thread([&s]() {
+                s.context.run();
+            });
+            if (m_options.pin_threads) {
+                pin(s.thread, i);
+            }
+        }
+
+        for (auto & s : m_shards) {
+            s->thread.join();
+        }
+    }
+
+    // Drops the results of the method cached by every client, or with arguments only
+    // the result of the call with those arguments
+    template <typename... Args>
+    void invalidate(method_key_type key, Args const &... args) {
+        for (auto & s : m_shards) {
+            std::lock_guard lock{s->endpoints_mutex};
+            for (auto & connection : s->endpoints) {
+                if (auto endpoint = connection.lock()) {
+                    asio::co_spawn(s->context, push_invalidation(std::move(endpoint), key, std::tuple<std::decay_t<Args>...>{args...}), asio::detached);
+                }
+            }
+        }
+    }
+
+    // Stops accepting connections and closes the ones being served. run() returns once
+    // the methods they were running completed, wherever they run.
+    void stop() {
+        m_stopping.store(true);
+        for (auto & s : m_shards) {
+            asio::post(s->context, [&s = *s]() {
+                if (s.acceptor) {
+                    s.acceptor->close();
+                }
+                s.work.reset();
+                std::lock_guard lock{s.endpoints_mutex};
+                for (auto & connection : s.endpoints) {
+                    if (auto endpoint = connection.lock(); endpoint && endpoint->is_open()) {
+                        endpoint->close();
+                    }
+                }
+            });
+        }
+    }
+
+  private:
+    void open(shard & s, typename protocol_type::endpoint const & endpoint) {
+        acceptor_type acceptor{s.context};
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(asio::socket_base::reuse_address(true));
+        if (m_options.reuse_port) {
+#if defined(SO_REUSEPORT)
+            acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+            throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+        }
+        acceptor.bind(endpoint);
+        acceptor.listen();
+        s.acceptor.emplace(std::move(acceptor));
+    }
+
+    static void pin(std::thread & thread, size_t index) {
+#if defined(__linux__)
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+#endif
+    }
+
+    shard & next_shard(shard & self) {
+        if (m_options.reuse_port) {
+            return self;
+        }
+        return *m_shards[m_next_shard.fetch_add(1, std::memory_order_relaxed) % m_shards.size()];
+    }
+
+    asio::awaitable<void> accept(shard & self) {
+        while (self.acceptor->is_open()) {
+            auto & target = next_shard(self);
+            socket_type socket{target.context};
+            asio::error_code ec;
+            co_await self.acceptor->async_accept(socket, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                if (ec == asio::error::operation_aborted) co_return;
+                continue;
+            }
+            asio::co_spawn(target.context, serve(target, std::move(socket)), asio::detached);
+        }
+    }
+
+    asio::awaitable<void> serve(shard & self, socket_type socket) {
+        auto endpoint = std::make_shared<endpoint_type>(std::move(socket), m_methods);
+        endpoint->set_max_in_flight(m_options.max_in_flight);
+        endpoint->set_handler_executor(m_options.handler_executor);
+        endpoint->set_max_frame_bytes(m_options.max_frame_bytes);
+
+        typename std::list<std::weak_ptr<endpoint_type>>::iterator registered;
+        {
+            std::lock_guard lock{self.endpoints_mutex};
+            registered = self.endpoints.insert(self.endpoints.end(), endpoint);
+        }
+        // accepted while stopping, after its shard closed the others
+        if (m_stopping.load()) {
+            endpoint->close();
+        }
+        try {
+            co_await endpoint->run();
+        } catch (...) {
+            // the client went away
+        }
+        // the methods may still be running on the handler executor
+        co_await endpoint->wait_handlers();
+        std::lock_guard lock{self.endpoints_mutex};
+        self.endpoints.erase(registered);
+    }
+
+    template <typename... Args>
+    static asio::awaitable<void> push_invalidation(std::shared_ptr<endpoint_type> endpoint, method_key_type key, std::tuple<Args...> args) {
+        co_await std::apply([&](auto const &... arguments) {
+            return endpoint->invalidate(std::move(key), arguments...);
+        }, args);
+    }
+};
+
+template <typename key_type, typename protocol_type = asio::ip::tcp>
+using ipc_server = basic_ipc_server<ipc_endpoint<key_type>, protocol_type>;
+
+}
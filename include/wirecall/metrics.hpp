@@ -0,0 +1,232 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+namespace wirecall {
+
+// Latencies counted in buckets of powers of two microseconds, the first one holding
+// everything below a microsecond and the last one everything above its lower bound
+struct latency_histogram {
+    static constexpr size_t buckets = 24;
+
+    std::array<uint64_t, buckets> counts = {};
+
+    static size_t bucket(std::chrono::steady_clock::duration latency) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        size_t index = 0;
+        for (; us > 0 && index + 1 < buckets; us >>= 1) {
+            ++index;
+        }
+        return index;
+    }
+
+    // Exclusive upper bound of the bucket
+    static std::chrono::microseconds upper_bound(size_t bucket) {
+        return std::chrono::microseconds{int64_t{1} << bucket};
+    }
+
+    uint64_t count() const {
+        uint64_t total = 0;
+        for (auto n : counts) {
+            total += n;
+        }
+        return total;
+    }
+
+    // Upper bound of the bucket holding the quantile `q`, zero without any sample
+    std::chrono::microseconds percentile(double q) const {
+        auto total = count();
+        if (total == 0) {
+            return std::chrono::microseconds{0};
+        }
+        auto rank = static_cast<uint64_t>(q * (total - 1));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets; ++i) {
+            seen += counts[i];
+            if (seen > rank) {
+                return upper_bound(i);
+            }
+        }
+        return upper_bound(buckets - 1);
+    }
+};
+
+// Counted when the method completes, except for in_flight which is how many are running.
+// Bytes in are the payloads of the calls, bytes out the frames of their results.
+struct method_metrics {
+    uint64_t calls = 0;
+    uint64_t errors = 0;
+    uint64_t in_flight = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    latency_histogram latency = {};
+};
+
+// Frames and bytes of frame bodies, as they go over the connection, compressed or not.
+// handlers_in_flight is how many received frames are being handled by subscriptions.
+struct connection_metrics {
+    uint64_t frames_in = 0;
+    uint64_t frames_out = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t handlers_in_flight = 0;
+};
+
+template <typename key_type>
+struct endpoint_metrics {
+    connection_metrics connection = {};
+    // calls of methods that don't exist on this endpoint
+    uint64_t invalid_calls = 0;
+    // the methods added to this endpoint, the ones of a shared registry are counted by the registry
+    std::unordered_map<key_type, method_metrics> methods = {};
+};
+
+namespace details {
+
+#if defined(WIRECALL_DISABLE_METRICS)
+inline constexpr bool metrics_enabled = false;
+#else
+inline constexpr bool metrics_enabled = true;
+#endif
+
+inline constexpr size_t metrics_shards = 16;
+
+// Threads are spread round robin over the shards
+inline size_t metrics_shard() {
+    static std::atomic<size_t> next = 0;
+    thread_local size_t shard = next.fetch_add(1, std::memory_order_relaxed) % metrics_shards;
+    return shard;
+}
+
+// Every thread adds to the counters of its own shard, and they are only summed up when
+// read, so that threads counting the same thing don't contend on the same cache line.
+// Without metrics there are no shards and adding does nothing.
+template <size_t size>
+struct sharded_counters {
+  private:
+    struct alignas(64) shard {
+        std::array<std::atomic<uint64_t>, size> values = {};
+    };
+
+    std::array<shard, metrics_enabled ? metrics_shards : 0> m_shards = {};
+
+  public:
+    void add(size_t counter, uint64_t n = 1) {
+        if constexpr (metrics_enabled) {
+            m_shards[metrics_shard()].values[counter].fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t sum(size_t counter) const {
+        uint64_t total = 0;
+        for (auto const & shard : m_shards) {
+            total += shard.values[counter].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+struct method_counters {
+  private:
+    enum counter : size_t { started, calls, errors, bytes_in, bytes_out, latency };
+
+    sharded_counters<latency + latency_histogram::buckets> m_counters;
+
+  public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    // A running call, counted once it is destroyed, however the method completed
+    struct measurement {
+      private:
+        method_counters & m_counters;
+        time_point m_start;
+
+      public:
+        bool failed = false;
+        size_t bytes_out = 0;
+
+        measurement(method_counters & counters, size_t bytes_in)
+          : m_counters{counters}
+          , m_start{counters.start(bytes_in)}
+        {}
+
+        measurement(measurement const &) = delete;
+        measurement & operator=(measurement const &) = delete;
+
+        ~measurement() {
+            m_counters.finish(m_start, failed, bytes_out);
+        }
+    };
+
+    time_point start(size_t bytes) {
+        if constexpr (metrics_enabled) {
+            m_counters.add(started);
+            m_counters.add(bytes_in, bytes);
+            return std::chrono::steady_clock::now();
+        } else {
+            return {};
+        }
+    }
+
+    void finish(time_point start, bool error, size_t bytes) {
+        if constexpr (metrics_enabled) {
+            m_counters.add(latency + latency_histogram::bucket(std::chrono::steady_clock::now() - start));
+            m_counters.add(bytes_out, bytes);
+            if (error) {
+                m_counters.add(errors);
+            }
+            // counted last, so that in_flight never goes below zero
+            m_counters.add(calls);
+        }
+    }
+
+    method_metrics snapshot() const {
+        method_metrics metrics;
+        metrics.calls = m_counters.sum(calls);
+        metrics.errors = m_counters.sum(errors);
+        metrics.bytes_in = m_counters.sum(bytes_in);
+        metrics.bytes_out = m_counters.sum(bytes_out);
+        for (size_t i = 0; i < latency_histogram::buckets; ++i) {
+            metrics.latency.counts[i] = m_counters.sum(latency + i);
+        }
+        auto started_calls = m_counters.sum(started);
+        metrics.in_flight = started_calls > metrics.calls ? started_calls - metrics.calls : 0;
+        return metrics;
+    }
+};
+
+struct connection_counters {
+  private:
+    enum counter : size_t { frames_in, frames_out, bytes_in, bytes_out, count };
+
+    sharded_counters<count> m_counters;
+
+  public:
+    void received(size_t bytes) {
+        m_counters.add(frames_in);
+        m_counters.add(bytes_in, bytes);
+    }
+
+    void sent(size_t bytes) {
+        m_counters.add(frames_out);
+        m_counters.add(bytes_out, bytes);
+    }
+
+    connection_metrics snapshot() const {
+        connection_metrics metrics;
+        metrics.frames_in = m_counters.sum(frames_in);
+        metrics.frames_out = m_counters.sum(frames_out);
+        metrics.bytes_in = m_counters.sum(bytes_in);
+        metrics.bytes_out = m_counters.sum(bytes_out);
+        return metrics;
+    }
+};
+
+}
+
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include "wirecall/frame.hpp"
+#include "wirecall/sync.hpp"
+
+#include <asio/awaitable.hpp>
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace wirecall::details {
+
+// Table of the calls waiting for a result, indexed by the anonymous key the result is
+// sent back on. A key packs a slot index with the generation of the slot, so results
+// for a slot that has been reused since are recognized and dropped.
+// Slots are recycled through a lock-free free list and own their result channel, so
+// issuing and completing a call takes no locks and does not allocate in steady state.
+// Growing the table only happens when all slots are in use. Single threaded
+// endpoints get the same table without atomics.
+// A stream is a call receiving many results on the same key, it stays armed until
+// it is released and buffers up to max_stream_results of them in a channel of its own.
+// A stream receiving more than that fails once the buffered results are read.
+template <template <typename...> typename channel_type>
+struct pending_calls {
+  public:
+    using key_type = uint64_t;
+
+    static constexpr size_t max_stream_results = 64;
+
+  private:
+    using sync = sync_traits<channel_type>;
+
+    static constexpr size_t index_bits = 24;
+    static constexpr size_t first_chunk_bits = 6;
+    static constexpr size_t max_chunks = index_bits - first_chunk_bits;
+
+    struct slot {
+        typename sync::template atomic<uint32_t> generation = 0;
+        // generation of the call waiting on this slot, or 0 when it already has its result
+        typename sync::template atomic<uint32_t> armed = 0;
+        typename sync::template atomic<uint32_t> next_free = 0;
+        typename sync::template atomic<bool> stream = false;
+        // set while a result is being handed to a stream
+        typename sync::template atomic<bool> delivering = false;
+        // set when a stream received a result its channel had no room for
+        typename sync::template atomic<bool> overflowed = false;
+        channel_type<frame> result;
+        // created by the first stream using the slot
+        std::optional<channel_type<frame>> stream_results = std::nullopt;
+
+        slot(channel_type<frame> channel)
+          : result{std::move(channel)}
+        {}
+    };
+
+    struct chunk_deleter {
+        size_t size;
+        void operator()(slot * slots) const {
+            std::destroy_n(slots, size);
+            std::allocator<slot>{}.deallocate(slots, size);
+        }
+    };
+
+    using chunk_type = std::unique_ptr<slot, chunk_deleter>;
+
+    static constexpr size_t chunk_size(size_t chunk) {
+        return size_t{1} << (first_chunk_bits + chunk);
+    }
+
+    static constexpr size_t chunk_begin(size_t chunk) {
+        return chunk_size(chunk) - chunk_size(0);
+    }
+
+    static constexpr size_t chunk_of(size_t index) {
+        return std::bit_width(index + chunk_size(0)) - 1 - first_chunk_bits;
+    }
+
+    // index + 1 in the low half, an ABA tag in the high half
+    typename sync::template atomic<uint64_t> m_free_head = 0;
+    typename sync::template atomic<size_t> m_capacity = 0;
+    std::array<chunk_type, max_chunks> m_chunks = {};
+    typename sync::mutex m_grow_mutex;
+    // set once no result can arrive anymore
+    typename sync::template atomic<bool> m_closed = false;
+
+    std::function<channel_type<frame>(size_t)> m_make_channel;
+
+  public:
+    struct [[nodiscard]] call {
+      private:
+        pending_calls * m_table;
+        slot * m_slot;
+        key_type m_key;
+        bool m_received = false;
+
+        call(pending_calls * table, slot * slot, key_type key)
+          : m_table{table}
+          , m_slot{slot}
+          , m_key{key}
+        {}
+
+        friend struct pending_calls;
+
+      public:
+        call(call const &) = delete;
+        call(call && other)
+          : m_table{std::exchange(other.m_table, nullptr)}
+          , m_slot{other.m_slot}
+          , m_key{other.m_key}
+          , m_received{other.m_received}
+        {}
+
+        ~call() {
+            if (!m_table) return;
+            m_table->release(*this);
+        }
+
+        key_type key() const {
+            return m_key;
+        }
+
+        asio::awaitable<frame> result() {
+            return m_table->wait(*this);
+        }
+    };
+
+    template <typename executor_type>
+    pending_calls(executor_type const & executor)
+      : m_make_channel{[executor](size_t size) { return channel_type<frame>{executor, size}; }}
+    {}
+
+    call acquire() {
+        return acquire(false);
+    }
+
+    // The results of a stream are received by calling result() repeatedly
+    call acquire_stream() {
+        return acquire(true);
+    }
+
+    // Hands the result over to the call waiting on key, returns false if there is none
+    bool complete(key_type key, frame & result) {
+        size_t index = key & ((size_t{1} << index_bits) - 1);
+        uint32_t generation = static_cast<uint32_t>(key >> index_bits);
+        if (generation == 0 || index >= m_capacity.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        auto & s = at(index);
+        if (s.armed.load(std::memory_order_acquire) != generation) {
+            return false;
+        }
+
+        if (s.stream.load(std::memory_order_relaxed)) {
+            // release() waits for the delivery to finish before draining the channel
+            s.delivering.store(true);
+            bool delivered = false;
+            if (s.armed.load() == generation && !s.overflowed.load(std::memory_order_relaxed)) {
+                delivered = s.stream_results->try_send(std::move(result));
+                if (!delivered) {
+                    s.overflowed.store(true, std::memory_order_release);
+                }
+            }
+            s.delivering.store(false, std::memory_order_release);
+            return delivered;
+        }
+
+        if (!s.armed.compare_exchange_strong(generation, 0, std::memory_order_acq_rel)) {
+            return false;
+        }
+        return s.result.try_send(std::move(result));
+    }
+
+    // Once no result can arrive anymore, fails the calls still waiting and the ones
+    // acquired from now on
+    void close() {
+        m_closed.store(true);
+        auto capacity = m_capacity.load(std::memory_order_acquire);
+        for (size_t index = 0; index < capacity; ++index) {
+            if (auto generation = at(index).armed.load(std::memory_order_acquire)) {
+                // results are never empty, this one tells the call the table is closed
+                frame closed;
+                complete((key_type{generation} << index_bits) | index, closed);
+            }
+        }
+    }
+
+  private:
+    call acquire(bool stream) {
+        auto index = pop_free();
+        if (!index) {
+            index = grow();
+        }
+
+        auto & s = at(*index);
+        auto generation = s.generation.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (generation == 0) {
+            generation = s.generation.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+        if (stream && !s.stream_results) {
+            s.stream_results.emplace(m_make_channel(max_stream_results + 1));
+        }
+        s.stream.store(stream, std::memory_order_relaxed);
+        s.overflowed.store(false, std::memory_order_relaxed);
+        s.armed.store(generation);
+
+        call c{this, &s, (key_type{generation} << index_bits) | *index};
+        // either close() sees the slot armed, or this sees the table closed
+        if (m_closed.load()) {
+            throw std::runtime_error("Connection closed");
+        }
+        return c;
+    }
+
+    asio::awaitable<frame> wait(call & c) {
+        auto & s = *c.m_slot;
+        if (s.stream.load(std::memory_order_relaxed)) {
+            // the results missed come after the buffered ones
+            std::optional<frame> payload;
+            if (s.overflowed.load(std::memory_order_acquire)) {
+                payload = s.stream_results->try_receive();
+                if (!payload) {
+                    throw std::runtime_error("Stream results not read in time were dropped");
+                }
+            } else {
+                payload.emplace(co_await s.stream_results->async_receive());
+            }
+            co_return checked(std::move(*payload));
+        }
+        auto payload = co_await s.result.async_receive();
+        c.m_received = true;
+        co_return checked(std::move(payload));
+    }
+
+    frame checked(frame payload) {
+        if (payload.remaining() == 0 && m_closed.load()) {
+            throw std::runtime_error("Connection closed");
+        }
+        return payload;
+    }
+
+    slot & at(size_t index) {
+        auto chunk = chunk_of(index);
+        return m_chunks[chunk].get()[index - chunk_begin(chunk)];
+    }
+
+    void release(call & c) {
+        auto & s = *c.m_slot;
+        auto generation = static_cast<uint32_t>(c.m_key >> index_bits);
+        if (s.stream.load(std::memory_order_relaxed)) {
+            s.armed.store(0);
+            while (s.delivering.load()) {
+                std::this_thread::yield();
+            }
+            // drop the results nobody read
+            while (s.stream_results->try_receive()) {}
+        } else if (!c.m_received && !s.armed.compare_exchange_strong(generation, 0, std::memory_order_acq_rel)) {
+            // the result is being delivered, drop it before the slot is reused
+            while (!s.result.try_receive()) {
+                std::this_thread::yield();
+            }
+        }
+        push_free(c.m_key & ((size_t{1} << index_bits) - 1));
+    }
+
+    std::optional<size_t> pop_free() {
+        auto head = m_free_head.load(std::memory_order_acquire);
+        while (uint32_t(head)) {
+            size_t index = uint32_t(head) - 1;
+            uint64_t next = ((head >> 32) + 1) << 32 | at(index).next_free.load(std::memory_order_relaxed);
+            if (m_free_head.compare_exchange_weak(head, next, std::memory_order_acq_rel)) {
+                return index;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void push_free(size_t index) {
+        auto & s = at(index);
+        auto head = m_free_head.load(std::memory_order_relaxed);
+        do {
+            s.next_free.store(uint32_t(head), std::memory_order_relaxed);
+        } while (!m_free_head.compare_exchange_weak(head, ((head >> 32) + 1) << 32 | (index + 1), std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    size_t grow() {
+        std::lock_guard lock{m_grow_mutex};
+
+        // another thread may have grown the table in the meantime
+        if (auto index = pop_free()) {
+            return *index;
+        }
+
+        auto capacity = m_capacity.load(std::memory_order_relaxed);
+        auto chunk = chunk_of(capacity);
+        if (chunk >= max_chunks) {
+            throw std::runtime_error("Too many pending calls");
+        }
+
+        auto size = chunk_size(chunk);
+        auto slots = std::allocator<slot>{}.allocate(size);
+        for (size_t i = 0; i < size; ++i) {
+            std::construct_at(slots + i, m_make_channel(1));
+        }
+        m_chunks[chunk] = chunk_type{slots, chunk_deleter{size}};
+        m_capacity.store(capacity + size, std::memory_order_release);
+
+        for (size_t i = 1; i < size; ++i) {
+            push_free(capacity + i);
+        }
+        return capacity;
+    }
+};
+
+}
@@ -3,86 +3,162 @@
 #include "wirecall/async_channel.hpp"
 #include "wirecall/async_mutex.hpp"
 #include "wirecall/buffered_socket.hpp"
+#include "wirecall/compression.hpp"
 #include "wirecall/connection.hpp"
+#include "wirecall/frame.hpp"
+#include "wirecall/metrics.hpp"
+#include "wirecall/topic_trie.hpp"
+#include "wirecall/tracing.hpp"
+#include "wirecall/sync.hpp"
 
 #include "wirepump.hpp"
 
+#include <asio/any_io_executor.hpp>
 #include <asio/awaitable.hpp>
 #include <asio/co_spawn.hpp>
 #include <asio/detached.hpp>
 #include <asio/generic/stream_protocol.hpp>
 
+#include <atomic>
+#include <concepts>
+#include <cstdint>
 #include <functional>
 #include <memory>
-#include <sstream>
+#include <optional>
 #include <stdexcept>
+#include <string_view>
 #include <tuple>
+#include <type_traits>
 #include <unordered_map>
 #include <utility>
 
 namespace wirecall {
 
-namespace details {
-
-template <typename T>
-std::string serialize(T && value) {
-    std::stringstream ss;
-    wirepump::write(ss, std::forward<T>(value));
-    return ss.str();
-}
-
-template <typename T>
-auto deserialize(std::string payload) {
-    auto length = payload.length();
-    std::stringstream ss(std::move(payload));
-    T value;
-    wirepump::read(ss, value);
-    if (ss.tellg() != length) {
-        throw std::runtime_error("Unexpected unused bytes in stream");
-    }
-    return value;
-}
-
-}
-
 template <typename key_type, typename socket_type, template <typename...> typename channel_type>
 struct basic_pubsub_endpoint {
+  public:
+    using callback_type = std::function<asio::awaitable<void>(frame)>;
+    using default_callback_type = std::function<asio::awaitable<void>(key_type, frame)>;
+    // Runs inline on the receiving loop, returns true when it took the frame
+    using direct_callback_type = std::function<bool(frame_flags, key_type const &, frame &)>;
+
   private:
-    using callback_type = std::function<asio::awaitable<void>(std::string)>;
     using callback_ptr_type = std::shared_ptr<callback_type>;
-
-    using default_callback_type = std::function<asio::awaitable<void>(key_type, std::string)>;
     using default_callback_ptr_type = std::shared_ptr<default_callback_type>;
+    using callback_table_type = std::unordered_map<key_type, callback_ptr_type>;
+    using callback_table_ptr_type = std::shared_ptr<callback_table_type const>;
+    using pattern_table_type = details::topic_trie<default_callback_ptr_type>;
+    using pattern_table_ptr_type = std::shared_ptr<pattern_table_type const>;
+    using sync = details::sync_traits<channel_type>;
 
     basic_connection<socket_type, basic_async_mutex<channel_type>> m_connection;
 
-    basic_async_mutex<channel_type> m_mutex;
-    std::unordered_map<key_type, callback_ptr_type> m_callbacks = {};
-    default_callback_ptr_type m_default_callback = nullptr;
+    // The callbacks are published as immutable snapshots. Dispatching a frame only
+    // loads the current one, subscribing and unsubscribing swap in a modified copy.
+    typename sync::template atomic<callback_table_ptr_type> m_callbacks = std::make_shared<callback_table_type const>();
+    typename sync::template atomic<default_callback_ptr_type> m_default_callback;
+    // Only looked up when no exact key matches, and only once there are patterns
+    typename sync::template atomic<pattern_table_ptr_type> m_patterns;
+    direct_callback_type m_direct_callback = nullptr;
+
+    // Once m_max_in_flight handlers are running the receive loop stops reading
+    // from the connection, which pushes back on the peer. Zero means no limit.
+    size_t m_max_in_flight = 0;
+    typename sync::template atomic<size_t> m_in_flight = 0;
+    channel_type<> m_in_flight_released;
+    std::optional<asio::any_io_executor> m_handler_executor = std::nullopt;
+
+    // Large frames are only compressed once the peer announced it can decompress them
+    std::optional<compression> m_compression = std::nullopt;
+    typename sync::template atomic<uint64_t> m_peer_codecs = 0;
+
+    details::connection_counters m_counters;
 
   public:
     basic_pubsub_endpoint(socket_type socket)
       : m_connection(std::move(socket))
-      , m_mutex(m_connection.get_executor())
+      , m_in_flight_released(m_connection.get_executor())
     {}
 
     auto get_executor() {
         return m_connection.get_executor();
     }
 
+    void set_write_coalescing(std::optional<write_coalescing> coalescing) {
+        m_connection.set_write_coalescing(std::move(coalescing));
+    }
+
+    // Set before running, the peer learns when the endpoint starts running whether it
+    // may compress what it sends
+    void set_compression(std::optional<compression> compression) {
+        m_compression = std::move(compression);
+    }
+
+    // The connection is closed when the peer sends a larger frame body
+    void set_max_frame_bytes(size_t max_frame_bytes) {
+        m_connection.set_max_frame_bytes(max_frame_bytes);
+    }
+
+    // Returns the size of the frame body sent
     template <typename... Args>
-    asio::awaitable<void> publish(key_type key, Args&&... args) {
-        auto payload = details::serialize(std::make_tuple(std::forward<Args>(args)...));
-        co_await m_connection.send(std::tuple{key, std::move(payload)});
+    asio::awaitable<size_t> publish(key_type key, Args&&... args) {
+        return publish_with_flags(frame_flags::none, std::move(key), std::forward<Args>(args)...);
     }
 
+    // With write coalescing, frames of a higher priority are written ahead of the others
     template <typename... Args>
-    asio::awaitable<void> subscribe(key_type key, std::function<asio::awaitable<void>(Args...)> f) {
-        auto lock = co_await m_mutex.lock();
-        auto f_ptr = std::make_shared<callback_type>([f = std::move(f)](std::string payload) -> asio::awaitable<void> {
-            co_await std::apply(f, details::deserialize<std::tuple<Args...>>(std::move(payload)));
+    asio::awaitable<size_t> publish_with_priority(priority lane, key_type key, Args&&... args) {
+        return publish_with_flags(lane, frame_flags::none, std::move(key), std::forward<Args>(args)...);
+    }
+
+    // Frames with flags are only seen by the direct callback
+    template <typename... Args>
+    asio::awaitable<size_t> publish_with_flags(frame_flags flags, key_type key, Args&&... args) {
+        return publish_with_flags(priority::normal, flags, std::move(key), std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    asio::awaitable<size_t> publish_with_flags(priority lane, frame_flags flags, key_type key, Args&&... args) {
+        size_t size;
+        if (m_compression && (m_peer_codecs.load(std::memory_order_relaxed) & details::supported_codecs)) {
+            size = co_await m_connection.send_compressed_frame(m_compression->threshold, lane, static_cast<uint8_t>(flags), key, args...);
+        } else {
+            size = co_await m_connection.send_frame_with_priority(lane, static_cast<uint8_t>(flags), key, args...);
+        }
+        m_counters.sent(size);
+        co_return size;
+    }
+
+    // A peer waiting for the results of its calls before reading the calls it receives
+    // can deadlock with a limit, if it is set it has to allow for that
+    void set_max_in_flight(size_t max_in_flight) {
+        m_max_in_flight = max_in_flight;
+    }
+
+    // Runs the callbacks on a different executor, like a pool of worker threads,
+    // so that slow callbacks don't hold up the connection
+    void set_handler_executor(std::optional<asio::any_io_executor> executor) requires sync::concurrent {
+        m_handler_executor = std::move(executor);
+    }
+
+    // Callbacks taking the raw frame decode the payload themselves
+    asio::awaitable<void> subscribe(key_type key, callback_type f) {
+        auto callback = std::make_shared<callback_type>(std::move(f));
+        update_callbacks([&](callback_table_type & callbacks) {
+            callbacks.insert_or_assign(key, callback);
         });
-        m_callbacks.insert_or_assign(std::move(key), std::move(f_ptr));
+        co_return;
+    }
+
+    // Arguments may be views (std::string_view, std::span<T const>) into the received frame,
+    // which stays alive until the callback completes
+    template <typename... Args>
+    asio::awaitable<void> subscribe(key_type key, std::function<asio::awaitable<void>(Args...)> f) {
+        callback_type callback = [f = std::move(f)](frame payload) -> asio::awaitable<void> {
+            auto args = co_await details::deserialize<std::tuple<std::remove_cvref_t<Args>...>>(payload.reader());
+            co_await std::apply(f, std::move(args));
+        };
+        co_await subscribe(std::move(key), std::move(callback));
     }
 
     template <typename... Args>
@@ -97,42 +173,128 @@ struct basic_pubsub_endpoint {
         co_await subscribe(std::move(key), std::function{std::forward<F>(f)});
     }
 
-    template <typename... Args>
-    void subscribe_default(std::function<asio::awaitable<void>(key_type, Args...)> f) {
-        m_default_callback = std::make_shared<default_callback_type>([f = std::move(f)](key_type key, std::string payload) -> asio::awaitable<void> {
-            co_await std::apply(f, std::tuple_cat(std::make_tuple(std::move(key)), details::deserialize<std::tuple<Args...>>(std::move(payload))));
-        });
+    // Subscribes to the key, and asks the broker at the other end of the connection to
+    // forward what is published on it
+    template <typename F>
+    asio::awaitable<void> broker_subscribe(key_type key, F && f) {
+        co_await subscribe(key, std::forward<F>(f));
+        co_await publish_with_flags(priority::high, frame_flags::subscribe, std::move(key));
     }
 
-    template <typename... Args>
-    void subscribe_default(std::function<void(key_type, Args...)> f) {
-        subscribe_default([f = std::move(f)](key_type key, Args... args) -> asio::awaitable<void> {
-            co_return f(std::move(key), args...);
-        });
+    asio::awaitable<void> broker_unsubscribe(key_type key) {
+        co_await publish_with_flags(priority::high, frame_flags::unsubscribe, key);
+        co_await unsubscribe(std::move(key));
+    }
+
+    void subscribe_default(default_callback_type f) {
+        m_default_callback.store(std::make_shared<default_callback_type>(std::move(f)), std::memory_order_release);
     }
 
     template <typename F>
     void subscribe_default(F && f) {
-        subscribe_default(std::function{std::forward<F>(f)});
+        subscribe_default(keyed_callback(std::function{std::forward<F>(f)}));
+    }
+
+    // Keys made of levels separated by '/' can be subscribed to by pattern, where a '+'
+    // level matches any single level and a last '#' level everything below, like
+    // "sensors/+/temperature" or "sensors/#". Callbacks get the key along with the
+    // arguments, like the default one. A frame goes to the callback of its exact key
+    // if there is one, otherwise to the most specific matching pattern.
+    void subscribe_pattern(std::string_view pattern, default_callback_type f) requires std::convertible_to<key_type const &, std::string_view> {
+        auto callback = std::make_shared<default_callback_type>(std::move(f));
+        update_patterns([&](pattern_table_type const & patterns) {
+            return patterns.insert(pattern, callback);
+        });
+    }
+
+    template <typename F>
+    void subscribe_pattern(std::string_view pattern, F && f) requires std::convertible_to<key_type const &, std::string_view> {
+        subscribe_pattern(pattern, keyed_callback(std::function{std::forward<F>(f)}));
+    }
+
+    void unsubscribe_pattern(std::string_view pattern) requires std::convertible_to<key_type const &, std::string_view> {
+        update_patterns([&](pattern_table_type const & patterns) {
+            return patterns.erase(pattern);
+        });
+    }
+
+    // Frames claimed by the direct callback skip the subscription lookup and are not
+    // dispatched to a new coroutine, it must be cheap and must not block
+    void subscribe_direct(direct_callback_type f) {
+        m_direct_callback = std::move(f);
+    }
+
+    // Runs a handler for a frame the direct callback claimed like the callbacks of
+    // subscriptions, on the handler executor and counted against the in-flight limit
+    void dispatch(asio::awaitable<void> handler) {
+        m_in_flight.fetch_add(1, std::memory_order_relaxed);
+        asio::co_spawn(
+            m_handler_executor.value_or(m_connection.get_executor()),
+            run_dispatched(std::move(handler)),
+            asio::detached
+        );
     }
 
     asio::awaitable<void> unsubscribe(key_type key) {
-        auto lock = co_await m_mutex.lock();
-        m_callbacks.erase(key);
+        update_callbacks([&](callback_table_type & callbacks) {
+            callbacks.erase(key);
+        });
+        co_return;
     }
 
     void unsubscribe_default(key_type key) {
-        m_default_callback = nullptr;
+        m_default_callback.store(nullptr, std::memory_order_release);
     }
 
     asio::awaitable<void> run() {
+        // let the peer know it may compress what it sends, only when compression is enabled
+        uint64_t const codecs = m_compression ? details::supported_codecs : 0;
+        m_counters.sent(co_await m_connection.send_frame(static_cast<uint8_t>(frame_flags::capabilities), key_type{}, codecs));
+
         while (m_connection.is_open()) {
-            auto [key, payload] =
-                co_await m_connection.template receive<std::tuple<key_type, std::string>>();
+            while (m_max_in_flight && m_in_flight.load(std::memory_order_acquire) >= m_max_in_flight) {
+                co_await m_in_flight_released.async_receive();
+            }
+
+            auto payload = co_await m_connection.receive_frame();
+            m_counters.received(payload.remaining());
+
+            uint8_t flags;
+            key_type key;
+            try {
+                co_await wirepump::read(payload.reader(), flags);
+                if (flags & static_cast<uint8_t>(frame_flags::compressed)) {
+                    if (!(codecs & static_cast<uint64_t>(details::compression_codec::lz))) {
+                        // compressed although this endpoint never announced it decompresses
+                        continue;
+                    }
+                    payload = details::decompress_frame(payload, flags, m_connection.max_frame_bytes());
+                    flags &= ~static_cast<uint8_t>(frame_flags::compressed);
+                }
+                co_await wirepump::read(payload.reader(), key);
+            } catch (...) {
+                // malformed header, drop the frame
+                continue;
+            }
+
+            if (static_cast<frame_flags>(flags) == frame_flags::capabilities) {
+                m_peer_codecs.store(details::read_buffered_varint(payload.reader()).value_or(0), std::memory_order_relaxed);
+                continue;
+            }
+
+            if (m_direct_callback && m_direct_callback(static_cast<frame_flags>(flags), key, payload)) {
+                continue;
+            }
 
+            if (static_cast<frame_flags>(flags) != frame_flags::none) {
+                continue;
+            }
+
+            m_in_flight.fetch_add(1, std::memory_order_relaxed);
+            auto trace = details::trace_begin(details::trace_event::dispatched);
             asio::co_spawn(
-                m_connection.get_executor(),
-                handle_request(std::move(key), std::move(payload)),
+                m_handler_executor.value_or(m_connection.get_executor()),
+                handle_request(std::move(key), std::move(payload), trace),
                 asio::detached
             );
         }
@@ -143,6 +305,20 @@ struct basic_pubsub_endpoint {
         return asio::co_spawn(get_executor(), run(), std::forward<token_type>(token));
     }
 
+    // Waits until the handlers dispatched so far completed, once run() returned the
+    // endpoint must outlive them
+    asio::awaitable<void> wait_handlers() {
+        while (m_in_flight.load(std::memory_order_acquire) > 0) {
+            co_await m_in_flight_released.async_receive();
+        }
+    }
+
+    connection_metrics metrics() const {
+        auto metrics = m_counters.snapshot();
+        metrics.handlers_in_flight = m_in_flight.load(std::memory_order_relaxed);
+        return metrics;
+    }
+
     auto is_open() const {
         return m_connection.is_open();
     }
@@ -152,29 +328,103 @@ struct basic_pubsub_endpoint {
     }
 
   private:
-    asio::awaitable<void> handle_request(key_type key, std::string payload) {
-        try {
-            callback_ptr_type callback = nullptr;
-            
-            {
-                auto lock = co_await m_mutex.lock();
-                auto it = m_callbacks.find(key);
-                if (it != m_callbacks.end()) callback = it->second;
+    template <typename... Args>
+    static default_callback_type keyed_callback(std::function<asio::awaitable<void>(key_type, Args...)> f) {
+        return [f = std::move(f)](key_type key, frame payload) -> asio::awaitable<void> {
+            auto args = co_await details::deserialize<std::tuple<std::remove_cvref_t<Args>...>>(payload.reader());
+            co_await std::apply(f, std::tuple_cat(std::make_tuple(std::move(key)), std::move(args)));
+        };
+    }
+
+    template <typename... Args>
+    static default_callback_type keyed_callback(std::function<void(key_type, Args...)> f) {
+        return keyed_callback(std::function{[f = std::move(f)](key_type key, Args... args) -> asio::awaitable<void> {
+            co_return f(std::move(key), args...);
+        }});
+    }
+
+    static default_callback_type keyed_callback(default_callback_type f) {
+        return f;
+    }
+
+    template <typename F>
+    void update_patterns(F && update) {
+        auto current = m_patterns.load(std::memory_order_acquire);
+        while (true) {
+            auto updated = update(current ? *current : pattern_table_type{});
+            auto next = updated.empty() ? nullptr : std::make_shared<pattern_table_type const>(std::move(updated));
+            if (m_patterns.compare_exchange_weak(current, std::move(next), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return;
+            }
+        }
+    }
+
+    // The callback of the most specific pattern matching the key, if any
+    default_callback_ptr_type match_pattern(key_type const & key) {
+        if constexpr (std::convertible_to<key_type const &, std::string_view>) {
+            if (auto patterns = m_patterns.load(std::memory_order_acquire); patterns) {
+                if (auto callback = patterns->match(key)) {
+                    return *callback;
+                }
             }
+        }
+        return nullptr;
+    }
 
-            if (callback) {
-                co_await (*callback)(std::move(payload));
-            } else if (auto default_callback = m_default_callback; default_callback) {
+    template <typename F>
+    void update_callbacks(F && update) {
+        auto current = m_callbacks.load(std::memory_order_acquire);
+        while (true) {
+            auto next = std::make_shared<callback_table_type>(*current);
+            update(*next);
+            if (m_callbacks.compare_exchange_weak(current, std::move(next), std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return;
+            }
+        }
+    }
+
+    asio::awaitable<void> handle_request(key_type key, frame payload, uint64_t trace) {
+        try {
+            // the snapshot keeps the callback alive while it runs
+            auto callbacks = m_callbacks.load(std::memory_order_acquire);
+            auto it = callbacks->find(key);
+
+            if (it != callbacks->end()) {
+                co_await (*it->second)(std::move(payload));
+            } else if (auto pattern_callback = match_pattern(key); pattern_callback) {
+                co_await (*pattern_callback)(std::move(key), std::move(payload));
+            } else if (auto default_callback = m_default_callback.load(std::memory_order_acquire); default_callback) {
                 co_await (*default_callback)(std::move(key), std::move(payload));
             }
         } catch (...) {
             // signature missmatch ?
             // anyway, there's not much to with with errors here
         }
+        details::trace(details::trace_event::handler_done, trace);
+        release_in_flight();
+    }
+
+    asio::awaitable<void> run_dispatched(asio::awaitable<void> handler) {
+        try {
+            co_await std::move(handler);
+        } catch (...) {
+            // the handler reports its own errors to the peer
+        }
+        release_in_flight();
+    }
+
+    void release_in_flight() {
+        auto in_flight = m_in_flight.fetch_sub(1, std::memory_order_acq_rel);
+        if ((m_max_in_flight && in_flight >= m_max_in_flight) || in_flight == 1) {
+            m_in_flight_released.try_send();
+        }
     }
 };
 
 template <typename key_type>
 using pubsub_endpoint = basic_pubsub_endpoint<key_type, buffered_socket<asio::generic::stream_protocol::socket>, async_channel>;
 
+template <typename key_type>
+using single_threaded_pubsub_endpoint = basic_pubsub_endpoint<key_type, buffered_socket<asio::generic::stream_protocol::socket>, single_threaded_async_channel>;
+
 }
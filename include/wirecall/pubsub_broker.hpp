@@ -0,0 +1,373 @@
+#pragma once
+
+#include "wirecall/buffered_socket.hpp"
+#include "wirecall/frame.hpp"
+
+#include "wirepump.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/buffer.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/dispatch.hpp>
+#include <asio/generic/stream_protocol.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/socket_base.hpp>
+#include <asio/strand.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+struct pubsub_broker_options {
+    // a subscriber with this many bytes waiting to be written to it is disconnected,
+    // instead of holding on to more frames for it
+    size_t max_queued_bytes = 64 * 1024 * 1024;
+    // frames gathered in a single write to a subscriber
+    size_t max_batch_frames = 64;
+    // connections publishing larger frames are closed
+    size_t max_frame_bytes = 64 * 1024 * 1024;
+};
+
+namespace details {
+
+// A frame encoded once and written as it is to every subscriber, freed once the last
+// of them is done with it
+struct shared_frame {
+    std::array<uint8_t, frame_length_size> header;
+    std::vector<uint8_t> body;
+
+    static std::shared_ptr<shared_frame const> make(std::vector<uint8_t> body) {
+        if (body.size() > fragment_header::max_length) {
+            throw std::length_error("Frame too large to be forwarded");
+        }
+        auto frame = std::make_shared<shared_frame>();
+        for (size_t i = 0; i < frame_length_size; ++i) {
+            frame->header[i] = (body.size() >> (8 * i)) & 0xff;
+        }
+        frame->body = std::move(body);
+        return frame;
+    }
+
+    size_t size() const {
+        return header.size() + body.size();
+    }
+};
+
+}
+
+// Accepts pubsub connections and forwards what any of them publishes to the ones that
+// subscribed to the key with broker_subscribe(). Every frame is written as it was
+// received, or as publish() encoded it, to all of its subscribers without being
+// encoded again. Each connection runs on its own strand of the executor.
+template <typename key_type, typename protocol_type>
+struct basic_pubsub_broker {
+  private:
+    using socket_type = buffered_socket<asio::generic::stream_protocol::socket>;
+    using frame_ptr = std::shared_ptr<details::shared_frame const>;
+
+    struct subscriber {
+        socket_type socket;
+        // written by a single coroutine at a time, started by whoever queues the first frame
+        std::mutex mutex;
+        std::deque<frame_ptr> queue = {};
+        size_t queued_bytes = 0;
+        bool writing = false;
+        bool closed = false;
+        // the keys it subscribed to, guarded by the broker's mutex
+        std::unordered_set<key_type> keys = {};
+
+        explicit subscriber(typename protocol_type::socket socket)
+          : socket{std::move(socket)}
+        {}
+    };
+
+    using subscriber_ptr = std::shared_ptr<subscriber>;
+
+    // On the strand of the connection, like everything else touching its socket
+    static void disconnect(subscriber_ptr s) {
+        auto executor = s->socket.get_executor();
+        asio::dispatch(executor, [s = std::move(s)]() {
+            if (s->socket.is_open()) {
+                s->socket.cancel();
+                s->socket.close();
+            }
+        });
+    }
+
+    // Routes are published as immutable snapshots, forwarding a frame only copies the
+    // pointer to the current one
+    using route_type = std::shared_ptr<std::vector<subscriber_ptr> const>;
+
+    asio::any_io_executor m_executor;
+    typename protocol_type::acceptor m_acceptor;
+    pubsub_broker_options m_options;
+
+    std::mutex m_mutex;
+    std::unordered_map<key_type, route_type> m_routes;
+    std::unordered_set<subscriber_ptr> m_subscribers;
+
+  public:
+    basic_pubsub_broker(asio::any_io_executor executor, typename protocol_type::endpoint const & endpoint, pubsub_broker_options options = {})
+      : m_executor{std::move(executor)}
+      , m_acceptor{asio::make_strand(m_executor)}
+      , m_options{std::move(options)}
+    {
+        m_acceptor.open(endpoint.protocol());
+        m_acceptor.set_option(asio::socket_base::reuse_address(true));
+        m_acceptor.bind(endpoint);
+        m_acceptor.listen();
+    }
+
+    basic_pubsub_broker(basic_pubsub_broker const &) = delete;
+
+    auto local_endpoint() const {
+        return m_acceptor.local_endpoint();
+    }
+
+    // Accepts connections until stop() is called
+    asio::awaitable<void> run() {
+        co_await asio::co_spawn(m_acceptor.get_executor(), accept(), asio::use_awaitable);
+    }
+
+    // Stops accepting, and disconnects everyone
+    void stop() {
+        asio::dispatch(m_acceptor.get_executor(), [this]() {
+            if (m_acceptor.is_open()) {
+                m_acceptor.close();
+            }
+        });
+        std::lock_guard lock{m_mutex};
+        for (auto & s : m_subscribers) {
+            disconnect(s);
+        }
+    }
+
+    // Publishes to the subscribers of the key, as if one of the connections did.
+    // Returns how many subscribers the frame was queued for.
+    template <typename... Args>
+    asio::awaitable<size_t> publish(key_type key, Args const &... args) {
+        byte_writer body;
+        co_await wirepump::write(body, static_cast<uint8_t>(frame_flags::none));
+        co_await wirepump::write(body, key);
+        (co_await wirepump::write(body, args), ...);
+        auto data = body.data();
+        co_return forward(key, details::shared_frame::make(std::vector<uint8_t>(data.begin(), data.end())));
+    }
+
+    size_t subscribers(key_type const & key) {
+        std::lock_guard lock{m_mutex};
+        auto it = m_routes.find(key);
+        return it == m_routes.end() ? 0 : it->second->size();
+    }
+
+    size_t connections() {
+        std::lock_guard lock{m_mutex};
+        return m_subscribers.size();
+    }
+
+  private:
+    // On the strand of the acceptor, which stop() closes it on
+    asio::awaitable<void> accept() {
+        while (m_acceptor.is_open()) {
+            typename protocol_type::socket socket{asio::make_strand(m_executor)};
+            asio::error_code ec;
+            co_await m_acceptor.async_accept(socket, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec) {
+                if (ec == asio::error::operation_aborted) co_return;
+                continue;
+            }
+
+            auto s = std::make_shared<subscriber>(std::move(socket));
+            s->socket.set_max_frame(m_options.max_frame_bytes);
+            {
+                std::lock_guard lock{m_mutex};
+                m_subscribers.insert(s);
+            }
+            asio::co_spawn(s->socket.get_executor(), serve(s), asio::detached);
+        }
+    }
+
+    asio::awaitable<void> serve(subscriber_ptr s) {
+        try {
+            while (s->socket.is_open()) {
+                auto payload = co_await s->socket.read_frame();
+
+                // the frame is forwarded whole, the header is read from a copy of the reader
+                auto reader = payload.reader();
+                uint8_t flags;
+                key_type key;
+                try {
+                    co_await wirepump::read(reader, flags);
+                    co_await wirepump::read(reader, key);
+                } catch (...) {
+                    // malformed or compressed, which the broker never announced it reads
+                    continue;
+                }
+
+                switch (static_cast<frame_flags>(flags)) {
+                    case frame_flags::none: {
+                        auto body = payload.reader().buffered();
+                        if (body.size() <= details::fragment_header::max_length) {
+                            forward(key, details::shared_frame::make(std::vector<uint8_t>(body.begin(), body.end())));
+                        }
+                        break;
+                    }
+                    case frame_flags::subscribe:
+                        add_route(std::move(key), s);
+                        break;
+                    case frame_flags::unsubscribe:
+                        remove_route(key, s);
+                        break;
+                    default:
+                        // capabilities and the like are meant for an endpoint
+                        break;
+                }
+            }
+        } catch (...) {
+            // the connection is gone
+        }
+
+        std::lock_guard lock{m_mutex};
+        for (auto const & key : std::exchange(s->keys, {})) {
+            remove_route_locked(key, s);
+        }
+        m_subscribers.erase(s);
+        disconnect(s);
+    }
+
+    size_t forward(key_type const & key, frame_ptr const & frame) {
+        route_type route;
+        {
+            std::lock_guard lock{m_mutex};
+            auto it = m_routes.find(key);
+            if (it == m_routes.end()) {
+                return 0;
+            }
+            route = it->second;
+        }
+        for (auto const & s : *route) {
+            enqueue(s, frame);
+        }
+        return route->size();
+    }
+
+    void enqueue(subscriber_ptr const & s, frame_ptr const & frame) {
+        bool overflow = false;
+        {
+            std::lock_guard lock{s->mutex};
+            if (s->closed) {
+                return;
+            }
+            if (s->queued_bytes + frame->size() > m_options.max_queued_bytes) {
+                // too slow to keep up, holding on to more would only grow the backlog
+                s->closed = true;
+                s->queue.clear();
+                s->queued_bytes = 0;
+                overflow = true;
+            } else {
+                s->queue.push_back(frame);
+                s->queued_bytes += frame->size();
+                if (s->writing) {
+                    return;
+                }
+                s->writing = true;
+            }
+        }
+        if (overflow) {
+            disconnect(s);
+            return;
+        }
+        asio::co_spawn(s->socket.get_executor(), write_queued(s, m_options.max_batch_frames), asio::detached);
+    }
+
+    static asio::awaitable<void> write_queued(subscriber_ptr s, size_t max_batch_frames) {
+        std::vector<frame_ptr> batch;
+        std::vector<asio::const_buffer> buffers;
+        try {
+            while (true) {
+                batch.clear();
+                buffers.clear();
+                {
+                    std::lock_guard lock{s->mutex};
+                    if (s->queue.empty() || s->closed) {
+                        s->writing = false;
+                        co_return;
+                    }
+                    while (!s->queue.empty() && batch.size() < max_batch_frames) {
+                        s->queued_bytes -= s->queue.front()->size();
+                        batch.push_back(std::move(s->queue.front()));
+                        s->queue.pop_front();
+                    }
+                }
+                for (auto const & frame : batch) {
+                    buffers.push_back(asio::buffer(frame->header));
+                    buffers.push_back(asio::buffer(frame->body));
+                }
+                co_await s->socket.write_buffers(buffers);
+            }
+        } catch (...) {
+            // the reading side notices as well, and cleans up
+        }
+        std::lock_guard lock{s->mutex};
+        s->closed = true;
+        s->writing = false;
+        s->queue.clear();
+        s->queued_bytes = 0;
+    }
+
+    void add_route(key_type key, subscriber_ptr const & s) {
+        std::lock_guard lock{m_mutex};
+        if (!s->keys.insert(key).second) {
+            return;
+        }
+        auto & route = m_routes[key];
+        auto updated = route ? std::make_shared<std::vector<subscriber_ptr>>(*route) : std::make_shared<std::vector<subscriber_ptr>>();
+        updated->push_back(s);
+        route = std::move(updated);
+    }
+
+    void remove_route(key_type const & key, subscriber_ptr const & s) {
+        std::lock_guard lock{m_mutex};
+        if (s->keys.erase(key)) {
+            remove_route_locked(key, s);
+        }
+    }
+
+    void remove_route_locked(key_type const & key, subscriber_ptr const & s) {
+        auto it = m_routes.find(key);
+        if (it == m_routes.end()) {
+            return;
+        }
+        auto updated = std::make_shared<std::vector<subscriber_ptr>>();
+        for (auto const & other : *it->second) {
+            if (other != s) {
+                updated->push_back(other);
+            }
+        }
+        if (updated->empty()) {
+            m_routes.erase(it);
+        } else {
+            it->second = std::move(updated);
+        }
+    }
+};
+
+template <typename key_type, typename protocol_type = asio::ip::tcp>
+using pubsub_broker = basic_pubsub_broker<key_type, protocol_type>;
+
+}
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+// Bounds of the results a caller keeps, the least recently used ones are dropped first
+struct result_cache_options {
+    size_t max_entries = 1024;
+    size_t max_bytes = 1024 * 1024;
+};
+
+struct result_cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+};
+
+namespace details {
+
+// Results of the methods the peer announced as cacheable, keyed by the method and the
+// encoded arguments of the call. Every invalidation of a method bumps its generation,
+// so that a result that was on its way while the method was invalidated is not kept.
+template <typename method_key_type, typename sync>
+struct result_cache {
+  public:
+    using clock = std::chrono::steady_clock;
+
+    // The result bytes start `offset` bytes into the buffer, at the same alignment
+    // as in the frame they were copied from
+    struct result {
+        std::vector<uint8_t> bytes;
+        size_t offset;
+    };
+
+  private:
+    struct entry {
+        method_key_type method;
+        std::string args;
+        result value;
+        clock::time_point expires;
+    };
+
+    using list_type = std::list<entry>;
+
+    struct method_entries {
+        clock::duration ttl = {};
+        uint64_t generation = 0;
+        std::unordered_map<std::string, typename list_type::iterator> calls = {};
+    };
+
+    typename sync::template atomic<bool> m_enabled = false;
+    typename sync::mutex m_mutex;
+    result_cache_options m_options;
+    // most recently used first
+    list_type m_entries;
+    std::unordered_map<method_key_type, method_entries> m_methods;
+    size_t m_bytes = 0;
+    uint64_t m_hits = 0;
+    uint64_t m_misses = 0;
+
+  public:
+    void set_options(std::optional<result_cache_options> options) {
+        std::lock_guard lock{m_mutex};
+        m_enabled.store(options.has_value(), std::memory_order_relaxed);
+        m_options = options.value_or(result_cache_options{});
+        shrink(options ? m_options.max_entries : 0, options ? m_options.max_bytes : 0);
+    }
+
+    // Cached for up to `ttl`, zero when the method is no longer cacheable
+    void set_ttl(method_key_type const & method, clock::duration ttl) {
+        std::lock_guard lock{m_mutex};
+        auto it = m_methods.find(method);
+        if (it == m_methods.end()) {
+            // the peer announces methods by name, no entry unless it is cacheable
+            if (ttl <= clock::duration::zero()) {
+                return;
+            }
+            it = m_methods.try_emplace(method).first;
+        }
+        it->second.ttl = ttl;
+        drop(it->second);
+    }
+
+    // Whether calls of the method are worth looking up at all
+    bool cacheable(method_key_type const & method) {
+        if (!m_enabled.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        std::lock_guard lock{m_mutex};
+        auto it = m_methods.find(method);
+        return it != m_methods.end() && it->second.ttl > clock::duration::zero();
+    }
+
+    // A copy of the result, or the generation to insert the result of the call with
+    std::optional<result> find(method_key_type const & method, std::string const & args, uint64_t & generation) {
+        std::lock_guard lock{m_mutex};
+        auto found = m_methods.find(method);
+        if (found == m_methods.end()) {
+            generation = 0;
+            ++m_misses;
+            return std::nullopt;
+        }
+        auto & entries = found->second;
+        generation = entries.generation;
+
+        auto it = entries.calls.find(args);
+        if (it != entries.calls.end()) {
+            if (it->second->expires > clock::now()) {
+                ++m_hits;
+                m_entries.splice(m_entries.begin(), m_entries, it->second);
+                return it->second->value;
+            }
+            erase(entries, it);
+        }
+        ++m_misses;
+        return std::nullopt;
+    }
+
+    void insert(method_key_type const & method, std::string args, result value, uint64_t generation) {
+        std::lock_guard lock{m_mutex};
+        auto found = m_methods.find(method);
+        if (found == m_methods.end()) {
+            return;
+        }
+        auto & entries = found->second;
+        auto size = value.bytes.size() + args.size();
+        if (!m_enabled.load(std::memory_order_relaxed) || entries.generation != generation || entries.ttl <= clock::duration::zero() || m_options.max_entries == 0 || size > m_options.max_bytes) {
+            return;
+        }
+
+        if (auto it = entries.calls.find(args); it != entries.calls.end()) {
+            erase(entries, it);
+        }
+        shrink(m_options.max_entries - 1, m_options.max_bytes - size);
+
+        m_entries.push_front(entry{method, args, std::move(value), expiry(entries.ttl)});
+        entries.calls.emplace(std::move(args), m_entries.begin());
+        m_bytes += size;
+    }
+
+    // Invalidations of methods that are not cacheable have nothing to drop
+    void invalidate(method_key_type const & method) {
+        std::lock_guard lock{m_mutex};
+        auto found = m_methods.find(method);
+        if (found == m_methods.end()) {
+            return;
+        }
+        ++found->second.generation;
+        drop(found->second);
+    }
+
+    void invalidate(method_key_type const & method, std::string const & args) {
+        std::lock_guard lock{m_mutex};
+        auto found = m_methods.find(method);
+        if (found == m_methods.end()) {
+            return;
+        }
+        auto & entries = found->second;
+        ++entries.generation;
+        if (auto it = entries.calls.find(args); it != entries.calls.end()) {
+            erase(entries, it);
+        }
+    }
+
+    result_cache_stats stats() {
+        std::lock_guard lock{m_mutex};
+        return {m_hits, m_misses, m_entries.size(), m_bytes};
+    }
+
+  private:
+    // Saturates instead of overflowing, for results cached for as long as the connection lasts
+    static clock::time_point expiry(clock::duration ttl) {
+        auto now = clock::now();
+        if (ttl >= clock::time_point::max() - now) {
+            return clock::time_point::max();
+        }
+        return now + ttl;
+    }
+
+    void erase(method_entries & entries, typename std::unordered_map<std::string, typename list_type::iterator>::iterator it) {
+        m_bytes -= it->second->value.bytes.size() + it->first.size();
+        m_entries.erase(it->second);
+        entries.calls.erase(it);
+    }
+
+    void drop(method_entries & entries) {
+        while (!entries.calls.empty()) {
+            erase(entries, entries.calls.begin());
+        }
+    }
+
+    // Drops the least recently used results until the cache is within the bounds
+    void shrink(size_t max_entries, size_t max_bytes) {
+        while (!m_entries.empty() && (m_entries.size() > max_entries || m_bytes > max_bytes)) {
+            auto & last = m_entries.back();
+            auto & entries = m_methods[last.method];
+            erase(entries, entries.calls.find(last.args));
+        }
+    }
+};
+
+}
+
+}
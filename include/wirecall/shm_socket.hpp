@@ -0,0 +1,491 @@
+#pragma once
+
+#if defined(__linux__)
+
+#include "wirecall/buffered_socket.hpp"
+#include "wirecall/ipc.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/associated_executor.hpp>
+#include <asio/async_result.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/buffer.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/error.hpp>
+#include <asio/local/stream_protocol.hpp>
+#include <asio/posix/stream_descriptor.hpp>
+#include <asio/redirect_error.hpp>
+#include <asio/system_error.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <new>
+#include <span>
+#include <system_error>
+#include <utility>
+
+namespace wirecall {
+
+namespace details {
+
+// Control block of a ring. Positions are the total number of bytes written and read,
+// the idle flags tell the peer it has to be woken up through an eventfd.
+struct shm_ring {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> reader_idle;
+    std::atomic<uint32_t> writer_idle;
+    std::atomic<uint32_t> closed;
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free);
+    static_assert(std::atomic<uint32_t>::is_always_lock_free);
+};
+
+struct shm_header {
+    static constexpr uint32_t magic_value = 0x6c6c6377; // "wcll"
+    static constexpr uint32_t version_value = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t capacity;
+    shm_ring rings[2];
+
+    static constexpr size_t data_offset() {
+        return (sizeof(shm_header) + 4095) & ~size_t{4095};
+    }
+
+    static constexpr size_t mapping_size(uint64_t capacity) {
+        return data_offset() + 2 * capacity;
+    }
+};
+
+struct shm_fd {
+  private:
+    int m_fd = -1;
+
+  public:
+    shm_fd() = default;
+    explicit shm_fd(int fd) : m_fd{fd} {}
+    shm_fd(shm_fd && other) : m_fd{std::exchange(other.m_fd, -1)} {}
+    shm_fd & operator=(shm_fd && other) {
+        std::swap(m_fd, other.m_fd);
+        return *this;
+    }
+    ~shm_fd() { if (m_fd >= 0) ::close(m_fd); }
+
+    int get() const { return m_fd; }
+    int release() { return std::exchange(m_fd, -1); }
+};
+
+inline void throw_errno(char const * what) {
+    throw std::system_error(errno, std::system_category(), what);
+}
+
+}
+
+// A byte stream between two processes on the same host, moving data through a pair of
+// single producer single consumer rings in a shared memory mapping. Peers only make
+// system calls to wake each other up, when the reader ran out of data or the writer ran
+// out of space. The mapping and the eventfds are exchanged over a connected unix socket,
+// which is then only watched to notice the peer going away.
+// It is an asio AsyncReadStream and AsyncWriteStream, meant to be wrapped in a buffered_socket.
+struct shm_socket {
+  public:
+    using executor_type = asio::any_io_executor;
+
+    static constexpr size_t default_capacity = 1024 * 1024;
+
+  private:
+    enum wakeup : size_t {
+        // eventfds of ring 0, then ring 1
+        data_ready = 0,
+        space_ready = 1,
+    };
+
+    struct state {
+        asio::local::stream_protocol::socket control;
+        std::array<asio::posix::stream_descriptor, 4> wakeups;
+        details::shm_header * header = nullptr;
+        size_t mapping_size = 0;
+        // validated once at the handshake, the copy in the header can be rewritten by the peer
+        size_t capacity = 0;
+        // index of the ring this side writes to, it reads from the other one
+        size_t tx = 0;
+
+        state(asio::local::stream_protocol::socket socket)
+          : control{std::move(socket)}
+          , wakeups{
+              asio::posix::stream_descriptor{control.get_executor()},
+              asio::posix::stream_descriptor{control.get_executor()},
+              asio::posix::stream_descriptor{control.get_executor()},
+              asio::posix::stream_descriptor{control.get_executor()},
+          }
+        {}
+
+        ~state() {
+            if (header) ::munmap(header, mapping_size);
+        }
+
+        details::shm_ring & tx_ring() { return header->rings[tx]; }
+        details::shm_ring & rx_ring() { return header->rings[1 - tx]; }
+
+        uint8_t * ring_data(size_t ring) {
+            return reinterpret_cast<uint8_t *>(header) + details::shm_header::data_offset() + ring * capacity;
+        }
+
+        asio::posix::stream_descriptor & wakeup_of(size_t ring, wakeup w) {
+            return wakeups[2 * ring + w];
+        }
+
+        void signal(size_t ring, wakeup w) {
+            ::eventfd_write(wakeup_of(ring, w).native_handle(), 1);
+        }
+
+        void drain(size_t ring, wakeup w) {
+            eventfd_t value;
+            ::eventfd_read(wakeup_of(ring, w).native_handle(), &value);
+        }
+
+        void shutdown() {
+            if (!header) return;
+            header->rings[0].closed.store(1, std::memory_order_release);
+            header->rings[1].closed.store(1, std::memory_order_release);
+            for (size_t ring = 0; ring < 2; ++ring) {
+                signal(ring, data_ready);
+                signal(ring, space_ready);
+            }
+        }
+    };
+
+    std::shared_ptr<state> m_state;
+
+    shm_socket(std::shared_ptr<state> state)
+      : m_state{std::move(state)}
+    {
+        asio::co_spawn(get_executor(), watch(m_state), asio::detached);
+    }
+
+  public:
+    shm_socket(shm_socket &&) = default;
+    shm_socket & operator=(shm_socket &&) = default;
+
+    ~shm_socket() {
+        if (m_state) close();
+    }
+
+    // Creates the mapping and sends it to the peer, which must call attach()
+    static asio::awaitable<shm_socket> create(asio::local::stream_protocol::socket socket, size_t capacity = default_capacity) {
+        capacity = std::bit_ceil(std::max<size_t>(capacity, 4096));
+
+        auto s = std::make_shared<state>(std::move(socket));
+        s->tx = 0;
+        s->mapping_size = details::shm_header::mapping_size(capacity);
+
+        details::shm_fd memfd{::memfd_create("wirecall", MFD_CLOEXEC)};
+        if (memfd.get() < 0) details::throw_errno("memfd_create");
+        if (::ftruncate(memfd.get(), s->mapping_size) < 0) details::throw_errno("ftruncate");
+
+        map(*s, memfd.get());
+        auto header = new (s->header) details::shm_header{};
+        header->magic = details::shm_header::magic_value;
+        header->version = details::shm_header::version_value;
+        header->capacity = capacity;
+        s->capacity = capacity;
+
+        std::array<int, 5> fds = {memfd.get()};
+        for (size_t i = 0; i < s->wakeups.size(); ++i) {
+            int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (fd < 0) details::throw_errno("eventfd");
+            s->wakeups[i].assign(fd);
+            fds[i + 1] = fd;
+        }
+
+        s->control.native_non_blocking(true);
+        while (true) {
+            uint8_t byte = 0;
+            iovec iov = {&byte, 1};
+            alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(fds))> control = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            auto cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(fds));
+
+            if (::sendmsg(s->control.native_handle(), &msg, MSG_NOSIGNAL) >= 0) break;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) details::throw_errno("sendmsg");
+            co_await s->control.async_wait(asio::socket_base::wait_write, asio::use_awaitable);
+        }
+
+        co_return shm_socket{std::move(s)};
+    }
+
+    // Receives the mapping sent by a peer calling create()
+    static asio::awaitable<shm_socket> attach(asio::local::stream_protocol::socket socket) {
+        auto s = std::make_shared<state>(std::move(socket));
+        s->tx = 1;
+
+        std::array<int, 5> fds;
+        s->control.native_non_blocking(true);
+        while (true) {
+            uint8_t byte = 0;
+            iovec iov = {&byte, 1};
+            alignas(cmsghdr) std::array<char, CMSG_SPACE(sizeof(fds))> control = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+
+            auto n = ::recvmsg(s->control.native_handle(), &msg, MSG_CMSG_CLOEXEC);
+            if (n > 0) {
+                auto cmsg = CMSG_FIRSTHDR(&msg);
+                if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+                    throw std::runtime_error("Invalid shared memory handshake");
+                }
+                std::memcpy(fds.data(), CMSG_DATA(cmsg), sizeof(fds));
+                break;
+            }
+            if (n == 0) throw asio::system_error(asio::error::eof);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) details::throw_errno("recvmsg");
+            co_await s->control.async_wait(asio::socket_base::wait_read, asio::use_awaitable);
+        }
+
+        details::shm_fd memfd{fds[0]};
+        for (size_t i = 0; i < s->wakeups.size(); ++i) {
+            s->wakeups[i].assign(fds[i + 1]);
+        }
+
+        struct stat st;
+        if (::fstat(memfd.get(), &st) < 0) details::throw_errno("fstat");
+        if (size_t(st.st_size) < sizeof(details::shm_header)) {
+            throw std::runtime_error("Invalid shared memory handshake");
+        }
+        s->mapping_size = st.st_size;
+        map(*s, memfd.get());
+
+        // read once, the peer can rewrite the header at any time
+        auto header = s->header;
+        uint64_t capacity = header->capacity;
+        if (
+            header->magic != details::shm_header::magic_value ||
+            header->version != details::shm_header::version_value ||
+            !std::has_single_bit(capacity) ||
+            details::shm_header::mapping_size(capacity) != s->mapping_size
+        ) {
+            throw std::runtime_error("Invalid shared memory handshake");
+        }
+        s->capacity = capacity;
+
+        co_return shm_socket{std::move(s)};
+    }
+
+    executor_type get_executor() {
+        return m_state->control.get_executor();
+    }
+
+    bool is_open() const {
+        return m_state && m_state->control.is_open();
+    }
+
+    void close() {
+        m_state->shutdown();
+        asio::error_code ec;
+        m_state->control.close(ec);
+    }
+
+    void cancel() {
+        for (auto & wakeup : m_state->wakeups) {
+            asio::error_code ec;
+            wakeup.cancel(ec);
+        }
+    }
+
+    template <typename MutableBufferSequence, typename CompletionToken>
+    auto async_read_some(MutableBufferSequence const & buffers, CompletionToken && token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code, size_t)>(
+            [](auto handler, std::shared_ptr<state> s, MutableBufferSequence buffers) {
+                auto executor = s->control.get_executor();
+                asio::co_spawn(executor, read_some(std::move(s), std::move(buffers)), complete_with(std::move(handler)));
+            },
+            token, m_state, buffers
+        );
+    }
+
+    template <typename ConstBufferSequence, typename CompletionToken>
+    auto async_write_some(ConstBufferSequence const & buffers, CompletionToken && token) {
+        return asio::async_initiate<CompletionToken, void(asio::error_code, size_t)>(
+            [](auto handler, std::shared_ptr<state> s, ConstBufferSequence buffers) {
+                auto executor = s->control.get_executor();
+                asio::co_spawn(executor, write_some(std::move(s), std::move(buffers)), complete_with(std::move(handler)));
+            },
+            token, m_state, buffers
+        );
+    }
+
+  private:
+    static void map(state & s, int fd) {
+        void * data = ::mmap(nullptr, s.mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) details::throw_errno("mmap");
+        s.header = static_cast<details::shm_header *>(data);
+    }
+
+    template <typename handler_type>
+    static auto complete_with(handler_type handler) {
+        return [handler = std::move(handler)](std::exception_ptr ex, std::pair<asio::error_code, size_t> result) mutable {
+            if (ex) {
+                result.first = asio::error::fault;
+            }
+            std::move(handler)(result.first, result.second);
+        };
+    }
+
+    template <typename MutableBufferSequence>
+    static asio::awaitable<std::pair<asio::error_code, size_t>> read_some(std::shared_ptr<state> s, MutableBufferSequence buffers) {
+        size_t size = asio::buffer_size(buffers);
+        if (size == 0) co_return std::pair{asio::error_code{}, size_t{0}};
+
+        size_t rx = 1 - s->tx;
+        auto & ring = s->rx_ring();
+        auto data = s->ring_data(rx);
+        auto mask = s->capacity - 1;
+
+        while (true) {
+            auto tail = ring.tail.load(std::memory_order_relaxed);
+            auto head = ring.head.load(std::memory_order_acquire);
+
+            if (head != tail) {
+                size_t n = std::min<size_t>(head - tail, size);
+                size_t copied = 0;
+                for (auto it = asio::buffer_sequence_begin(buffers); copied < n; ++it) {
+                    asio::mutable_buffer buffer = *it;
+                    auto out = static_cast<uint8_t *>(buffer.data());
+                    for (size_t chunk = std::min(buffer.size(), n - copied); chunk > 0;) {
+                        size_t offset = (tail + copied) & mask;
+                        size_t len = std::min(chunk, mask + 1 - offset);
+                        std::memcpy(out, data + offset, len);
+                        out += len;
+                        copied += len;
+                        chunk -= len;
+                    }
+                }
+                ring.tail.store(tail + n, std::memory_order_release);
+
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ring.writer_idle.load(std::memory_order_relaxed) && ring.writer_idle.exchange(0)) {
+                    s->signal(rx, space_ready);
+                }
+                co_return std::pair{asio::error_code{}, n};
+            }
+
+            if (ring.closed.load(std::memory_order_acquire)) {
+                co_return std::pair{asio::error_code{asio::error::eof}, size_t{0}};
+            }
+
+            ring.reader_idle.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring.head.load(std::memory_order_acquire) == tail && !ring.closed.load(std::memory_order_acquire)) {
+                asio::error_code ec;
+                co_await s->wakeup_of(rx, data_ready).async_wait(asio::posix::stream_descriptor::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) {
+                    ring.reader_idle.store(0, std::memory_order_relaxed);
+                    co_return std::pair{ec, size_t{0}};
+                }
+                s->drain(rx, data_ready);
+            }
+            ring.reader_idle.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    template <typename ConstBufferSequence>
+    static asio::awaitable<std::pair<asio::error_code, size_t>> write_some(std::shared_ptr<state> s, ConstBufferSequence buffers) {
+        size_t size = asio::buffer_size(buffers);
+        if (size == 0) co_return std::pair{asio::error_code{}, size_t{0}};
+
+        size_t tx = s->tx;
+        auto & ring = s->tx_ring();
+        auto data = s->ring_data(tx);
+        auto capacity = s->capacity;
+        auto mask = capacity - 1;
+
+        while (true) {
+            if (ring.closed.load(std::memory_order_acquire)) {
+                co_return std::pair{asio::error_code{asio::error::broken_pipe}, size_t{0}};
+            }
+
+            auto head = ring.head.load(std::memory_order_relaxed);
+            auto tail = ring.tail.load(std::memory_order_acquire);
+
+            if (head - tail < capacity) {
+                size_t n = std::min<size_t>(capacity - (head - tail), size);
+                size_t copied = 0;
+                for (auto it = asio::buffer_sequence_begin(buffers); copied < n; ++it) {
+                    asio::const_buffer buffer = *it;
+                    auto in = static_cast<uint8_t const *>(buffer.data());
+                    for (size_t chunk = std::min(buffer.size(), n - copied); chunk > 0;) {
+                        size_t offset = (head + copied) & mask;
+                        size_t len = std::min(chunk, mask + 1 - offset);
+                        std::memcpy(data + offset, in, len);
+                        in += len;
+                        copied += len;
+                        chunk -= len;
+                    }
+                }
+                ring.head.store(head + n, std::memory_order_release);
+
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ring.reader_idle.load(std::memory_order_relaxed) && ring.reader_idle.exchange(0)) {
+                    s->signal(tx, data_ready);
+                }
+                co_return std::pair{asio::error_code{}, n};
+            }
+
+            ring.writer_idle.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ring.tail.load(std::memory_order_acquire) == tail && !ring.closed.load(std::memory_order_acquire)) {
+                asio::error_code ec;
+                co_await s->wakeup_of(tx, space_ready).async_wait(asio::posix::stream_descriptor::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+                if (ec) {
+                    ring.writer_idle.store(0, std::memory_order_relaxed);
+                    co_return std::pair{ec, size_t{0}};
+                }
+                s->drain(tx, space_ready);
+            }
+            ring.writer_idle.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // The peer never writes to the control socket after the handshake, so it only
+    // becomes readable once the peer is gone
+    static asio::awaitable<void> watch(std::shared_ptr<state> s) {
+        asio::error_code ec;
+        co_await s->control.async_wait(asio::socket_base::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+        s->shutdown();
+    }
+};
+
+template <typename key_type>
+using shm_ipc_endpoint = basic_ipc_endpoint<key_type, buffered_socket<shm_socket>, async_channel>;
+
+}
+
+#endif
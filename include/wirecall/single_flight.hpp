@@ -0,0 +1,112 @@
+#pragma once
+
+#include "wirecall/sync.hpp"
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace wirecall {
+
+struct method_options {
+    // Calls with the same encoded arguments as a call still running wait for its result
+    // instead of running the method again, across all the connections sharing the
+    // method. Only for methods whose result depends on nothing but their arguments.
+    // Cancelling one of the calls only drops its own result, the method keeps running
+    // for the others.
+    bool single_flight = false;
+};
+
+namespace details {
+
+// The calls of a method currently running, keyed by their encoded arguments. The first
+// call of a key runs the method, the ones arriving until it completes get its outcome.
+template <typename result_type, template <typename...> typename channel_type>
+struct single_flight : std::enable_shared_from_this<single_flight<result_type, channel_type>> {
+  public:
+    struct outcome {
+        std::optional<result_type> result;
+        std::string error;
+    };
+
+    using outcome_ptr = std::shared_ptr<outcome const>;
+    using waiter_type = channel_type<outcome_ptr>;
+
+    // Held by the first caller while it runs the method. The calls waiting for it fail
+    // if it is destroyed without completing, like when its executor goes away.
+    struct leader {
+      private:
+        std::shared_ptr<single_flight> m_flights;
+        std::string m_args;
+
+      public:
+        leader(std::shared_ptr<single_flight> flights, std::string args)
+          : m_flights{std::move(flights)}
+          , m_args{std::move(args)}
+        {}
+
+        leader(leader &&) = default;
+        leader & operator=(leader &&) = delete;
+
+        ~leader() {
+            if (m_flights) {
+                try {
+                    m_flights->complete(m_args, {std::nullopt, "Call abandoned"});
+                } catch (...) {
+                    // nothing left to tell the waiting calls
+                }
+            }
+        }
+
+        outcome_ptr complete(outcome value) {
+            return std::exchange(m_flights, nullptr)->complete(m_args, std::move(value));
+        }
+    };
+
+  private:
+    using sync = sync_traits<channel_type>;
+
+    typename sync::mutex m_mutex;
+    std::unordered_map<std::string, std::vector<waiter_type>> m_flights;
+
+  public:
+    // The leader when the caller is the first one and has to run the method, otherwise
+    // the channel its outcome is sent to
+    template <typename executor_type>
+    std::variant<leader, waiter_type> join(std::string args, executor_type const & executor) {
+        std::lock_guard lock{m_mutex};
+        auto [it, first] = m_flights.try_emplace(args);
+        if (first) {
+            return std::variant<leader, waiter_type>{std::in_place_index<0>, this->shared_from_this(), std::move(args)};
+        }
+        return std::variant<leader, waiter_type>{std::in_place_index<1>, it->second.emplace_back(executor)};
+    }
+
+  private:
+    // Called by the leader, however the method completed
+    outcome_ptr complete(std::string const & args, outcome value) {
+        auto shared = std::make_shared<outcome const>(std::move(value));
+        std::vector<waiter_type> waiters;
+        {
+            std::lock_guard lock{m_mutex};
+            auto it = m_flights.find(args);
+            if (it != m_flights.end()) {
+                waiters = std::move(it->second);
+                m_flights.erase(it);
+            }
+        }
+        for (auto & waiter : waiters) {
+            waiter.try_send(shared);
+        }
+        return shared;
+    }
+};
+
+}
+
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+namespace wirecall::details {
+
+// Same interface as the subset of std::atomic used in the library, for state that
+// is only ever touched from a single thread
+template <typename T>
+struct unsynchronized {
+  private:
+    T m_value;
+
+  public:
+    unsynchronized(T value = {})
+      : m_value{value}
+    {}
+
+    T load(std::memory_order = std::memory_order_seq_cst) const {
+        return m_value;
+    }
+
+    void store(T value, std::memory_order = std::memory_order_seq_cst) {
+        m_value = value;
+    }
+
+    T exchange(T value, std::memory_order = std::memory_order_seq_cst) {
+        return std::exchange(m_value, value);
+    }
+
+    bool compare_exchange_strong(T & expected, T desired, std::memory_order = std::memory_order_seq_cst, std::memory_order = std::memory_order_seq_cst) {
+        if (m_value != expected) {
+            expected = m_value;
+            return false;
+        }
+        m_value = desired;
+        return true;
+    }
+
+    bool compare_exchange_weak(T & expected, T desired, std::memory_order = std::memory_order_seq_cst, std::memory_order = std::memory_order_seq_cst) {
+        return compare_exchange_strong(expected, desired);
+    }
+
+    T fetch_add(T value, std::memory_order = std::memory_order_seq_cst) {
+        return std::exchange(m_value, m_value + value);
+    }
+
+    T fetch_sub(T value, std::memory_order = std::memory_order_seq_cst) {
+        return std::exchange(m_value, m_value - value);
+    }
+};
+
+struct null_mutex {
+    void lock() {}
+    bool try_lock() { return true; }
+    void unlock() {}
+};
+
+// Synchronization primitives matching the thread safety of a channel type.
+// Endpoints built on a single threaded channel only run on one thread, or on
+// a strand, so they need neither atomics nor mutexes.
+template <template <typename...> typename channel_type>
+struct sync_traits {
+    static constexpr bool concurrent = channel_type<>::concurrent;
+
+    template <typename T>
+    using atomic = std::conditional_t<concurrent, std::atomic<T>, unsynchronized<T>>;
+
+    using mutex = std::conditional_t<concurrent, std::mutex, null_mutex>;
+};
+
+}
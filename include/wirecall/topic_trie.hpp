@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace wirecall {
+
+namespace details {
+
+// Subscriptions to families of keys, with the levels of a key separated by '/'. A '+'
+// level of a pattern matches any single level, and a last '#' level matches the levels
+// before it and everything below them. Matching walks the key once, level by level,
+// carrying the nodes its levels so far lead to. Each level costs at most one lookup per
+// node at the depth of that level, and never more than the number of patterns.
+//
+// The trie is immutable, updating it copies the nodes on the path to the changed one and
+// shares all the others with the previous trie.
+template <typename value_type>
+struct topic_trie {
+  private:
+    struct string_hash {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    struct node;
+    using node_ptr = std::shared_ptr<node const>;
+
+    struct node {
+        std::unordered_map<std::string, node_ptr, string_hash, std::equal_to<>> children = {};
+        // of the pattern ending at this node
+        std::optional<value_type> value = std::nullopt;
+        // of the pattern ending with a '#' below this node
+        std::optional<value_type> rest = std::nullopt;
+
+        bool empty() const {
+            return children.empty() && !value && !rest;
+        }
+    };
+
+    node_ptr m_root;
+
+    explicit topic_trie(node_ptr root)
+      : m_root{std::move(root)}
+    {}
+
+  public:
+    topic_trie() = default;
+
+    bool empty() const {
+        return !m_root;
+    }
+
+    topic_trie insert(std::string_view pattern, value_type value) const {
+        validate(pattern);
+        return topic_trie{insert(m_root.get(), pattern, value)};
+    }
+
+    topic_trie erase(std::string_view pattern) const {
+        validate(pattern);
+        return topic_trie{m_root ? erase(*m_root, pattern) : nullptr};
+    }
+
+    // The value of the most specific pattern matching the key, preferring a literal level
+    // over '+', and '+' over '#', level by level. Valid as long as the trie is.
+    value_type const * match(std::string_view key) const {
+        if (!m_root) {
+            return nullptr;
+        }
+
+        // The nodes are kept from the most specific to the least, the pattern prefixes
+        // they stand for compared level by level. Expanding each node into its literal then
+        // its '+' child keeps the next level in that order.
+        std::vector<node const *> active{m_root.get()};
+        std::vector<node const *> next;
+        value_type const * best = nullptr;
+        while (true) {
+            auto [level, rest] = split(key);
+
+            // a '#' matches all the remaining levels. It ranks below whatever extends its
+            // own node, and above all the nodes after it, which are dropped.
+            for (size_t i = 0; i < active.size(); ++i) {
+                if (active[i]->rest) {
+                    best = &*active[i]->rest;
+                    active.resize(i + 1);
+                    break;
+                }
+            }
+
+            next.clear();
+            for (auto at : active) {
+                for (std::string_view name : {level, std::string_view{"+"}}) {
+                    auto it = at->children.find(name);
+                    if (it != at->children.end()) {
+                        next.push_back(it->second.get());
+                    }
+                    if (level == "+") {
+                        break;
+                    }
+                }
+            }
+            std::swap(active, next);
+
+            if (active.empty()) {
+                return best;
+            }
+            if (!rest) {
+                break;
+            }
+            key = *rest;
+        }
+
+        // the key ended, a pattern ending there beats one going on with a '#'
+        for (auto at : active) {
+            if (at->value) return &*at->value;
+            if (at->rest) return &*at->rest;
+        }
+        return best;
+    }
+
+  private:
+    // The first level of the pattern, and the remaining ones if there are any
+    static std::pair<std::string_view, std::optional<std::string_view>> split(std::string_view pattern) {
+        auto end = pattern.find('/');
+        if (end == std::string_view::npos) {
+            return {pattern, std::nullopt};
+        }
+        return {pattern.substr(0, end), pattern.substr(end + 1)};
+    }
+
+    static void validate(std::string_view pattern) {
+        while (true) {
+            auto [level, rest] = split(pattern);
+            if (level == "#" && rest) {
+                throw std::invalid_argument("'#' must be the last level of a pattern");
+            }
+            if (level.size() > 1 && level.find_first_of("+#") != std::string_view::npos) {
+                throw std::invalid_argument("'+' and '#' must be whole levels of a pattern");
+            }
+            if (!rest) {
+                return;
+            }
+            pattern = *rest;
+        }
+    }
+
+    static node_ptr insert(node const * at, std::string_view pattern, value_type & value) {
+        auto copy = at ? std::make_shared<node>(*at) : std::make_shared<node>();
+        auto [level, rest] = split(pattern);
+        if (level == "#") {
+            copy->rest = std::move(value);
+            return copy;
+        }
+
+        auto it = copy->children.find(level);
+        auto child = it == copy->children.end() ? nullptr : it->second.get();
+        node_ptr updated;
+        if (rest) {
+            updated = insert(child, *rest, value);
+        } else {
+            auto leaf = child ? std::make_shared<node>(*child) : std::make_shared<node>();
+            leaf->value = std::move(value);
+            updated = std::move(leaf);
+        }
+        copy->children.insert_or_assign(std::string{level}, std::move(updated));
+        return copy;
+    }
+
+    // Empty nodes are pruned, the root included
+    static node_ptr erase(node const & at, std::string_view pattern) {
+        auto [level, rest] = split(pattern);
+        auto copy = std::make_shared<node>(at);
+        if (level == "#") {
+            copy->rest.reset();
+        } else {
+            auto it = copy->children.find(level);
+            if (it == copy->children.end()) {
+                return copy;
+            }
+            node_ptr updated;
+            if (rest) {
+                updated = erase(*it->second, *rest);
+            } else if (!it->second->children.empty() || it->second->rest) {
+                auto leaf = std::make_shared<node>(*it->second);
+                leaf->value.reset();
+                updated = std::move(leaf);
+            }
+            if (updated) {
+                it->second = std::move(updated);
+            } else {
+                copy->children.erase(it);
+            }
+        }
+        return copy->empty() ? nullptr : copy;
+    }
+};
+
+}
+
+}
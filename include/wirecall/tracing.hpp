@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace wirecall {
+
+namespace details {
+
+#if defined(WIRECALL_ENABLE_TRACING)
+inline constexpr bool tracing_compiled = true;
+#else
+inline constexpr bool tracing_compiled = false;
+#endif
+
+// What happens to a frame, from being written to being handled. The send and handler
+// events are spans, matched up by the id returned when they begin.
+enum class trace_event : uint8_t {
+    enqueue,
+    write_locked,
+    flushed,
+    received,
+    dispatched,
+    handler_done,
+    reply_sent,
+};
+
+// Events are stored as atomics so that they can be dumped while being recorded, the
+// oldest ones overwritten once the ring is full
+struct trace_ring {
+    static constexpr size_t capacity = size_t{1} << 14;
+
+    struct record {
+        std::atomic<uint64_t> timestamp;
+        std::atomic<uint64_t> id;
+        // the event in the low byte, a byte count above it
+        std::atomic<uint64_t> data;
+    };
+
+    uint64_t thread;
+    uint64_t next_id = 0;
+    std::atomic<uint64_t> head = 0;
+    // set once the thread exited, the ring is dropped after its events were dumped
+    std::atomic<bool> retired = false;
+    std::array<record, capacity> records;
+
+    explicit trace_ring(uint64_t thread)
+      : thread{thread}
+    {}
+
+    // Only ever called from the thread owning the ring
+    void push(trace_event event, uint64_t id, uint64_t bytes) {
+        auto index = head.load(std::memory_order_relaxed);
+        auto & r = records[index % capacity];
+        r.timestamp.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        r.id.store(id, std::memory_order_relaxed);
+        r.data.store(static_cast<uint64_t>(event) | (bytes << 8), std::memory_order_relaxed);
+        head.store(index + 1, std::memory_order_release);
+    }
+};
+
+// Every thread records into its own ring, rings outlive their threads until dumped
+struct trace_rings {
+    std::atomic<bool> enabled = false;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<trace_ring>> rings;
+    uint64_t threads = 0;
+
+    static trace_rings & instance() {
+        static trace_rings rings;
+        return rings;
+    }
+
+    static trace_ring & local() {
+        struct local_ring {
+            std::shared_ptr<trace_ring> ring;
+
+            ~local_ring() {
+                ring->retired.store(true, std::memory_order_release);
+            }
+        };
+        thread_local local_ring local{[] {
+            auto & self = instance();
+            std::lock_guard lock{self.mutex};
+            self.rings.push_back(std::make_shared<trace_ring>(++self.threads));
+            return self.rings.back();
+        }()};
+        return *local.ring;
+    }
+
+    // Drops the rings of the threads that had exited before they were dumped
+    void drop_retired(std::vector<std::shared_ptr<trace_ring>> const & retired) {
+        std::lock_guard lock{mutex};
+        std::erase_if(rings, [&retired](auto const & ring) {
+            return std::find(retired.begin(), retired.end(), ring) != retired.end();
+        });
+    }
+};
+
+inline bool tracing() {
+    if constexpr (tracing_compiled) {
+        return trace_rings::instance().enabled.load(std::memory_order_relaxed);
+    } else {
+        return false;
+    }
+}
+
+inline void trace(trace_event event, uint64_t id = 0, uint64_t bytes = 0) {
+    if (tracing()) {
+        trace_rings::local().push(event, id, bytes);
+    }
+}
+
+// Begins a span, returns the id ending it, zero when not tracing
+inline uint64_t trace_begin(trace_event event, uint64_t bytes = 0) {
+    if (!tracing()) {
+        return 0;
+    }
+    auto & ring = trace_rings::local();
+    auto id = (ring.thread << 40) | ++ring.next_id;
+    ring.push(event, id, bytes);
+    return id;
+}
+
+}
+
+// Starts or stops recording frame events, when built with WIRECALL_ENABLE_TRACING
+inline void enable_tracing(bool enabled = true) {
+    details::trace_rings::instance().enabled.store(enabled, std::memory_order_relaxed);
+}
+
+// Writes the events recorded so far in the Chrome trace event format, which
+// chrome://tracing and Perfetto open. Timestamps are in microseconds, and every thread
+// that recorded events is its own track.
+inline void write_chrome_trace(std::ostream & out) {
+    struct event_format {
+        char const * name;
+        char const * phase;
+    };
+    constexpr std::array<event_format, 7> formats = {{
+        {"send", "b"},
+        {"write locked", "n"},
+        {"send", "e"},
+        {"received", "i"},
+        {"handler", "b"},
+        {"handler", "e"},
+        {"reply sent", "i"},
+    }};
+
+    // the rings retired by then hold all the events they will ever have
+    auto & self = details::trace_rings::instance();
+    std::vector<std::shared_ptr<details::trace_ring>> rings;
+    std::vector<std::shared_ptr<details::trace_ring>> retired;
+    {
+        std::lock_guard lock{self.mutex};
+        rings = self.rings;
+    }
+    for (auto const & ring : rings) {
+        if (ring->retired.load(std::memory_order_acquire)) {
+            retired.push_back(ring);
+        }
+    }
+
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (auto const & ring : rings) {
+        auto head = ring->head.load(std::memory_order_acquire);
+        auto begin = head > details::trace_ring::capacity ? head - details::trace_ring::capacity : 0;
+        for (auto i = begin; i < head; ++i) {
+            auto const & r = ring->records[i % details::trace_ring::capacity];
+            auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::duration{r.timestamp.load(std::memory_order_relaxed)}
+            ).count();
+            auto id = r.id.load(std::memory_order_relaxed);
+            auto data = r.data.load(std::memory_order_relaxed);
+            auto event = static_cast<size_t>(data & 0xff);
+            if (event >= formats.size()) {
+                continue;
+            }
+            auto [name, phase] = formats[event];
+
+            out << (first ? "" : ",") << "\n{\"name\":\"" << name << "\",\"cat\":\"wirecall\",\"ph\":\"" << phase << "\""
+                << ",\"ts\":" << timestamp / 1000 << '.' << char('0' + timestamp / 100 % 10) << char('0' + timestamp / 10 % 10) << char('0' + timestamp % 10)
+                << ",\"pid\":1,\"tid\":" << ring->thread;
+            if (phase[0] == 'i') {
+                out << ",\"s\":\"t\"";
+            } else {
+                out << ",\"id\":" << id;
+            }
+            out << ",\"args\":{\"bytes\":" << (data >> 8) << "}}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+
+    self.drop_retired(retired);
+}
+
+}
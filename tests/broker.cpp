@@ -0,0 +1,107 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using endpoint_type = wirecall::pubsub_endpoint<std::string>;
+
+asio::awaitable<std::shared_ptr<endpoint_type>> connect(asio::ip::tcp::endpoint ep) {
+    asio::ip::tcp::socket socket{co_await asio::this_coro::executor};
+    co_await socket.async_connect(ep, asio::use_awaitable);
+    auto endpoint = std::make_shared<endpoint_type>(std::move(socket));
+    endpoint->run(asio::detached);
+    co_return endpoint;
+}
+
+asio::awaitable<void> subscribe(std::shared_ptr<endpoint_type> endpoint, std::atomic<int> & received, std::atomic<int> & total) {
+    co_await endpoint->broker_subscribe("news", [&received, &total](int value) {
+        ++received;
+        total += value;
+    });
+}
+
+asio::awaitable<void> publish(std::shared_ptr<endpoint_type> endpoint) {
+    for (int i = 1; i <= 10; ++i) {
+        co_await endpoint->publish("news", i);
+        // nobody subscribed to it, the broker drops it
+        co_await endpoint->publish("weather", i);
+    }
+}
+
+template <typename F>
+bool wait_for(F && done) {
+    for (int i = 0; i < 5000 && !done(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    }
+    return done();
+}
+
+int main(void) {
+    constexpr int subscribers = 3;
+
+    asio::thread_pool ctx(2);
+    wirecall::pubsub_broker<std::string> broker{ctx.get_executor(), {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::co_spawn(ctx, broker.run(), asio::detached);
+
+    std::vector<std::shared_ptr<endpoint_type>> endpoints;
+    std::vector<std::atomic<int>> received(subscribers);
+    std::vector<std::atomic<int>> totals(subscribers);
+    for (int i = 0; i < subscribers; ++i) {
+        endpoints.push_back(asio::co_spawn(ctx, connect(broker.local_endpoint()), asio::use_future).get());
+        asio::co_spawn(ctx, subscribe(endpoints.back(), received[i], totals[i]), asio::use_future).get();
+    }
+    if (!wait_for([&] { return broker.subscribers("news") == subscribers; })) {
+        std::cout << "subscribed " << broker.subscribers("news") << " times\n";
+        return 1;
+    }
+
+    auto publisher = asio::co_spawn(ctx, connect(broker.local_endpoint()), asio::use_future).get();
+    asio::co_spawn(ctx, publish(publisher), asio::use_future).get();
+    auto queued = asio::co_spawn(ctx, broker.publish("news", 11), asio::use_future).get();
+
+    bool delivered = wait_for([&] {
+        for (auto & count : received) {
+            if (count != 11) return false;
+        }
+        return true;
+    });
+
+    // an unsubscribed connection no longer gets anything
+    asio::co_spawn(ctx, endpoints.front()->broker_unsubscribe("news"), asio::use_future).get();
+    bool unsubscribed = wait_for([&] { return broker.subscribers("news") == subscribers - 1; });
+
+    auto connections = broker.connections();
+    asio::post(ctx, [&]() {
+        for (auto & endpoint : endpoints) {
+            endpoint->close();
+        }
+        publisher->close();
+        broker.stop();
+    });
+    ctx.join();
+
+    if (queued != subscribers) {
+        std::cout << "queued for " << queued << " subscribers\n";
+        return 1;
+    }
+    for (int i = 0; i < subscribers; ++i) {
+        if (received[i] != 11 || totals[i] != 66) {
+            std::cout << "subscriber " << i << " received " << received[i] << " messages adding up to " << totals[i] << "\n";
+            return 1;
+        }
+    }
+    if (!delivered || !unsubscribed || connections != subscribers + 1) {
+        std::cout << "broker had " << connections << " connections\n";
+        return 1;
+    }
+    std::cout << "forwarded 11 messages to " << subscribers << " subscribers\n";
+    return 0;
+}
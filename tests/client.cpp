@@ -0,0 +1,134 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using client_type = wirecall::ipc_client<std::string>;
+
+asio::awaitable<int> caller(client_type & client, int id) {
+    int total = 0;
+    for (int i = 0; i < 10; ++i) {
+        total += co_await client.call<int>("sum", id, i);
+    }
+    co_return total;
+}
+
+asio::awaitable<void> connect(client_type & client, asio::ip::tcp::endpoint ep) {
+    co_await client.connect(ep);
+    client.for_each_endpoint([](auto & endpoint) {
+        endpoint.set_result_cache(wirecall::result_cache_options{});
+    });
+}
+
+// Every connection calls the server once, until the server invalidates the results
+asio::awaitable<int> versions(client_type & client, int expected) {
+    int version = 0;
+    for (int i = 0; i < 1000 && version != expected; ++i) {
+        version = co_await client.call<int>("version");
+        if (version != expected) {
+            asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{1}};
+            co_await timer.async_wait(asio::use_awaitable);
+        }
+    }
+    for (int i = 0; i < 16; ++i) {
+        version = co_await client.call<int>("version");
+    }
+    co_return version;
+}
+
+int main(void) {
+    constexpr int callers = 32;
+
+    wirecall::ipc_server<std::string>::method_registry methods;
+    methods.add("sum", [](int a, int b) -> int {
+        return a + b;
+    });
+
+    std::atomic<int> version = 1;
+    methods.add("version", [&version]() -> int {
+        return version.load();
+    });
+    methods.cacheable("version", std::chrono::minutes{1});
+
+    wirecall::ipc_server_options server_options;
+    server_options.threads = 2;
+    wirecall::ipc_server<std::string> server{
+        asio::ip::tcp::endpoint{asio::ip::make_address("127.0.0.1"), 0},
+        std::move(methods),
+        server_options
+    };
+
+    std::thread server_thread{[&server]() {
+        server.run();
+    }};
+
+    // calls from all the threads of the pool are spread over 4 connections
+    asio::thread_pool ctx(4);
+    wirecall::ipc_client_options options;
+    options.connections = 4;
+    client_type client{ctx.get_executor(), options};
+    asio::co_spawn(ctx, connect(client, server.local_endpoint()), asio::use_future).get();
+
+    std::vector<int> totals(callers, -1);
+    std::atomic<int> done = 0;
+    std::promise<void> finished;
+    for (int id = 0; id < callers; ++id) {
+        asio::co_spawn(ctx, caller(client, id), [&, id](std::exception_ptr ex, int total) {
+            if (!ex) totals[id] = total;
+            if (++done == callers) finished.set_value();
+        });
+    }
+    finished.get_future().wait();
+
+    // cached by every connection, until the server invalidates them all
+    auto cached = asio::co_spawn(ctx, versions(client, 1), asio::use_future).get();
+    ++version;
+    server.invalidate("version");
+    auto bumped = asio::co_spawn(ctx, versions(client, 2), asio::use_future).get();
+    auto version_calls = server.metrics().at("version").calls;
+
+    auto metrics = client.metrics();
+    asio::post(ctx, [&client]() {
+        client.close();
+    });
+    server.stop();
+    ctx.join();
+    server_thread.join();
+
+    for (int id = 0; id < callers; ++id) {
+        if (totals[id] != 10 * id + 45) {
+            std::cout << "caller " << id << " failed\n";
+            return 1;
+        }
+    }
+
+    if constexpr (wirecall::details::metrics_enabled) {
+        for (auto & connection : metrics) {
+            if (connection.connection.frames_out == 0) {
+                std::cout << "a connection was never used\n";
+                return 1;
+            }
+        }
+    }
+    if (cached != 1 || bumped != 2) {
+        std::cout << "cached versions " << cached << " and " << bumped << "\n";
+        return 1;
+    }
+    if constexpr (wirecall::details::metrics_enabled) {
+        if (version_calls > 4 * metrics.size()) {
+            std::cout << "version was called " << version_calls << " times\n";
+            return 1;
+        }
+    }
+    std::cout << "made " << callers * 10 << " calls over " << metrics.size() << " connections\n";
+    return 0;
+}
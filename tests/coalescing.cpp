@@ -0,0 +1,167 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using base_socket_type = wirecall::buffered_socket<asio::generic::stream_protocol::socket>;
+
+struct write_stats {
+    std::vector<size_t> batches;
+    size_t max_pending = 0;
+    bool fail_writes = false;
+};
+
+// Records the batches the flusher stages, and how much was queued when it staged them
+struct recording_socket : base_socket_type {
+    write_stats * stats;
+
+    recording_socket(asio::ip::tcp::socket socket, write_stats & stats)
+      : base_socket_type{std::move(socket)}
+      , stats{&stats}
+    {}
+
+    size_t stage_pending(size_t max_bytes) {
+        stats->max_pending = std::max(stats->max_pending, pending_bytes());
+        auto staged = base_socket_type::stage_pending(max_bytes);
+        if (staged) {
+            stats->batches.push_back(staged);
+        }
+        return staged;
+    }
+
+    asio::awaitable<void> write_staged() {
+        if (stats->fail_writes) {
+            // let the other senders queue behind the failing write
+            co_await asio::post(asio::use_awaitable);
+            throw asio::system_error{asio::error::broken_pipe};
+        }
+        co_await base_socket_type::write_staged();
+    }
+};
+
+template <typename T>
+    requires std::is_arithmetic_v<T>
+struct wirepump::write_impl<recording_socket, T> : wirecall::details::codec<T> {};
+
+template <>
+struct wirepump::write_impl<recording_socket, std::string> : wirecall::details::codec<std::string> {};
+
+using connection_type = wirecall::basic_connection<recording_socket, wirecall::async_mutex>;
+
+constexpr uint32_t senders = 64;
+constexpr uint32_t messages = 200;
+constexpr size_t max_batch_bytes = 4096;
+constexpr size_t max_pending_bytes = 8192;
+
+asio::awaitable<void> send(connection_type & connection, uint32_t sender, std::atomic<uint32_t> & sent) {
+    std::string padding(256, 'x');
+    for (uint32_t i = 0; i < messages; ++i) {
+        co_await connection.send_frame(sender, i, padding);
+        sent.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+asio::awaitable<void> send_once(connection_type & connection, std::atomic<uint32_t> & sent, std::atomic<uint32_t> & failed) {
+    try {
+        co_await connection.send_frame(uint32_t{0});
+        sent.fetch_add(1, std::memory_order_relaxed);
+    } catch (asio::system_error const &) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Frames are read on a single thread, in the order they arrive
+asio::awaitable<bool> receive(base_socket_type & socket) {
+    std::vector<uint32_t> next(senders, 0);
+    for (uint32_t n = 0; n < senders * messages; ++n) {
+        auto payload = co_await socket.read_frame();
+        auto [sender, i, padding] = co_await wirecall::details::deserialize<std::tuple<uint32_t, uint32_t, std::string>>(payload.reader());
+        if (sender >= senders || i != next[sender]) {
+            co_return false;
+        }
+        ++next[sender];
+    }
+    co_return true;
+}
+
+int main(void) {
+    asio::io_context receiver_ctx;
+    asio::ip::tcp::acceptor acceptor{receiver_ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    auto coalescing = wirecall::write_coalescing{
+        .max_batch_bytes = max_batch_bytes,
+        .max_linger = std::chrono::microseconds{100},
+        .max_pending_bytes = max_pending_bytes,
+    };
+
+    // every sender sends from whichever thread of the pool it runs on
+    asio::thread_pool ctx(4);
+    asio::ip::tcp::socket socket{ctx};
+    socket.connect(acceptor.local_endpoint());
+    base_socket_type reader{acceptor.accept()};
+    write_stats stats;
+    connection_type connection{recording_socket{std::move(socket), stats}};
+    connection.set_write_coalescing(coalescing);
+
+    std::atomic<uint32_t> sent = 0;
+    for (uint32_t sender = 0; sender < senders; ++sender) {
+        asio::co_spawn(ctx, send(connection, sender, sent), asio::detached);
+    }
+    auto in_order = asio::co_spawn(receiver_ctx, receive(reader), asio::use_future);
+    receiver_ctx.run();
+    if (!in_order.get()) {
+        std::cout << "frames arrived out of order\n";
+        return 1;
+    }
+    ctx.join();
+
+    // the senders returned once their frames were written, gathered in bounded batches,
+    // without queuing much more than allowed
+    auto frames = senders * messages;
+    if (sent != frames || stats.batches.size() >= frames) {
+        std::cout << sent << " frames sent in " << stats.batches.size() << " batches\n";
+        return 1;
+    }
+    if (std::ranges::any_of(stats.batches, [](size_t batch) { return batch > max_batch_bytes; })) {
+        std::cout << "a batch was larger than " << max_batch_bytes << " bytes\n";
+        return 1;
+    }
+    if (stats.max_pending > max_pending_bytes + 1024) {
+        std::cout << stats.max_pending << " bytes were queued\n";
+        return 1;
+    }
+
+    // the senders queued behind a failing write fail along with it
+    asio::thread_pool failing_ctx(4);
+    asio::ip::tcp::socket failing_socket{failing_ctx};
+    failing_socket.connect(acceptor.local_endpoint());
+    auto failing_peer = acceptor.accept();
+    write_stats failing_stats;
+    failing_stats.fail_writes = true;
+    connection_type failing{recording_socket{std::move(failing_socket), failing_stats}};
+    failing.set_write_coalescing(coalescing);
+
+    std::atomic<uint32_t> failing_sent = 0;
+    std::atomic<uint32_t> failed = 0;
+    for (uint32_t sender = 0; sender < 16; ++sender) {
+        asio::co_spawn(failing_ctx, send_once(failing, failing_sent, failed), asio::detached);
+    }
+    failing_ctx.join();
+    if (failing_sent != 0 || failed != 16) {
+        std::cout << failing_sent << " frames sent over a failing connection, " << failed << " failed\n";
+        return 1;
+    }
+
+    std::cout << frames << " frames in order in " << stats.batches.size() << " batches\n";
+    return 0;
+}
@@ -0,0 +1,120 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+using socket_type = wirecall::buffered_socket<asio::generic::stream_protocol::socket>;
+using endpoint_type = wirecall::pubsub_endpoint<std::string>;
+
+// Sends a frame the way an endpoint would, compressed if asked even when the peer never
+// announced it decompresses
+asio::awaitable<void> send(socket_type & socket, std::string key, std::string value, bool compress) {
+    wirecall::byte_writer body;
+    co_await wirepump::write(body, static_cast<uint8_t>(wirecall::frame_flags::none));
+    co_await wirepump::write(body, key);
+    co_await wirepump::write(body, value);
+
+    std::vector<uint8_t> block;
+    socket.begin_frame();
+    if (compress && wirecall::details::compress_frame_body(body.data(), block)) {
+        co_await socket.write(static_cast<uint8_t>(wirecall::frame_flags::compressed));
+        co_await socket.write(std::span<uint8_t const>{block});
+    } else {
+        co_await socket.write(body.data());
+    }
+    socket.end_frame();
+    co_await socket.flush();
+}
+
+// Returns the values the endpoint received on "value", until it got "last"
+asio::awaitable<std::vector<std::string>> receive(asio::ip::tcp::acceptor & acceptor, bool compression, std::vector<std::pair<std::string, bool>> frames) {
+    auto executor = co_await asio::this_coro::executor;
+
+    asio::ip::tcp::socket peer{executor};
+    co_await peer.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+    socket_type writer{std::move(peer)};
+
+    endpoint_type endpoint{co_await acceptor.async_accept(asio::use_awaitable)};
+    endpoint.set_max_frame_bytes(4096);
+    if (compression) {
+        endpoint.set_compression(wirecall::compression{.threshold = 0});
+    }
+
+    // gives up on frames that never arrive
+    asio::steady_timer timeout{executor, std::chrono::seconds{10}};
+    timeout.async_wait([&endpoint](asio::error_code ec) {
+        if (!ec) endpoint.close();
+    });
+
+    std::vector<std::string> received;
+    std::function<asio::awaitable<void>(std::string)> on_value = [&](std::string value) -> asio::awaitable<void> {
+        if (value == "last") {
+            timeout.cancel();
+            endpoint.close();
+        } else {
+            received.push_back(std::move(value));
+        }
+        co_return;
+    };
+    co_await endpoint.subscribe("value", std::move(on_value));
+    bool finished = false;
+    endpoint.run([&finished](std::exception_ptr) {
+        finished = true;
+    });
+
+    std::string const key = "value";
+    std::string const last = "last";
+    for (auto const & [value, compress] : frames) {
+        co_await send(writer, key, value, compress);
+    }
+    co_await send(writer, key, last, false);
+
+    while (!finished) {
+        asio::steady_timer wait{executor, std::chrono::milliseconds{1}};
+        co_await wait.async_wait(asio::use_awaitable);
+    }
+    co_return received;
+}
+
+asio::awaitable<int> run(asio::ip::tcp::acceptor & acceptor) {
+    // well under the frame limit once compressed, far above it once decompressed
+    std::string large(64 * 1024, 'x');
+    std::string small(1024, 'y');
+
+    std::vector<std::pair<std::string, bool>> frames{{small, true}, {large, true}, {"next", false}};
+    auto received = co_await receive(acceptor, true, std::move(frames));
+    if (received != std::vector<std::string>{small, "next"}) {
+        std::cout << "an endpoint decompressed " << received.size() << " values past its frame limit\n";
+        co_return 1;
+    }
+
+    // an endpoint that never enabled compression does not decompress
+    frames = {{small, true}, {"next", false}};
+    received = co_await receive(acceptor, false, std::move(frames));
+    if (received != std::vector<std::string>{"next"}) {
+        std::cout << "an endpoint decompressed " << received.size() << " values it never asked for\n";
+        co_return 1;
+    }
+    co_return 0;
+}
+
+int main(void) {
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    auto result = asio::co_spawn(ctx, run(acceptor), asio::use_future);
+    ctx.run();
+    auto rc = result.get();
+    if (rc == 0) {
+        std::cout << "compressed frames past the limit, or unannounced, were dropped\n";
+    }
+    return rc;
+}
@@ -0,0 +1,124 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using socket_type = wirecall::buffered_socket<asio::generic::stream_protocol::socket>;
+
+std::vector<uint8_t> header(uint32_t length, wirecall::priority lane = wirecall::priority::normal, bool more = false) {
+    auto value = wirecall::details::fragment_header::encode(length, lane, more);
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i < wirecall::frame_length_size; ++i) {
+        bytes.push_back((value >> (8 * i)) & 0xff);
+    }
+    return bytes;
+}
+
+void append(std::vector<uint8_t> & out, std::vector<uint8_t> const & bytes) {
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+void append(std::vector<uint8_t> & out, std::string const & text) {
+    out.insert(out.end(), text.begin(), text.end());
+}
+
+// Writes the bytes a few at a time, so that headers and bodies arrive split across reads
+asio::awaitable<void> trickle(asio::ip::tcp::socket & socket, std::vector<uint8_t> bytes) {
+    for (size_t i = 0; i < bytes.size(); i += 3) {
+        auto n = std::min<size_t>(3, bytes.size() - i);
+        co_await asio::async_write(socket, asio::buffer(bytes.data() + i, n), asio::use_awaitable);
+        co_await asio::post(asio::use_awaitable);
+    }
+}
+
+std::string text(wirecall::frame const & payload) {
+    auto data = payload.data();
+    return {data.begin(), data.end()};
+}
+
+asio::awaitable<int> run(asio::ip::tcp::acceptor & acceptor) {
+    auto executor = co_await asio::this_coro::executor;
+
+    asio::ip::tcp::socket writer{executor};
+    co_await writer.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+    socket_type reader{co_await acceptor.async_accept(asio::use_awaitable), 1};
+    reader.set_max_frame(16);
+
+    // a whole frame, a frame in two fragments with a high priority frame in between,
+    // and an empty frame
+    std::vector<uint8_t> bytes;
+    append(bytes, header(5));
+    append(bytes, std::string{"hello"});
+    append(bytes, header(4, wirecall::priority::low, true));
+    append(bytes, std::string{"frag"});
+    append(bytes, header(6, wirecall::priority::high));
+    append(bytes, std::string{"urgent"});
+    append(bytes, header(6, wirecall::priority::low));
+    append(bytes, std::string{"mented"});
+    append(bytes, header(0));
+    asio::co_spawn(executor, trickle(writer, std::move(bytes)), asio::detached);
+
+    std::vector<std::string> expected{"hello", "urgent", "fragmented", ""};
+    for (auto const & body : expected) {
+        auto payload = co_await reader.read_frame();
+        if (text(payload) != body) {
+            std::cout << "read `" << text(payload) << "` instead of `" << body << "`\n";
+            co_return 1;
+        }
+    }
+
+    // fragments adding up to more than the limit close the connection, before their
+    // bytes are even read
+    bytes.clear();
+    append(bytes, header(10, wirecall::priority::normal, true));
+    append(bytes, std::string(10, 'x'));
+    append(bytes, header(10, wirecall::priority::normal, false));
+    co_await asio::async_write(writer, asio::buffer(bytes), asio::use_awaitable);
+    try {
+        co_await reader.read_frame();
+        std::cout << "fragments past the limit were accepted\n";
+        co_return 1;
+    } catch (std::length_error const &) {
+    }
+    if (reader.is_open()) {
+        std::cout << "the connection was left open\n";
+        co_return 1;
+    }
+
+    // and so does a single oversized length
+    asio::ip::tcp::socket other{executor};
+    co_await other.async_connect(acceptor.local_endpoint(), asio::use_awaitable);
+    socket_type oversized{co_await acceptor.async_accept(asio::use_awaitable)};
+    oversized.set_max_frame(1024);
+    auto huge = header(wirecall::details::fragment_header::max_length);
+    co_await asio::async_write(other, asio::buffer(huge), asio::use_awaitable);
+    try {
+        co_await oversized.read_frame();
+        std::cout << "an oversized frame was accepted\n";
+        co_return 1;
+    } catch (std::length_error const &) {
+    }
+    if (oversized.is_open()) {
+        std::cout << "the connection was left open\n";
+        co_return 1;
+    }
+    co_return 0;
+}
+
+int main(void) {
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    auto result = asio::co_spawn(ctx, run(acceptor), asio::use_future);
+    ctx.run();
+    auto rc = result.get();
+    if (rc == 0) {
+        std::cout << "frames read across partial reads, oversized ones rejected\n";
+    }
+    return rc;
+}
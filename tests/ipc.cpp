@@ -2,11 +2,15 @@
 
 #include <asio.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <exception>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace {
 
@@ -18,8 +22,11 @@ enum class daytime {
     evening,
 };
 
-asio::awaitable<void> client(asio::ip::tcp::socket socket) {
+asio::awaitable<int> client(asio::ip::tcp::socket socket) {
     wirecall::ipc_endpoint<std::string> endpoint{std::move(socket)};
+    endpoint.set_compression(wirecall::compression{});
+    // frames larger than a kilobyte are fragmented
+    endpoint.set_write_coalescing(wirecall::write_coalescing{.max_fragment_bytes = 1024});
 
     co_await endpoint.add_method("name", []() {
         return "client"s;
@@ -42,6 +49,61 @@ asio::awaitable<void> client(asio::ip::tcp::socket socket) {
     // call a method using a callback
     co_await endpoint.call<void>("get_secret", "callback"sv);
 
+    // call a streaming method, it never gets more than 4 numbers ahead of us
+    endpoint.set_stream_window(4);
+    auto numbers = co_await endpoint.call_stream<int>("count", 100);
+    int sum = 0;
+    while (auto number = co_await numbers.next()) {
+        sum += *number;
+    }
+    std::cout << "sum of the streamed numbers: " << sum << "\n";
+    if (sum != 4950) {
+        co_return 1;
+    }
+
+    // call several methods with a single frame each way
+    decltype(endpoint)::batch batch;
+    auto batched_number = batch.add<size_t>("number");
+    auto batched_greeting = batch.add<std::string>("greeting", daytime::evening);
+    auto batched_failure = batch.add<void>("invalid");
+    co_await endpoint.call_batch(batch);
+    std::cout << "batched results: " << batched_number.get() << ", " << batched_greeting.get() << "\n";
+    if (batched_number.get() != 42 || batched_greeting.get() != "good evening client") {
+        co_return 1;
+    }
+    try {
+        batched_failure.get();
+        co_return 1;
+    } catch (std::exception & ex) {
+        std::cout << "batched invalid method: " << ex.what() << "\n";
+    }
+
+    // large results are compressed, once the peer announced it can decompress them
+    auto repeated = co_await endpoint.call<std::string>("repeat", "wirecall "sv, 100000);
+    std::cout << "received a repeated string of " << repeated.size() << " bytes\n";
+    if (repeated.size() != 900000 || !repeated.starts_with("wirecall wirecall ")) {
+        co_return 1;
+    }
+
+    // bulk transfers go out in fragments, once nothing of a higher priority is waiting
+    auto bulk = co_await endpoint.call_with_priority<std::vector<uint8_t>>(wirecall::priority::low, "bytes", 100000);
+    auto control = co_await endpoint.call_with_priority<size_t>(wirecall::priority::high, "number");
+    std::cout << "received " << bulk.size() << " bulk bytes and number " << control << "\n";
+    if (bulk.size() != 100000 || control != 42) {
+        co_return 1;
+    }
+
+    // results of methods the server marked cacheable are kept until it invalidates them
+    endpoint.set_result_cache(wirecall::result_cache_options{});
+    auto version = co_await endpoint.call<int>("version");
+    auto cached_version = co_await endpoint.call<int>("version");
+    co_await endpoint.call<void>("bump_version");
+    auto bumped_version = co_await endpoint.call<int>("version");
+    std::cout << "versions: " << version << ", " << cached_version << ", " << bumped_version << ", cache hits: " << endpoint.cache_stats().hits << "\n";
+    if (version != 1 || cached_version != 1 || bumped_version != 2 || endpoint.cache_stats().hits != 1) {
+        co_return 1;
+    }
+
     try {
         // call a throwing method
         auto greeting = co_await endpoint.call<std::string>("authorize", "user"sv, "password"sv);
@@ -49,6 +111,17 @@ asio::awaitable<void> client(asio::ip::tcp::socket socket) {
         std::cout << "authorization failed: " << ex.what() << "\n";
     }
 
+    try {
+        // give up on a slow method, which gets cancelled on the server as well
+        co_await endpoint.call_for<void>(20ms, "sleep", 200);
+        co_return 1;
+    } catch (asio::system_error & ex) {
+        std::cout << "deadline exceeded: " << ex.what() << "\n";
+        if (ex.code() != asio::error::timed_out) {
+            co_return 1;
+        }
+    }
+
     try {
         // call an invalid method
         co_await endpoint.call<void>("invalid");
@@ -69,10 +142,23 @@ asio::awaitable<void> client(asio::ip::tcp::socket socket) {
     } catch (std::exception & ex) {
         std::cout << "invalid return signature: " << ex.what() << "\n";
     }
+
+    auto metrics = co_await endpoint.call<std::vector<uint64_t>>("metrics");
+    std::cout << "number calls: " << metrics[0] << ", failed: " << metrics[1] << "\n";
+    std::cout << "authorize failed: " << metrics[2] << ", invalid calls: " << metrics[3] << ", metrics in flight: " << metrics[4] << "\n";
+    // "number" only failed on the wrong arguments, the wrong return type failing here, and
+    // the metrics call is still running
+    if (metrics != std::vector<uint64_t>{5, 1, 1, 2, 1}) {
+        co_return 1;
+    }
+    co_return 0;
 }
 
 asio::awaitable<void> server(asio::ip::tcp::socket socket) {
     wirecall::ipc_endpoint<std::string> endpoint{std::move(socket)};
+    endpoint.set_compression(wirecall::compression{});
+    // frames larger than a kilobyte are fragmented
+    endpoint.set_write_coalescing(wirecall::write_coalescing{.max_fragment_bytes = 1024});
 
     // a simple method
     co_await endpoint.add_method("number", []() {
@@ -97,20 +183,77 @@ asio::awaitable<void> server(asio::ip::tcp::socket socket) {
         co_await endpoint.call<wirecall::ignore_result>(callback_name, "a secret"sv);
     });
 
+    // a streaming method
+    co_await endpoint.add_method("count", [](wirecall::stream_writer<int> & out, int n) -> asio::awaitable<void> {
+        for (int i = 0; i < n; ++i) {
+            co_await out.yield(i);
+        }
+    });
+
+    // a method with a large result
+    co_await endpoint.add_method("repeat", [](std::string_view text, int n) {
+        std::string result;
+        for (int i = 0; i < n; ++i) {
+            result += text;
+        }
+        return result;
+    });
+
+    // a method with a large result that doesn't compress
+    co_await endpoint.add_method("bytes", [](int n) {
+        std::vector<uint8_t> result(n);
+        uint32_t state = 1;
+        for (auto & byte : result) {
+            state = state * 1103515245 + 12345;
+            byte = state >> 24;
+        }
+        return result;
+    });
+
+    // a cacheable method, invalidated whenever its result changes and kept until then
+    std::atomic<int> version = 1;
+    co_await endpoint.add_method("version", [&version]() {
+        return version.load();
+    });
+    co_await endpoint.set_cacheable("version", std::chrono::steady_clock::duration::max());
+    co_await endpoint.add_method("bump_version", [&endpoint, &version]() -> asio::awaitable<void> {
+        ++version;
+        co_await endpoint.invalidate("version");
+    });
+
+    // a slow method
+    co_await endpoint.add_method("sleep", [](int ms) -> asio::awaitable<void> {
+        asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{ms}};
+        co_await timer.async_wait(asio::use_awaitable);
+    });
+
     // a throwing method
     co_await endpoint.add_method("authorize", [](std::string user, std::string password) {
         throw std::runtime_error("Failed to authorize user \"" + user + "\"");
     });
 
+    // the metrics of this endpoint
+    co_await endpoint.add_method("metrics", [&endpoint]() {
+        auto metrics = endpoint.metrics();
+        auto & number = metrics.methods["number"];
+        return std::vector<uint64_t>{
+            number.calls,
+            number.errors,
+            metrics.methods["authorize"].errors,
+            metrics.invalid_calls,
+            metrics.methods["metrics"].in_flight,
+        };
+    });
+
     co_await endpoint.run();
 }
 
-asio::awaitable<void> client() {
+asio::awaitable<int> client() {
     auto ctx = co_await asio::this_coro::executor;
     asio::ip::tcp::endpoint ep(asio::ip::make_address("127.0.0.1"), 5678);
     asio::ip::tcp::socket socket{ctx, ep.protocol()};
     co_await socket.async_connect(ep, asio::use_awaitable);
-    co_await client(std::move(socket));
+    co_return co_await client(std::move(socket));
 }
 
 asio::awaitable<void> server() {
@@ -126,7 +269,7 @@ asio::awaitable<void> server() {
 int main(void) {
     asio::thread_pool ctx(2);
     asio::co_spawn(ctx, server(), asio::detached);
-    asio::co_spawn(ctx, client(), asio::detached);
+    auto result = asio::co_spawn(ctx, client(), asio::use_future);
     ctx.join();
-    return 0;
+    return result.get();
 }
\ No newline at end of file
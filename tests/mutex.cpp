@@ -0,0 +1,84 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <atomic>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+asio::awaitable<void> exclusive(wirecall::async_mutex & mutex, int id, int & inside, std::vector<int> & order) {
+    auto lock = co_await mutex.lock();
+    if (inside++) {
+        throw std::runtime_error("two owners at once");
+    }
+    order.push_back(id);
+    // yield while holding the lock, so the others have to queue
+    co_await asio::post(asio::use_awaitable);
+    --inside;
+}
+
+asio::awaitable<void> shared(wirecall::async_shared_mutex & mutex, bool writer, std::atomic<int> & readers, std::atomic<int> & writers) {
+    for (int i = 0; i < 1000; ++i) {
+        if (writer) {
+            auto lock = co_await mutex.lock();
+            if (writers++ || readers) {
+                throw std::runtime_error("writer does not own the lock alone");
+            }
+            co_await asio::post(asio::use_awaitable);
+            --writers;
+        } else {
+            auto lock = co_await mutex.lock_shared();
+            ++readers;
+            if (writers) {
+                throw std::runtime_error("reader shares the lock with a writer");
+            }
+            co_await asio::post(asio::use_awaitable);
+            --readers;
+        }
+    }
+}
+
+int main(void) {
+    {
+        // waiters get the lock in the order they asked for it
+        asio::io_context ctx;
+        wirecall::async_mutex mutex;
+        int inside = 0;
+        std::vector<int> order;
+        for (int id = 0; id < 8; ++id) {
+            asio::co_spawn(ctx, exclusive(mutex, id, inside, order), asio::detached);
+        }
+        ctx.run();
+        for (int id = 0; id < 8; ++id) {
+            if (order.size() != 8 || order[id] != id) {
+                std::cout << "waiters were not served in order\n";
+                return 1;
+            }
+        }
+        if (!mutex.try_lock()) {
+            std::cout << "mutex still locked\n";
+            return 1;
+        }
+    }
+
+    {
+        asio::thread_pool ctx(4);
+        wirecall::async_shared_mutex mutex;
+        std::atomic<int> readers = 0, writers = 0, failed = 0;
+        for (int id = 0; id < 12; ++id) {
+            asio::co_spawn(ctx, shared(mutex, id % 3 == 0, readers, writers), [&](std::exception_ptr ex) {
+                if (ex) ++failed;
+            });
+        }
+        ctx.join();
+        if (failed) {
+            std::cout << "shared mutex failed\n";
+            return 1;
+        }
+    }
+
+    std::cout << "mutexes ok\n";
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+using table_type = wirecall::details::pending_calls<wirecall::async_channel>;
+
+wirecall::frame make_frame(uint8_t value) {
+    return wirecall::frame{std::vector<uint8_t>{value}};
+}
+
+asio::awaitable<int> run() {
+    table_type table{co_await asio::this_coro::executor};
+
+    for (uint8_t round = 0; round < 100; ++round) {
+        // a call given up on before its result arrived
+        table_type::key_type stale;
+        {
+            auto abandoned = table.acquire();
+            stale = abandoned.key();
+        }
+
+        // its slot is reused right away under a new generation, the low 24 bits of a key
+        // are the index of its slot
+        auto call = table.acquire();
+        if (call.key() == stale || (call.key() & 0xffffff) != (stale & 0xffffff)) {
+            std::cout << "the slot was not reused under a new key\n";
+            co_return 1;
+        }
+
+        auto late = make_frame(0);
+        if (table.complete(stale, late)) {
+            std::cout << "a late result reached the call reusing its slot\n";
+            co_return 1;
+        }
+
+        auto result = make_frame(round);
+        if (!table.complete(call.key(), result)) {
+            std::cout << "the result of the current call was dropped\n";
+            co_return 1;
+        }
+        auto payload = co_await call.result();
+        if (payload.data().size() != 1 || payload.data()[0] != round) {
+            std::cout << "the current call got the wrong result\n";
+            co_return 1;
+        }
+
+        // and once it has its result, nothing else is delivered to it
+        auto duplicate = make_frame(0);
+        if (table.complete(call.key(), duplicate)) {
+            std::cout << "a second result was delivered\n";
+            co_return 1;
+        }
+    }
+
+    // a stream gets the results it had room for, then fails instead of missing some
+    auto stream = table.acquire_stream();
+    constexpr auto buffered = table_type::max_stream_results + 1;
+    for (size_t i = 0; i < buffered + 2; ++i) {
+        auto item = make_frame(static_cast<uint8_t>(i));
+        if (table.complete(stream.key(), item) != (i < buffered)) {
+            std::cout << "result " << i << " of the stream was " << (i < buffered ? "dropped" : "buffered") << "\n";
+            co_return 1;
+        }
+    }
+    for (size_t i = 0; i < buffered; ++i) {
+        auto payload = co_await stream.result();
+        if (payload.data()[0] != i) {
+            std::cout << "the stream got result " << int(payload.data()[0]) << " instead of " << i << "\n";
+            co_return 1;
+        }
+    }
+    bool failed = false;
+    try {
+        co_await stream.result();
+    } catch (std::runtime_error const &) {
+        failed = true;
+    }
+    if (!failed) {
+        std::cout << "the stream did not fail after missing results\n";
+        co_return 1;
+    }
+    co_return 0;
+}
+
+int main(void) {
+    asio::io_context ctx;
+    auto result = asio::co_spawn(ctx, run(), asio::use_future);
+    ctx.run();
+    auto rc = result.get();
+    if (rc == 0) {
+        std::cout << "late results dropped across slot generations, overflowing streams failed\n";
+    }
+    return rc;
+}
@@ -0,0 +1,94 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+
+using endpoint_type = wirecall::ipc_endpoint<std::string>;
+
+constexpr int calls = 500;
+
+asio::awaitable<void> serve(asio::ip::tcp::acceptor & acceptor) {
+    endpoint_type endpoint{co_await acceptor.async_accept(asio::use_awaitable)};
+    co_await endpoint.add_method("echo", [](int value) {
+        return value;
+    });
+    try {
+        co_await endpoint.run();
+    } catch (...) {
+        // the client is done
+    }
+}
+
+asio::awaitable<bool> client(asio::ip::tcp::endpoint ep, wirecall::buffer_pool_stats & warm, wirecall::buffer_pool_stats & steady) {
+    asio::ip::tcp::socket socket{co_await asio::this_coro::executor};
+    co_await socket.async_connect(ep, asio::use_awaitable);
+    endpoint_type endpoint{std::move(socket)};
+    endpoint.run(asio::detached);
+
+    // warmed up with values encoded as long as the measured ones, past 127
+    bool ok = true;
+    for (int i = 0; i < 200; ++i) {
+        ok &= co_await endpoint.call<int>("echo", i) == i;
+    }
+    warm = wirecall::frame_buffer_pool_stats();
+    for (int i = 0; i < calls; ++i) {
+        ok &= co_await endpoint.call<int>("echo", i) == i;
+    }
+    steady = wirecall::frame_buffer_pool_stats();
+
+    endpoint.close();
+    co_return ok;
+}
+
+int main(void) {
+    using pool = wirecall::details::frame_buffer_pool;
+
+    // an empty pool misses, a recycled buffer large enough hits
+    auto start = wirecall::frame_buffer_pool_stats();
+    pool::release(pool::acquire(100));
+    auto hit = pool::acquire(50);
+    auto miss = pool::acquire(200);
+    auto stats = wirecall::frame_buffer_pool_stats();
+    if (stats.hits - start.hits != 1 || stats.misses - start.misses != 2) {
+        std::cout << "unexpected counts: " << stats.hits - start.hits << " hits, " << stats.misses - start.misses << " misses\n";
+        return 1;
+    }
+    pool::release(std::move(hit));
+    pool::release(std::move(miss));
+
+    // buffers too large to keep around are not recycled
+    pool::release(pool::acquire(pool::max_buffer_capacity + 1));
+    start = wirecall::frame_buffer_pool_stats();
+    auto large = pool::acquire(pool::max_buffer_capacity + 1);
+    if (wirecall::frame_buffer_pool_stats().misses - start.misses != 1) {
+        std::cout << "a large buffer was recycled\n";
+        return 1;
+    }
+    pool::release(std::move(large));
+
+    // both ends run on this thread, each call receives a request and a result
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    wirecall::buffer_pool_stats warm;
+    wirecall::buffer_pool_stats steady;
+    asio::co_spawn(ctx, serve(acceptor), asio::detached);
+    auto result = asio::co_spawn(ctx, client(acceptor.local_endpoint(), warm, steady), asio::use_future);
+    ctx.run();
+
+    if (!result.get()) {
+        std::cout << "wrong results\n";
+        return 1;
+    }
+    auto hits = steady.hits - warm.hits;
+    auto misses = steady.misses - warm.misses;
+    if (misses != 0 || hits < 2 * calls) {
+        std::cout << "steady state calls had " << hits << " hits and " << misses << " misses\n";
+        return 1;
+    }
+    std::cout << calls << " calls got their frame buffers from the pool, " << hits << " hits and no misses\n";
+    return 0;
+}
@@ -0,0 +1,196 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using endpoint_type = wirecall::ipc_endpoint<std::string>;
+
+asio::awaitable<void> run(std::shared_ptr<endpoint_type> endpoint) {
+    try {
+        co_await endpoint->run();
+    } catch (...) {
+        // closed once the client is done
+    }
+}
+
+asio::awaitable<int> client(asio::ip::tcp::endpoint ep, int id) {
+    auto ctx = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket socket{ctx, ep.protocol()};
+    co_await socket.async_connect(ep, asio::use_awaitable);
+
+    auto endpoint = std::make_shared<endpoint_type>(std::move(socket));
+
+    asio::co_spawn(ctx, run(endpoint), asio::detached);
+
+    // every client asks at about the same time, odd ones with calls they can cancel
+    std::string name = "timeout";
+    int timeout = -1;
+    if (id % 2 == 0) {
+        timeout = co_await endpoint->call<int>("config", name);
+    } else {
+        asio::cancellation_signal cancel;
+        if (id == 1) {
+            // gives up on its first call, which leaves the run to the others
+            asio::steady_timer giving_up{ctx, std::chrono::milliseconds{20}};
+            giving_up.async_wait([&cancel](asio::error_code ec) {
+                if (!ec) cancel.emit(asio::cancellation_type::terminal);
+            });
+            try {
+                co_await asio::co_spawn(ctx, endpoint->call<int>("config", name), asio::bind_cancellation_slot(cancel.slot(), asio::use_awaitable));
+            } catch (asio::system_error const &) {
+                // cancelled
+            }
+        }
+        timeout = co_await asio::co_spawn(ctx, endpoint->call<int>("config", name), asio::bind_cancellation_slot(cancel.slot(), asio::use_awaitable));
+    }
+    if (timeout != 30) {
+        endpoint->close();
+        co_return -1;
+    }
+
+    for (int i = 0; i < 10; ++i) {
+        co_await endpoint->call<wirecall::ignore_result>("sum", id, i);
+    }
+
+    // more calls at once than the server runs for a connection, and a batch
+    auto probes = std::make_shared<std::atomic<int>>(0);
+    auto on_pool = std::make_shared<std::atomic<bool>>(true);
+    for (int i = 0; i < 8; ++i) {
+        asio::co_spawn(ctx, [endpoint, id, probes, on_pool]() -> asio::awaitable<void> {
+            if (!co_await endpoint->call<bool>("probe", id)) *on_pool = false;
+            ++*probes;
+        }, asio::detached);
+    }
+    endpoint_type::batch batch;
+    auto batched = batch.add<bool>("probe", id);
+    co_await endpoint->call_batch(batch);
+    asio::steady_timer timer{ctx};
+    while (*probes < 8) {
+        timer.expires_after(std::chrono::milliseconds{5});
+        co_await timer.async_wait(asio::use_awaitable);
+    }
+    if (!*on_pool || !batched.get()) {
+        endpoint->close();
+        co_return -1;
+    }
+
+    int total = 0;
+    for (int i = 0; i < 10; ++i) {
+        total += co_await endpoint->call<int>("sum", id, i);
+    }
+
+    endpoint->close();
+    co_return total;
+}
+
+int main(void) {
+    constexpr int clients = 16;
+
+    // calls waiting for a run that is torn down before it completes fail
+    {
+        using flights_type = wirecall::details::single_flight<int, wirecall::async_channel>;
+        asio::io_context waiting_ctx;
+        auto flights = std::make_shared<flights_type>();
+        std::optional<flights_type::leader> leader;
+        leader.emplace(std::move(std::get<0>(flights->join("args", waiting_ctx.get_executor()))));
+        auto waiter = std::get<1>(flights->join("args", waiting_ctx.get_executor()));
+        leader.reset();
+        auto outcome = waiter.try_receive();
+        if (!outcome || (*outcome)->result || (*outcome)->error.empty()) {
+            std::cout << "a call waited for a run that was gone\n";
+            return 1;
+        }
+    }
+
+    // the methods are registered once, and shared by all the connections
+    wirecall::ipc_server<std::string>::method_registry methods;
+    methods.add("sum", [](int a, int b) -> int {
+        return a + b;
+    });
+
+    // identical calls running at the same time share a single run
+    std::atomic<int> config_runs = 0;
+    methods.add("config", [&config_runs](std::string name) -> asio::awaitable<int> {
+        ++config_runs;
+        asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{200}};
+        co_await timer.async_wait(asio::use_awaitable);
+        co_return name == "timeout" ? 30 : 0;
+    }, wirecall::method_options{.single_flight = true});
+
+    // methods run on a separate pool, at most 4 at a time for each connection
+    asio::thread_pool workers(2);
+
+    std::vector<std::atomic<int>> running(clients);
+    std::vector<std::atomic<int>> peak(clients);
+    methods.add("probe", [&](int id) -> asio::awaitable<bool> {
+        bool on_pool = workers.get_executor().running_in_this_thread();
+        int now = ++running[id];
+        int seen = peak[id];
+        while (now > seen && !peak[id].compare_exchange_weak(seen, now)) {}
+        asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{20}};
+        co_await timer.async_wait(asio::use_awaitable);
+        --running[id];
+        co_return on_pool;
+    });
+
+    wirecall::ipc_server_options options;
+    options.threads = 4;
+    options.max_in_flight = 4;
+    options.handler_executor = workers.get_executor();
+
+    wirecall::ipc_server<std::string> server{
+        asio::ip::tcp::endpoint{asio::ip::make_address("127.0.0.1"), 0},
+        std::move(methods),
+        options
+    };
+
+    std::thread server_thread{[&server]() {
+        server.run();
+    }};
+
+    asio::thread_pool ctx(2);
+    std::vector<int> totals(clients, -1);
+    std::atomic<int> done = 0;
+    for (int id = 0; id < clients; ++id) {
+        // each client on its own strand, which its cancellation is emitted on
+        asio::co_spawn(asio::make_strand(ctx), client(server.local_endpoint(), id), [&, id](std::exception_ptr ex, int total) {
+            if (!ex) totals[id] = total;
+            if (++done == clients) server.stop();
+        });
+    }
+    ctx.join();
+    server_thread.join();
+
+    for (int id = 0; id < clients; ++id) {
+        if (totals[id] != 10 * id + 45) {
+            std::cout << "client " << id << " failed\n";
+            return 1;
+        }
+    }
+    for (int id = 0; id < clients; ++id) {
+        if (peak[id] > 4) {
+            std::cout << "client " << id << " had " << peak[id] << " calls running at once\n";
+            return 1;
+        }
+    }
+    // a client connecting late may miss the first run
+    if (config_runs > 2) {
+        std::cout << "config ran " << config_runs << " times for " << clients << " clients\n";
+        return 1;
+    }
+    std::cout << "served " << clients << " clients, config ran " << config_runs << " times\n";
+    std::cout << "sum was called " << server.metrics().at("sum").calls << " times\n";
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using endpoint_type = wirecall::shm_ipc_endpoint<std::string>;
+
+asio::awaitable<void> calls(endpoint_type & endpoint) {
+    auto result = co_await endpoint.call<int>("sum", 20, 22);
+    std::cout << "20 + 22 = " << result << "\n";
+
+    // larger than the ring, so the writer has to wait for the reader
+    std::string message(100000, 'x');
+    auto echo = co_await endpoint.call<std::string>("echo", message);
+    if (echo != message) {
+        throw std::runtime_error("echo mismatch");
+    }
+    std::cout << "echoed " << echo.size() << " bytes\n";
+
+    endpoint.close();
+}
+
+asio::awaitable<void> client(asio::local::stream_protocol::socket socket) {
+    endpoint_type endpoint{co_await wirecall::shm_socket::create(std::move(socket), 4096)};
+
+    asio::co_spawn(endpoint.get_executor(), calls(endpoint), asio::detached);
+
+    try {
+        co_await endpoint.run();
+    } catch (...) {
+        // closed once the calls are done
+    }
+}
+
+asio::awaitable<void> server(asio::local::stream_protocol::socket socket) {
+    endpoint_type endpoint{co_await wirecall::shm_socket::attach(std::move(socket))};
+
+    co_await endpoint.add_method("sum", [](int a, int b) -> int {
+        return a + b;
+    });
+
+    co_await endpoint.add_method("echo", [](std::string message) {
+        return message;
+    });
+
+    try {
+        co_await endpoint.run();
+    } catch (...) {
+        // the client hung up
+    }
+}
+
+int main(void) {
+    asio::thread_pool ctx(2);
+    asio::local::stream_protocol::socket client_socket{ctx}, server_socket{ctx};
+    asio::local::connect_pair(client_socket, server_socket);
+    asio::co_spawn(ctx, server(std::move(server_socket)), asio::detached);
+    asio::co_spawn(ctx, client(std::move(client_socket)), asio::detached);
+    ctx.join();
+    return 0;
+}
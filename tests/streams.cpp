@@ -0,0 +1,82 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+
+using endpoint_type = wirecall::ipc_endpoint<std::string>;
+
+// A streaming method waiting for credits when its caller hangs up gives up on the stream.
+// The endpoint outlives the method, which still reports its failure once it stopped.
+asio::awaitable<void> serve(asio::io_context & ctx, asio::ip::tcp::acceptor & acceptor, std::unique_ptr<endpoint_type> & endpoint, std::string & outcome) {
+    endpoint = std::make_unique<endpoint_type>(co_await acceptor.async_accept(asio::use_awaitable));
+
+    co_await endpoint->add_method("numbers", [&outcome](wirecall::stream_writer<int> & out, int n) -> asio::awaitable<void> {
+        try {
+            for (int i = 0; i < n; ++i) {
+                co_await out.yield(i);
+            }
+            outcome = "completed";
+        } catch (std::exception const & ex) {
+            outcome = ex.what();
+            throw;
+        }
+    });
+
+    try {
+        co_await endpoint->run();
+    } catch (...) {
+        // the caller hung up
+    }
+
+    asio::steady_timer timer{co_await asio::this_coro::executor};
+    for (int i = 0; i < 500 && outcome.empty(); ++i) {
+        timer.expires_after(std::chrono::milliseconds{10});
+        co_await timer.async_wait(asio::use_awaitable);
+    }
+    if (outcome.empty()) {
+        // the method would wait forever
+        ctx.stop();
+    }
+}
+
+// The endpoint also outlives the cancellation the stream sends when it is dropped
+asio::awaitable<void> client(asio::ip::tcp::endpoint ep, std::unique_ptr<endpoint_type> & endpoint) {
+    asio::ip::tcp::socket socket{co_await asio::this_coro::executor};
+    co_await socket.async_connect(ep, asio::use_awaitable);
+    endpoint = std::make_unique<endpoint_type>(std::move(socket));
+    endpoint->run(asio::detached);
+
+    // far more numbers than the window lets the method send before they are read
+    endpoint->set_stream_window(2);
+    auto numbers = co_await endpoint->call_stream<int>("numbers", 1000);
+
+    // none are read, the method uses up its credits and waits for more
+    asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{50}};
+    co_await timer.async_wait(asio::use_awaitable);
+    endpoint->close();
+}
+
+int main(void) {
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+
+    std::unique_ptr<endpoint_type> server;
+    std::unique_ptr<endpoint_type> caller;
+    std::string outcome;
+    asio::co_spawn(ctx, serve(ctx, acceptor, server, outcome), asio::detached);
+    asio::co_spawn(ctx, client(acceptor.local_endpoint(), caller), asio::detached);
+    ctx.run();
+
+    if (outcome.empty() || outcome == "completed") {
+        std::cout << "the stream " << (outcome.empty() ? "was still waiting for credits" : "completed") << "\n";
+        return 1;
+    }
+    std::cout << "the stream stopped once the caller was gone: " << outcome << "\n";
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <utility>
+
+using endpoint_type = wirecall::pubsub_endpoint<std::string>;
+
+constexpr int messages = 2000;
+constexpr int churners = 4;
+constexpr int rounds = 500;
+
+int main(void) {
+    asio::thread_pool ctx(4);
+    asio::io_context sender_ctx;
+
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::ip::tcp::socket socket{sender_ctx};
+    socket.connect(acceptor.local_endpoint());
+    endpoint_type receiver{acceptor.accept()};
+    endpoint_type sender{std::move(socket)};
+
+    // every frame lands exactly once, in its subscription or in the default callback,
+    // whatever the subscriptions look like when it is dispatched
+    std::atomic<int> steady = 0;
+    std::atomic<int> matched = 0;
+    std::atomic<int> unmatched = 0;
+    std::atomic<int> churned = 0;
+    std::atomic<bool> done = false;
+
+    // gives up on frames that never arrive
+    asio::steady_timer timeout{sender_ctx, std::chrono::seconds{10}};
+    auto closing = [&]() {
+        asio::post(sender_ctx, [&]() {
+            timeout.cancel();
+            sender.close();
+        });
+    };
+    auto received = [&]() {
+        if (steady + matched + unmatched == 2 * messages && churned == churners && !done.exchange(true)) {
+            closing();
+        }
+    };
+
+    asio::co_spawn(ctx, [&]() -> asio::awaitable<void> {
+        co_await receiver.subscribe("steady", [&](int) {
+            ++steady;
+            received();
+        });
+        receiver.subscribe_default([&](std::string, int) {
+            ++unmatched;
+            received();
+        });
+    }, asio::use_future).get();
+    asio::co_spawn(ctx, [&]() -> asio::awaitable<void> {
+        try {
+            co_await receiver.run();
+        } catch (...) {
+            // the sender is done
+        }
+    }, asio::detached);
+
+    // the subscriptions change from other threads while frames are being dispatched
+    for (int i = 0; i < churners; ++i) {
+        asio::co_spawn(ctx, [&, i]() -> asio::awaitable<void> {
+            auto executor = co_await asio::this_coro::executor;
+            auto key = "churn/" + std::to_string(i);
+            for (int round = 0; round < rounds; ++round) {
+                co_await receiver.subscribe(key, [&](int) {
+                    ++matched;
+                    received();
+                });
+                receiver.subscribe_pattern("churn/+", [&](std::string, int) {
+                    ++matched;
+                    received();
+                });
+                co_await asio::post(executor, asio::use_awaitable);
+                co_await receiver.unsubscribe(key);
+                receiver.unsubscribe_pattern("churn/+");
+                co_await asio::post(executor, asio::use_awaitable);
+            }
+            ++churned;
+            received();
+        }, asio::detached);
+    }
+
+    sender.run(asio::detached);
+    asio::co_spawn(sender_ctx, [&]() -> asio::awaitable<void> {
+        for (int i = 0; i < messages; ++i) {
+            co_await sender.publish("steady", i);
+            co_await sender.publish("churn/" + std::to_string(i % churners), i);
+        }
+    }, asio::detached);
+
+    timeout.async_wait([&](asio::error_code ec) {
+        if (!ec) sender.close();
+    });
+
+    sender_ctx.run();
+    asio::post(ctx, [&receiver]() {
+        receiver.close();
+    });
+    ctx.join();
+
+    if (steady != messages || matched + unmatched != messages || churned != churners) {
+        std::cout << "steady: " << steady << ", churn: " << matched << " + " << unmatched << ", churners done: " << churned << "\n";
+        return 1;
+    }
+    std::cout << "delivered " << 2 * messages << " frames, " << matched << " while subscribed\n";
+    return 0;
+}
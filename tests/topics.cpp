@@ -0,0 +1,144 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+using endpoint_type = wirecall::pubsub_endpoint<std::string>;
+
+// Which subscription each key was delivered to
+using deliveries = std::map<std::string, std::string>;
+
+asio::awaitable<void> subscriber(asio::ip::tcp::acceptor & acceptor, deliveries & received) {
+    endpoint_type endpoint{co_await acceptor.async_accept(asio::use_awaitable)};
+
+    co_await endpoint.subscribe("sensors/kitchen/temperature", [&received](int) {
+        received["sensors/kitchen/temperature"] = "exact";
+    });
+    endpoint.subscribe_pattern("sensors/+/temperature", [&received](std::string key, int) {
+        received[key] = "+/temperature";
+    });
+    endpoint.subscribe_pattern("sensors/#", [&received](std::string key, int) {
+        received[key] = "sensors/#";
+    });
+    endpoint.subscribe_pattern("sensors/garage/#", [&received](std::string key, int) {
+        received[key] = "garage/#";
+    });
+    endpoint.subscribe_pattern("alerts/+", [&received](std::string key, int) {
+        received[key] = "alerts/+";
+    });
+    endpoint.unsubscribe_pattern("alerts/+");
+    endpoint.subscribe_default([&received](std::string key, int) {
+        received[key] = "default";
+    });
+
+    try {
+        endpoint.subscribe_pattern("sensors/#/temperature", [](std::string, int) {});
+        received["invalid"] = "accepted";
+    } catch (std::invalid_argument const &) {
+    }
+
+    try {
+        co_await endpoint.run();
+    } catch (...) {
+        // the publisher is gone
+    }
+}
+
+asio::awaitable<void> publisher(asio::ip::tcp::endpoint ep) {
+    asio::ip::tcp::socket socket{co_await asio::this_coro::executor};
+    co_await socket.async_connect(ep, asio::use_awaitable);
+    endpoint_type endpoint{std::move(socket)};
+    endpoint.run(asio::detached);
+
+    for (auto key : {
+        "sensors/kitchen/temperature",
+        "sensors/bedroom/temperature",
+        "sensors/bedroom/humidity",
+        "sensors",
+        "sensors/garage/temperature",
+        "sensors/garage/door/open",
+        "alerts/fire",
+        "weather",
+    }) {
+        co_await endpoint.publish(key, 1);
+    }
+
+    // give the callbacks time to run before hanging up
+    asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{100}};
+    co_await timer.async_wait(asio::use_awaitable);
+    endpoint.close();
+}
+
+// Patterns overlapping on every level, each with a literal "a" on its own level and '+'
+// on the others, are matched in a single pass and ranked level by level
+bool match_overlapping_patterns() {
+    constexpr int depth = 24;
+    wirecall::details::topic_trie<int> trie;
+    for (int i = 0; i < depth; ++i) {
+        std::string pattern;
+        for (int level = 0; level < depth; ++level) {
+            pattern += level == i ? "a/" : "+/";
+        }
+        trie = trie.insert(pattern + "end", i);
+    }
+    trie = trie.insert("a/#", depth);
+
+    auto key = [](std::string first, std::string last) {
+        std::string key = first;
+        for (int level = 1; level < depth; ++level) {
+            key += "/a";
+        }
+        return key + "/" + last;
+    };
+    auto matches = [&trie](std::string const & key, int expected) {
+        auto found = trie.match(key);
+        if (found ? *found != expected : expected != -1) {
+            std::cout << key << " matched " << (found ? *found : -1) << " instead of " << expected << "\n";
+            return false;
+        }
+        return true;
+    };
+    return matches(key("a", "end"), 0)
+        && matches(key("b", "end"), 1)
+        && matches(key("a", "other"), depth)
+        && matches(key("b", "other"), -1);
+}
+
+int main(void) {
+    if (!match_overlapping_patterns()) {
+        return 1;
+    }
+
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+
+    deliveries received;
+    asio::co_spawn(ctx, subscriber(acceptor, received), asio::detached);
+    asio::co_spawn(ctx, publisher(acceptor.local_endpoint()), asio::detached);
+    ctx.run();
+
+    deliveries expected{
+        {"sensors/kitchen/temperature", "exact"},
+        {"sensors/bedroom/temperature", "+/temperature"},
+        {"sensors/bedroom/humidity", "sensors/#"},
+        {"sensors", "sensors/#"},
+        {"sensors/garage/temperature", "garage/#"},
+        {"sensors/garage/door/open", "garage/#"},
+        {"alerts/fire", "default"},
+        {"weather", "default"},
+    };
+    if (received != expected) {
+        for (auto const & [key, subscription] : received) {
+            std::cout << key << " went to " << subscription << "\n";
+        }
+        return 1;
+    }
+    std::cout << "routed " << received.size() << " keys\n";
+    return 0;
+}
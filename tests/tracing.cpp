@@ -0,0 +1,85 @@
+#if !defined(WIRECALL_ENABLE_TRACING)
+#define WIRECALL_ENABLE_TRACING
+#endif
+
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+using endpoint_type = wirecall::ipc_endpoint<std::string>;
+
+asio::awaitable<void> run(std::shared_ptr<endpoint_type> endpoint) {
+    try {
+        co_await endpoint->run();
+    } catch (...) {
+        // closed once the client is done
+    }
+}
+
+asio::awaitable<void> calls(std::shared_ptr<endpoint_type> client, std::shared_ptr<endpoint_type> server) {
+    co_await server->add_method("sum", [](int a, int b) {
+        return a + b;
+    });
+
+    for (int i = 0; i < 10; ++i) {
+        co_await client->call<int>("sum", i, i);
+    }
+
+    client->close();
+    server->close();
+}
+
+int main(void) {
+    wirecall::enable_tracing();
+
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::ip::tcp::socket client_socket{ctx};
+    client_socket.connect(acceptor.local_endpoint());
+    auto client = std::make_shared<endpoint_type>(std::move(client_socket));
+    auto server = std::make_shared<endpoint_type>(acceptor.accept());
+
+    asio::co_spawn(ctx, run(client), asio::detached);
+    asio::co_spawn(ctx, run(server), asio::detached);
+    asio::co_spawn(ctx, calls(client, server), asio::detached);
+    // recorded on a thread that is gone by the time the trace is dumped
+    std::thread{[&ctx] { ctx.run(); }}.join();
+
+    wirecall::enable_tracing(false);
+
+    std::stringstream trace;
+    wirecall::write_chrome_trace(trace);
+    for (auto event : {"\"send\"", "\"write locked\"", "\"received\"", "\"handler\"", "\"reply sent\""}) {
+        if (trace.str().find(event) == std::string::npos) {
+            std::cout << "no " << event << " event in the trace\n";
+            return 1;
+        }
+    }
+
+    // the ring of the exited thread is dropped once dumped
+    auto & rings = wirecall::details::trace_rings::instance();
+    {
+        std::lock_guard lock{rings.mutex};
+        if (!rings.rings.empty()) {
+            std::cout << rings.rings.size() << " trace rings left after the dump\n";
+            return 1;
+        }
+    }
+    std::stringstream empty;
+    wirecall::write_chrome_trace(empty);
+    if (empty.str().find("\"send\"") != std::string::npos) {
+        std::cout << "events of a dropped ring were dumped again\n";
+        return 1;
+    }
+
+    std::cout << "traced " << trace.str().size() << " bytes of events\n";
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <wirecall.hpp>
+
+#include <asio.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+using endpoint_type = wirecall::ipc_endpoint<std::string>;
+
+asio::awaitable<void> serve(asio::ip::tcp::acceptor & acceptor) {
+    endpoint_type endpoint{co_await acceptor.async_accept(asio::use_awaitable)};
+
+    // the views point into the frame of the call, which has to outlive the suspension
+    co_await endpoint.add_method("describe", [](std::string_view name, std::span<int32_t const> values) -> asio::awaitable<std::string> {
+        asio::steady_timer timer{co_await asio::this_coro::executor, std::chrono::milliseconds{20}};
+        co_await timer.async_wait(asio::use_awaitable);
+        co_return std::string{name} + "=" + std::to_string(std::accumulate(values.begin(), values.end(), int64_t{0}));
+    });
+
+    try {
+        co_await endpoint.run();
+    } catch (...) {
+        // the client is done
+    }
+}
+
+asio::awaitable<std::string> describe(endpoint_type & endpoint, int id) {
+    std::vector<int32_t> values(100 + id, id);
+    co_return co_await endpoint.call<std::string>("describe", "caller " + std::to_string(id), values);
+}
+
+// A size whose byte count wraps around to fit the few bytes that follow it
+asio::awaitable<bool> rejects_truncated_span() {
+    std::vector<uint8_t> bytes;
+    uint64_t size = (uint64_t{1} << 62) + 1;
+    do {
+        bytes.push_back((size & 0x7f) | (size >= 0x80 ? 0x80 : 0));
+        size >>= 7;
+    } while (size);
+    bytes.resize(16, 0);
+
+    try {
+        co_await wirecall::details::deserialize<std::span<int32_t const>>(std::span<uint8_t const>{bytes});
+    } catch (std::runtime_error const &) {
+        co_return true;
+    }
+    co_return false;
+}
+
+asio::awaitable<int> run(asio::ip::tcp::endpoint ep) {
+    auto executor = co_await asio::this_coro::executor;
+    asio::ip::tcp::socket socket{executor};
+    co_await socket.async_connect(ep, asio::use_awaitable);
+    endpoint_type endpoint{std::move(socket)};
+    endpoint.run(asio::detached);
+
+    // all the calls are suspended at once, their frames reused by none of the others
+    constexpr int callers = 8;
+    std::vector<std::string> results(callers);
+    int done = 0;
+    for (int id = 0; id < callers; ++id) {
+        asio::co_spawn(executor, describe(endpoint, id), [&, id](std::exception_ptr ex, std::string result) {
+            results[id] = ex ? "failed" : std::move(result);
+            ++done;
+        });
+    }
+    while (done < callers) {
+        asio::steady_timer timer{executor, std::chrono::milliseconds{5}};
+        co_await timer.async_wait(asio::use_awaitable);
+    }
+    endpoint.close();
+
+    for (int id = 0; id < callers; ++id) {
+        auto expected = "caller " + std::to_string(id) + "=" + std::to_string((100 + id) * id);
+        if (results[id] != expected) {
+            std::cout << "got `" << results[id] << "` instead of `" << expected << "`\n";
+            co_return 1;
+        }
+    }
+
+    if (!co_await rejects_truncated_span()) {
+        std::cout << "a truncated span was accepted\n";
+        co_return 1;
+    }
+    co_return 0;
+}
+
+int main(void) {
+    asio::io_context ctx;
+    asio::ip::tcp::acceptor acceptor{ctx, {asio::ip::make_address("127.0.0.1"), 0}};
+    asio::co_spawn(ctx, serve(acceptor), asio::detached);
+    auto result = asio::co_spawn(ctx, run(acceptor.local_endpoint()), asio::use_future);
+    ctx.run();
+    auto rc = result.get();
+    if (rc == 0) {
+        std::cout << "views stayed valid, truncated spans rejected\n";
+    }
+    return rc;
+}